@@ -0,0 +1,293 @@
+/*------------------------------------------------------------------------
+ Module:        digest.c
+ Project:       ripMIME
+ Description:   MD5 (RFC 1321) and SHA-256 (FIPS 180-4) message digests, computed
+                incrementally so that decoded parts can be fingerprinted as they
+                are written without ever being stored.
+------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "digest.h"
+
+#define ROTL32(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*-----------------------------------------------------------------\
+ MD5
+\------------------------------------------------------------------*/
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void DIGEST_md5_block( struct DIGEST_md5 *ctx, const unsigned char *p )
+{
+	uint32_t w[16];
+	uint32_t a, b, c, d, f, t;
+	int i, g;
+
+	for (i = 0; i < 16; i++)
+	{
+		w[i] = (uint32_t)p[i*4] | ((uint32_t)p[i*4+1] << 8) | ((uint32_t)p[i*4+2] << 16) | ((uint32_t)p[i*4+3] << 24);
+	}
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+
+	for (i = 0; i < 64; i++)
+	{
+		if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+		else if (i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) & 15; }
+		else if (i < 48) { f = b ^ c ^ d;          g = (3*i + 5) & 15; }
+		else             { f = c ^ (b | ~d);       g = (7*i) & 15; }
+
+		t = d;
+		d = c;
+		c = b;
+		b = b + ROTL32(a + f + md5_k[i] + w[g], md5_r[i]);
+		a = t;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+}
+
+void DIGEST_md5_init( struct DIGEST_md5 *ctx )
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->count = 0;
+}
+
+void DIGEST_md5_update( struct DIGEST_md5 *ctx, const void *data, size_t len )
+{
+	const unsigned char *p = data;
+	size_t used = ctx->count & 63;
+
+	ctx->count += len;
+
+	if (used)
+	{
+		size_t fill = 64 - used;
+
+		if (len < fill)
+		{
+			memcpy(ctx->buffer + used, p, len);
+			return;
+		}
+		memcpy(ctx->buffer + used, p, fill);
+		DIGEST_md5_block(ctx, ctx->buffer);
+		p += fill;
+		len -= fill;
+	}
+
+	while (len >= 64)
+	{
+		DIGEST_md5_block(ctx, p);
+		p += 64;
+		len -= 64;
+	}
+
+	if (len) memcpy(ctx->buffer, p, len);
+}
+
+void DIGEST_md5_final( struct DIGEST_md5 *ctx, unsigned char *digest )
+{
+	unsigned char pad[72];
+	uint64_t bits = ctx->count << 3;
+	size_t used = ctx->count & 63;
+	size_t padlen = (used < 56) ? (56 - used) : (120 - used);
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) pad[padlen + i] = (unsigned char)(bits >> (8 * i));
+	DIGEST_md5_update(ctx, pad, padlen + 8);
+
+	for (i = 0; i < 4; i++)
+	{
+		digest[i*4]   = (unsigned char)(ctx->state[i]);
+		digest[i*4+1] = (unsigned char)(ctx->state[i] >> 8);
+		digest[i*4+2] = (unsigned char)(ctx->state[i] >> 16);
+		digest[i*4+3] = (unsigned char)(ctx->state[i] >> 24);
+	}
+}
+
+/*-----------------------------------------------------------------\
+ SHA-256
+\------------------------------------------------------------------*/
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void DIGEST_sha256_block( struct DIGEST_sha256 *ctx, const unsigned char *p )
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t)p[i*4] << 24) | ((uint32_t)p[i*4+1] << 16) | ((uint32_t)p[i*4+2] << 8) | (uint32_t)p[i*4+3];
+	}
+	for (i = 16; i < 64; i++)
+	{
+		uint32_t s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = ctx->state[0];
+	b = ctx->state[1];
+	c = ctx->state[2];
+	d = ctx->state[3];
+	e = ctx->state[4];
+	f = ctx->state[5];
+	g = ctx->state[6];
+	h = ctx->state[7];
+
+	for (i = 0; i < 64; i++)
+	{
+		t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	ctx->state[0] += a;
+	ctx->state[1] += b;
+	ctx->state[2] += c;
+	ctx->state[3] += d;
+	ctx->state[4] += e;
+	ctx->state[5] += f;
+	ctx->state[6] += g;
+	ctx->state[7] += h;
+}
+
+void DIGEST_sha256_init( struct DIGEST_sha256 *ctx )
+{
+	ctx->state[0] = 0x6a09e667;
+	ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372;
+	ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f;
+	ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab;
+	ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void DIGEST_sha256_update( struct DIGEST_sha256 *ctx, const void *data, size_t len )
+{
+	const unsigned char *p = data;
+	size_t used = ctx->count & 63;
+
+	ctx->count += len;
+
+	if (used)
+	{
+		size_t fill = 64 - used;
+
+		if (len < fill)
+		{
+			memcpy(ctx->buffer + used, p, len);
+			return;
+		}
+		memcpy(ctx->buffer + used, p, fill);
+		DIGEST_sha256_block(ctx, ctx->buffer);
+		p += fill;
+		len -= fill;
+	}
+
+	while (len >= 64)
+	{
+		DIGEST_sha256_block(ctx, p);
+		p += 64;
+		len -= 64;
+	}
+
+	if (len) memcpy(ctx->buffer, p, len);
+}
+
+void DIGEST_sha256_final( struct DIGEST_sha256 *ctx, unsigned char *digest )
+{
+	unsigned char pad[72];
+	uint64_t bits = ctx->count << 3;
+	size_t used = ctx->count & 63;
+	size_t padlen = (used < 56) ? (56 - used) : (120 - used);
+	int i;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++) pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+	DIGEST_sha256_update(ctx, pad, padlen + 8);
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i*4]   = (unsigned char)(ctx->state[i] >> 24);
+		digest[i*4+1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[i*4+2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[i*4+3] = (unsigned char)(ctx->state[i]);
+	}
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: DIGEST_to_hex
+ Returns Type	: char *
+ 	----Parameter List
+	1. const unsigned char *digest,
+	2.  size_t len, length of the digest in bytes
+	3.  char *hex, buffer of at least (len *2) +1 chars
+ ------------------
+ Exit Codes	: hex
+\------------------------------------------------------------------*/
+char *DIGEST_to_hex( const unsigned char *digest, size_t len, char *hex )
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		hex[i*2]   = digits[digest[i] >> 4];
+		hex[i*2+1] = digits[digest[i] & 0x0f];
+	}
+	hex[len*2] = '\0';
+
+	return hex;
+}
+
+/*-END-----------------------------------------------------------*/
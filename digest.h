@@ -0,0 +1,35 @@
+#ifndef DIGEST
+#define DIGEST
+/* digest.h - MD5 and SHA-256 message digests for the digest output sink */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_MD5_LEN		16
+#define DIGEST_SHA256_LEN	32
+
+struct DIGEST_md5
+{
+	uint32_t state[4];
+	uint64_t count;		// bytes hashed so far
+	unsigned char buffer[64];
+};
+
+struct DIGEST_sha256
+{
+	uint32_t state[8];
+	uint64_t count;		// bytes hashed so far
+	unsigned char buffer[64];
+};
+
+void DIGEST_md5_init( struct DIGEST_md5 *ctx );
+void DIGEST_md5_update( struct DIGEST_md5 *ctx, const void *data, size_t len );
+void DIGEST_md5_final( struct DIGEST_md5 *ctx, unsigned char *digest );
+
+void DIGEST_sha256_init( struct DIGEST_sha256 *ctx );
+void DIGEST_sha256_update( struct DIGEST_sha256 *ctx, const void *data, size_t len );
+void DIGEST_sha256_final( struct DIGEST_sha256 *ctx, unsigned char *digest );
+
+char *DIGEST_to_hex( const unsigned char *digest, size_t len, char *hex );
+
+#endif
@@ -123,11 +123,22 @@ int FFGET_getnewblock( FFGET_FILE *f )
 	} else {
 		long block_pos;
 
-		block_pos = ftell(f->f); /** Get our current read position so we can use it in FFGET_ftell if required **/
+		if (f->source)
+		{
+			block_pos = f->source_pos;
+			bs = FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING;
+			if ((size_t)bs > f->source_size -f->source_pos) bs = f->source_size -f->source_pos;
+			memcpy(f->buffer, f->source +f->source_pos, bs);
+			f->source_pos += bs;
+			if (bs < (FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING)) f->FILEEND = 1;
+
+		} else {
+			block_pos = ftell(f->f); /** Get our current read position so we can use it in FFGET_ftell if required **/
 
-		bs = fread( f->buffer, 1, FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING, f->f );
+			bs = fread( f->buffer, 1, FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING, f->f );
+		}
 
-		if (bs < (FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING))
+		if ((f->FILEEND == 0)&&(bs < (FFGET_BUFFER_MAX -FFGET_BUFFER_PADDING)))
 		{
 			if (feof(f->f))
 			{
@@ -219,6 +230,9 @@ int FFGET_setstream( FFGET_FILE *f, FILE *fi )
 //	memset(f,0,sizeof(FFGET_FILE)); // be pedantic - clear the struct
 
 	f->f = fi;
+	f->source = NULL;
+	f->source_size = 0;
+	f->source_pos = 0;
 	f->bytes = 0;
 	f->linecount = 0;
 	f->endpoint = f->buffer;
@@ -238,6 +252,46 @@ int FFGET_setstream( FFGET_FILE *f, FILE *fi )
 }
 
 
+/*------------------------------------------------------------------------
+Procedure:     FFGET_setbuffer ID:1
+Purpose:       Sets an in-memory block as the source for the FFGET_FILE record
+Input:         FFGET_FILE record
+Data to read, which must stay put until the record is done with
+Size of the data
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int FFGET_setbuffer( FFGET_FILE *f, const char *source, size_t size )
+{
+	FFGET_setstream(f, NULL);
+	f->source = source;
+	f->source_size = size;
+	return 0;
+}
+
+
+/*------------------------------------------------------------------------
+Procedure:     FFGET_source_getc ID:1
+Purpose:       Reads the single char past the current block, from whichever
+source the record has.
+Input:         FFGET_FILE record
+Output:        The char, or EOF
+Errors:
+------------------------------------------------------------------------*/
+static int FFGET_source_getc( FFGET_FILE *f )
+{
+	if (f->source == NULL) return fgetc(f->f);
+	if (f->source_pos >= f->source_size) return EOF;
+	return (unsigned char)f->source[f->source_pos++];
+}
+
+static void FFGET_source_ungetc( FFGET_FILE *f, int c )
+{
+	if (f->source == NULL) ungetc(c, f->f);
+	else if (f->source_pos > 0) f->source_pos--;
+}
+
+
 /*------------------------------------------------------------------------
 Procedure:     FFGET_closestream ID:1
 Purpose:       Closes the stream contained in a FFGET record
@@ -249,6 +303,7 @@ int FFGET_closestream( FFGET_FILE *f )
 {
 	f->startpoint = f->endpoint = NULL;
 	f->f = NULL;
+	f->source = NULL;
 	return 0;
 }
 
@@ -291,7 +346,21 @@ int FFGET_seek( FFGET_FILE *f, long offset, int whence )
 	int result = 0;
 
 	/** Move to the new block location **/
-	result = fseek(f->f, offset, whence);
+	if (f->source)
+	{
+		long base = (whence == SEEK_END) ? (long)f->source_size : (whence == SEEK_CUR) ? (long)f->source_pos : 0;
+
+		if ((base +offset < 0)||(base +offset > (long)f->source_size))
+		{
+			LOGGER_log("%s:%d:FFGET_seek:ERROR: Offset %ld from %d is outside the %ld byte buffer", FL, offset, whence, (long)f->source_size);
+			return -1;
+		}
+		f->source_pos = base +offset;
+		f->FILEEND = 0;
+		f->FFEOF = 0;
+		result = 0;
+	}
+	else result = fseek(f->f, offset, whence);
 	if (result == -1) {
 		LOGGER_log("%s:%d:FFGET_seek:ERROR: While attempting to seek to offset %ld from %d - [%s]", FL, offset, whence, strerror(errno));
 		return -1;
@@ -498,7 +567,7 @@ char *FFGET_fgets( char *linein, int maxsize, FFGET_FILE *f )
 				// We have an EOL character, get 1 more from the stream to test the next character
 
 
-				nextchar = c = fgetc(f->f);
+				nextchar = c = FFGET_source_getc(f);
 				if (c==EOF)
 				{
 					//					fprintf(stderr,"EOF hit due to fgetc()\n");
@@ -606,7 +675,7 @@ char *FFGET_fgets( char *linein, int maxsize, FFGET_FILE *f )
 
 			if ((charstoCRLF >= 0)&&(charstoCRLF < max_size)) max_size = charstoCRLF;
 
-			if ((extra_char_kept == 0) && (nextchar != -1)) ungetc(nextchar,f->f);
+			if ((extra_char_kept == 0) && (nextchar != -1)) FFGET_source_ungetc(f, nextchar);
 
 		} // If CRLF pos found.
 
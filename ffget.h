@@ -27,6 +27,9 @@
 struct _FFGET_FILE
 {
 	FILE *f;
+	const char *source;		// in-memory source, see FFGET_setbuffer()
+	size_t source_size;
+	size_t source_pos;
 	char buffer[FFGET_BUFFER_MAX + 4 * sizeof(char)];
 	char *startpoint;
 	char *endpoint;
@@ -58,6 +61,7 @@ extern char *DELIMITERS;
 
 
 int FFGET_setstream( FFGET_FILE *f, FILE *fi );
+int FFGET_setbuffer( FFGET_FILE *f, const char *source, size_t size );
 #ifdef sgi
 short FFGET_fgetc( FFGET_FILE *f );
 #else
@@ -28,6 +28,7 @@
  **
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,9 +36,12 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
 
 #ifdef MEMORY_DEBUG
 #define DEBUG_MEMORY 1
@@ -49,12 +53,14 @@
 #include "ffget.h"
 #include "strstack.h"
 #include "mime_element.h"
+#include "digest.h"
 #include "mime_headers.h"
 #include "mime.h"
 #include "tnef/tnef_api.h"
 #include "ripOLE/ole.h"
 #include "libmime-decoders.h"
 #include "uuencode.h"
+#include "yenc.h"
 #include "filename-filters.h"
 #include "logger.h"
 
@@ -62,6 +68,7 @@
 int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo, int current_recursion_level, struct SS_object *ss );
 int MIME_unpack_single_diskfile( RIPMIME_output *unpack_metadata, char *mpname, int current_recursion_level, struct SS_object *ss );
 int MIME_unpack_single_file( RIPMIME_output *unpack_metadata, FILE *fi, int current_recursion_level, struct SS_object *ss );
+int MIME_unpack_single_element( RIPMIME_output *unpack_metadata, MIME_element *m, int current_recursion_level, struct SS_object *ss );
 int MIME_unpack_mailbox( RIPMIME_output *unpack_metadata, char *mpname, int current_recursion_level, struct SS_object *ss );
 int MIME_handle_multipart( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *h, int current_recursion_level, struct SS_object *ss );
 int MIME_handle_rfc822( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *h, int current_recursion_level, struct SS_object *ss );
@@ -69,6 +76,7 @@ int MIME_handle_rfc822( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMIME_
 MIME_element* MIME_decode_std_raw(  MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo);
 MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo );
 MIME_element* MIME_decode_std_64(   MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo );
+static FILE *MIME_intermediate_open( RIPMIME_output *unpack_metadata );
 
 
 // Predefined filenames
@@ -148,8 +156,10 @@ struct MIME_globals {
     int no_nameless;
     int name_by_type;
     int mailbox_format;
+    int intermediates_in_memory; // see MIME_set_intermediates_in_memory()
 
     int decode_uu;
+    int decode_yenc;
     int decode_tnef;
     int decode_b64;
     int decode_qp;
@@ -158,6 +168,19 @@ struct MIME_globals {
 
     int multiple_filenames;
 
+    int discard_part; // the part about to be decoded goes to MIME_sink_discard, see MIME_part_add()
+    int part_keyed; // part_key is the dedup store key of the part about to be decoded, see MIME_span_read()
+    unsigned char part_key[DIGEST_SHA256_LEN];
+    int reparse_part; // the part being decoded is a message to be unpacked in turn, see MIME_part_kept()
+
+    // Header-time part filters, comma separated lists, empty when not set.
+    //  See MIME_part_wanted()
+    char include_types[_MIME_STRLEN_MAX +1];
+    char exclude_types[_MIME_STRLEN_MAX +1];
+    char include_extensions[_MIME_STRLEN_MAX +1];
+    char exclude_extensions[_MIME_STRLEN_MAX +1];
+    char include_dispositions[_MIME_STRLEN_MAX +1];
+
     int header_longsearch;
     int max_recursion_level;
 
@@ -251,6 +274,7 @@ int MIME_set_debug( int level )
     MIMEH_set_debug(level);
     MDECODE_set_debug(level);
     UUENCODE_set_debug(level);
+    YENC_set_debug(level);
     FNFILTER_set_debug(level);
     MIMEELEMENT_set_debug(level);
     return glb.debug;
@@ -345,6 +369,29 @@ int MIME_set_decode_uudecode( int level )
     return glb.decode_uu;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_decode_yenc
+  Returns Type  : int
+  ----Parameter List
+  1. int level ,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_decode_yenc( int level )
+{
+    glb.decode_yenc = level;
+    YENC_set_decode( level );
+
+    return glb.decode_yenc;
+}
+
 /*-----------------------------------------------------------------\
   Function Name : MIME_set_decode_base64
   Returns Type  : int
@@ -509,6 +556,7 @@ int MIME_set_verbosity( int level )
     TNEF_set_verbosity( level );
     FNFILTER_set_verbose( level );
     UUENCODE_set_verbosity( level );
+    YENC_set_verbosity( level );
     MDECODE_set_verbose( level );
     BS_set_verbose( level );
     return 0;
@@ -556,6 +604,7 @@ int MIME_set_verbosity_contenttype( int level )
     glb.verbosity_contenttype = level;
     MIMEH_set_verbosity_contenttype( level );
     UUENCODE_set_verbosity_contenttype( level );
+    YENC_set_verbosity_contenttype( level );
     TNEF_set_verbosity_contenttype( level );
     return glb.verbosity_contenttype;
 }
@@ -623,6 +672,7 @@ int MIME_set_filename_report_fn( int (*ptr_to_fn)(char *, char *) )
 {
     glb.filename_decoded_reporter = ptr_to_fn;
     UUENCODE_set_filename_report_fn( ptr_to_fn );
+    YENC_set_filename_report_fn( ptr_to_fn );
     TNEF_set_filename_report_fn( ptr_to_fn );
 
     return 0;
@@ -800,6 +850,142 @@ int MIME_set_no_nameless( int level )
     return 0;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_filter_list
+  Returns Type  : int
+  ----Parameter List
+  1. char *dest, one of the glb filter lists
+  2. char *list, comma separated, or NULL to clear the filter
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Filter lists are stored lower-cased, as content-types, file name
+extensions and dispositions are all compared without regard to case.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_set_filter_list( char *dest, char *list )
+{
+    char *p;
+
+    if (list == NULL) list = "";
+    PLD_strncpy( dest, list, _MIME_STRLEN_MAX );
+    for (p = dest; *p; p++) *p = tolower((int)*p);
+
+    return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_include_types
+  Returns Type  : int
+  ----Parameter List
+  1. char *globs, content-type patterns, comma separated, in which a
+     trailing '*' matches any subtype (e.g. the "image/" prefix)
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Only parts whose content-type matches one of the patterns are decoded.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_include_types( char *globs )
+{
+    return MIME_set_filter_list( glb.include_types, globs );
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_exclude_types
+  Returns Type  : int
+  ----Parameter List
+  1. char *globs, content-type patterns as for MIME_set_include_types()
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Parts whose content-type matches one of the patterns are skipped.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_exclude_types( char *globs )
+{
+    return MIME_set_filter_list( glb.exclude_types, globs );
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_include_extensions
+  Returns Type  : int
+  ----Parameter List
+  1. char *extensions, file name extensions such as "pdf,doc,xls"
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Only parts whose file name ends in one of the extensions are decoded.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_include_extensions( char *extensions )
+{
+    return MIME_set_filter_list( glb.include_extensions, extensions );
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_exclude_extensions
+  Returns Type  : int
+  ----Parameter List
+  1. char *extensions, file name extensions such as "exe,scr"
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Parts whose file name ends in one of the extensions are skipped.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_exclude_extensions( char *extensions )
+{
+    return MIME_set_filter_list( glb.exclude_extensions, extensions );
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_set_include_dispositions
+  Returns Type  : int
+  ----Parameter List
+  1. char *dispositions, any of "inline,attachment,formdata,none"
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Only parts with one of the listed content-dispositions are decoded,
+"none" standing for parts without a (recognised) disposition.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_set_include_dispositions( char *dispositions )
+{
+    return MIME_set_filter_list( glb.include_dispositions, dispositions );
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_set_noparanoid ID:1
 Purpose:       If set, will prevent MIME from clobbering what it considers
@@ -831,6 +1017,25 @@ int MIME_set_mailboxformat( int level )
     return 0;
 }
 
+/*------------------------------------------------------------------------
+Procedure:     MIME_set_intermediates_in_memory ID:1
+Purpose:       Keeps the files ripMIME only creates to read back again -
+the per-message mailpacks of mailbox mode and the doubleCR
+sections - off the filesystem.  The mailpacks go to an
+anonymous memfd, or failing that an unlinked file in the
+directory set by MIME_set_tmpdir() (which may be a tmpfs),
+and the doubleCR sections to the scratch sink.
+Input:
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int MIME_set_intermediates_in_memory( int level )
+{
+    glb.intermediates_in_memory = level;
+    MIMEH_set_doubleCR_in_memory( level );
+    return glb.intermediates_in_memory;
+}
+
 /*-----------------------------------------------------------------\
   Function Name : MIME_get_header_defect_count
   Returns Type  : int
@@ -968,6 +1173,32 @@ int MIME_is_diskfile_RFC822( char *fname )
     return result == 1;
 }
 
+/*------------------------------------------------------------------------
+Procedure:     MIME_is_element_RFC822
+Purpose:       Determines if a decoded part is itself a MIME type email, reading
+it back from wherever the part was decoded to (disk or memory).
+Input:         MIME_element *m: decoded part to analyze
+Output:        Returns 0 for NO, 1 for YES
+Errors:
+------------------------------------------------------------------------*/
+int MIME_is_element_RFC822( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+    int result = 0;
+    FILE *f;
+
+    f = MIME_element_open_read(m, unpack_metadata);
+    if (!f)
+    {
+        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: No decoded content to test for RFC822 headers",FL,__func__);
+        return 0;
+    }
+    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Testing %s for RFC822 headers",FL,__func__,m->fullpath);
+
+    result = MIME_is_file_RFC822(f);
+    fclose(f);
+    return result == 1;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_getchar_start ID:1
 Purpose:       This function is used on a once-off basis. It's purpose is to locate a
@@ -1003,18 +1234,29 @@ Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-int MIME_decode_TNEF( RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
+int MIME_decode_TNEF( RIPMIME_output *unpack_metadata, MIME_element *m )
 {
-    int result = TNEF_main( hinfo->filename, unpack_metadata->dir );
+    int result;
+    MIME_element *parent;
+    const char *tnef;
+    size_t len;
 
-    if (result >= 0)
+    if ((m == NULL)||(!TNEF_is_signature(m->head, m->head_l)))
     {
-        //      result = remove( fullpath );
-        if (result == -1)
-        {
-            if (MIME_VERBOSE) LOGGER_log("%s:%d:%s: Removing %s/%s failed (%s)",FL,__func__,hinfo->filename, unpack_metadata->dir,strerror(errno));
-        }
+        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: No TNEF signature, not decoding",FL,__func__);
+        return 0;
     }
+
+    // The TNEF attachments go out through the same sink as everything else,
+    // the TNEF stream itself is walked in place
+    tnef = MIME_element_map(m, unpack_metadata, &len);
+    if (tnef == NULL) return 0;
+
+    parent = MIME_element_set_parent(m);
+    result = TNEF_decode_buffer( tnef, len, unpack_metadata );
+    MIME_element_set_parent(parent);
+    MIME_element_unmap(m, tnef, len);
+
     return result;
 }
 
@@ -1026,30 +1268,36 @@ int MIME_report_filename_decoded_RIPOLE(char *filename)
 }
 
 /*-----------------------------------------------------------------\
-  Function Name : MIME_decode_OLE_diskfile
+  Function Name : MIME_decode_OLE_element
   Returns Type  : int
   ----Parameter List
   1. RIPMIME_output *unpack_metadata,
-  2.  struct MIMEH_header_info *hinfo,
+  2.  MIME_element *m, decoded part to look inside
   ------------------
   Exit Codes    :
   Side Effects  :
   --------------------------------------------------------------------
 Comments:
+The part is used from wherever it was decoded to, memory or a mapped
+file, so this works the same in directory and in-memory modes and the
+sectors are never read through a FILE.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int MIME_decode_OLE_diskfile( RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
+int MIME_decode_OLE_element( RIPMIME_output *unpack_metadata, MIME_element *m )
 {
     struct OLE_object ole;
     int result;
-    char *fn;
-    int fn_l = strlen(unpack_metadata->dir) + strlen(hinfo->filename) + sizeof(char) * 2;
+    MIME_element *parent;
+    const char *image;
+    size_t len;
+
+    if ((m == NULL)||(!OLE_is_signature(m->head, m->head_l))) return 0;
 
-    fn = malloc(fn_l);
-    snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,hinfo->filename);
+    image = MIME_element_map(m, unpack_metadata, &len);
+    if (image == NULL) return 0;
 
     OLE_init(&ole);
     OLE_set_quiet(&ole,glb.quiet);
@@ -1059,12 +1307,12 @@ int MIME_decode_OLE_diskfile( RIPMIME_output *unpack_metadata, struct MIMEH_head
     OLE_set_filename_report_fn(&ole, MIME_report_filename_decoded_RIPOLE );
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Starting OLE Decode",FL,__func__);
-    result = OLE_decode_diskfile(&ole, fn, unpack_metadata );
-    free(fn);
+    parent = MIME_element_set_parent(m);
+    result = OLE_decode_buffer(&ole, (const unsigned char *)image, len, unpack_metadata );
+    MIME_element_set_parent(parent);
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decode done, cleaning up.",FL,__func__);
     OLE_decode_done(&ole);
-    if (ole.f)
-        fclose(ole.f);
+    MIME_element_unmap(m, image, len);
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decode returned with code = %d",FL,__func__,result);
     return result;
@@ -1094,6 +1342,141 @@ int MIME_decode_OLE_file( RIPMIME_output *unpack_metadata, FILE *f )
 #endif
 
 
+/*-----------------------------------------------------------------\
+  Function Name : MIME_is_buffer_RFC822
+  Returns Type  : int
+  ----Parameter List
+  1. const char *buf, start of a decoded part
+  2. size_t len,
+  3. int final, buf is the whole part
+  ------------------
+  Exit Codes    : as MIME_is_file_RFC822(), or -1 if buf does not yet
+                  hold all the lines that would read
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Lets a sink which is not keeping the part find out whether
+MIME_is_element_RFC822() would want it, from no more of the part than
+the first 100 lines.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_is_buffer_RFC822( const char *buf, size_t len, int final )
+{
+    const char *p = buf;
+    const char *end = buf +len;
+    int lines = 0;
+    int done = 0;
+    int result;
+    FILE *f;
+
+    // Walk the lines as MIME_is_file_RFC822() would fgets() them
+    while ((p < end)&&(!done))
+    {
+        const char *eol = memchr(p, '\n', end -p);
+        size_t l = (eol) ? (size_t)(eol -p) +1 : (size_t)(end -p);
+
+        if (l > 1023) l = 1023;
+        else if (eol == NULL) break;
+        if ((glb.header_longsearch == 0)&&(*p == '\n' || *p == '\r')) done = 1;
+        else if (++lines == 100) done = 1;
+        p += l;
+    }
+    if ((!done)&&(!final)) return -1;
+    if (len == 0) return 0;
+
+    f = fmemopen((void *)buf, len, "r");
+    if (f == NULL) return 1;
+    result = MIME_is_file_RFC822(f);
+    fclose(f);
+    return result == 1;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_part_kept
+  Returns Type  : int
+  ----Parameter List
+  1. MIME_element *m, part being written, what there is of it so far
+                      in m->mem_filearea
+  2. int final, the part is complete
+  ------------------
+  Exit Codes    : 1 if the post-decoders will read the part back, 0 if
+                  not, -1 if it cannot yet tell
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+The keep test for the sinks which otherwise do not hold on to a part
+(see MIME_element_set_keep_test()).  TNEF and OLE are known by their
+signatures and MHT by its name; a message for MIME_is_element_RFC822()
+has to wait for the lines it would read.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_part_kept( MIME_element *m, int final )
+{
+    const unsigned char *buf = (const unsigned char *)m->mem_filearea;
+    size_t len = m->mem_filearea_l;
+
+    if (glb.reparse_part) return 1;
+    if ((m->content_type_string)&&(strncasecmp(m->content_type_string, "message/", strlen("message/")) == 0)) return 1;
+    if (TNEF_is_signature(buf, len)) return 1;
+#ifdef RIPOLE
+    if ((glb.decode_ole > 0)&&(OLE_is_signature(buf, len))) return 1;
+#endif
+    if ((glb.decode_mht != 0)&&(((m->filename)&&(strstr(m->filename,".mht")))||((m->name)&&(strstr(m->name,".mht"))))) return 1;
+
+    return MIME_is_buffer_RFC822(m->mem_filearea, len, final);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_part_add
+  Returns Type  : MIME_element *
+  ----Parameter List
+  1. RIPMIME_output *unpack_metadata,
+  2. struct MIMEH_header_info *hinfo, headers of the part being decoded
+  3. const char *func, caller, for error reporting
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Creates the element a decoder writes the part to.  Nameless parts
+which --no-nameless doesn't want go to the discard sink, which keeps
+only those the RFC822, TNEF and OLE post-decoders are going to look
+inside, and only until they have.  Whatever those find is written
+out as normal.
+
+Decoders which need do nothing more than close a part the dedup store
+already has say so with keyed.  If MIME_process_content_transfer_encoding()
+has keyed the part (see MIME_span_read()), it then goes through the
+store sink, and is looked up there before the decoder sees it.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static MIME_element *MIME_part_add( MIME_element *parent, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo, int keyed, const char *func )
+{
+    const struct mime_sink *sink = unpack_metadata->sink;
+    MIME_element *cur_mime;
+
+    keyed = (keyed)&&(glb.part_keyed)&&(!glb.discard_part);
+    if (glb.discard_part) unpack_metadata->sink = &MIME_sink_discard;
+    else if (keyed) unpack_metadata->sink = &MIME_sink_store;
+    glb.discard_part = 0;
+    glb.part_keyed = 0;
+
+    cur_mime = MIME_element_add (parent, unpack_metadata, hinfo->filename, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, glb.attachment_count, glb.filecount, func);
+    unpack_metadata->sink = sink;
+    if (keyed) MIME_element_store_key(cur_mime, glb.part_key);
+
+    return cur_mime;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_decode_std_raw ID:1
 Purpose:       Decodes a binary type attachment, ie, no encoding, just raw data.
@@ -1104,11 +1487,12 @@ Errors:
 MIME_element* MIME_decode_std_raw(MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo)
 {
     int result = 0;
+    int uu_result = 0;
     int bufsize=1024;
     char *buffer = malloc((bufsize + 1)*sizeof(char));
     size_t readcount;
-    int file_has_uuencode = 0;
-    int decode_entire_file = 0;
+    struct UUENCODE_inline uu;
+    struct YENC_inline yenc;
     MIME_element* cur_mime = NULL;
 
     /* Decoding / reading a binary attachment is a real interesting situation, as we
@@ -1120,78 +1504,60 @@ MIME_element* MIME_decode_std_raw(MIME_element* parent, FFGET_FILE *f, RIPMIME_o
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Start\n",FL,__func__);
 
-    cur_mime = MIME_element_add (NULL, unpack_metadata, hinfo->filename, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, glb.attachment_count, glb.filecount, __func__);
+    cur_mime = MIME_part_add (parent, unpack_metadata, hinfo, 0, __func__);
+    cur_mime->held = 1; // released by the caller once the post-decoders have seen it
+
+    // Any UUEncoded portions are pulled out as the data goes past;
+    //  only the first one, as this may well be an x-uuencode stream.
+    //  uudec_name may still hold the name from an earlier part.
+    hinfo->uudec_name[0] = '\0';
+    UUENCODE_inline_init(&uu, hinfo->uudec_name, 0, unpack_metadata, hinfo);
+    YENC_inline_init(&yenc, unpack_metadata, hinfo);
 
     while ((readcount=FFGET_raw(f, (unsigned char *) buffer,bufsize)) > 0)
     {
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: BUFFER[%p]= '%s'\n",FL,__func__,buffer, buffer);
 
-        if ((!file_has_uuencode)&&(UUENCODE_is_uuencode_header( buffer )))
-        {
-            if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: File contains UUENCODED data(%s)\n",FL,__func__,buffer);
-            file_has_uuencode = 1;
-        }
-
         if (BS_cmp(buffer, readcount))
         {
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Boundary located - breaking out.\n",FL,__func__);
             break;
         } else {
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: writing: %s\n",FL,__func__, buffer);
-            fwrite( buffer, readcount, 1, cur_mime->f);
+            MIME_element_write(cur_mime, buffer, readcount);
+            if ((cur_mime->opened)||(cur_mime->discarded))
+            {
+                UUENCODE_inline_write(&uu, buffer, readcount);
+                YENC_inline_write(&yenc, buffer, readcount);
+            }
+            if (MIME_element_budget_exceeded()) break;
         }
     }
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Completed reading RAW data\n",FL,__func__);
     free(buffer);
+    uu_result = UUENCODE_inline_done(&uu);
+    glb.attachment_count += YENC_inline_done(&yenc);
+    MIME_element_deactivate(cur_mime, unpack_metadata);
 
-    // If there was UUEncoded portions [potentially] in the email, the
-    // try to extract them using the MIME_decode_uu()
-    if (file_has_uuencode)
+    if (uu.found)
     {
-        FFGET_FILE * ffg = NULL;
-
-        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding UUencoded data\n",FL,__func__);
-        if ( hinfo->content_transfer_encoding == _CTRANS_ENCODING_UUENCODE ) decode_entire_file = 0;
-
-        ffg = UUENCODE_make_sourcestream(cur_mime->f); /* fseek to begin is here */
-        result = UUENCODE_decode_uu(ffg , hinfo->uudec_name, decode_entire_file, unpack_metadata, hinfo );
-        if (result == -1)
+        if (uu_result == -1)
         {
-            switch (uuencode_error) {
-                case UUENCODE_STATUS_SHORT_FILE:
-                case UUENCODE_STATUS_CANNOT_OPEN_FILE:
-                case UUENCODE_STATUS_CANNOT_FIND_FILENAME:
-                    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Nullifying uuencode_error result %d",FL,__func__, uuencode_error);
-                    result = 0;
-                    break;
-
-                case UUENCODE_STATUS_CANNOT_ALLOCATE_MEMORY:
-                    LOGGER_log("%s:%d:%s:ERROR: Failure to allocate memory for UUdecode process",FL,__func__);
-                    cur_mime->decode_result_code = -1;
-                    return cur_mime;
-                    break;
-
-                default:
-                    LOGGER_log("%s:%d:%s:ERROR: Unknown return code from UUDecode process [%d]",FL,__func__,uuencode_error);
-                    cur_mime->decode_result_code = -1;
-                    return cur_mime;
-            }
+            if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Nullifying uuencode_error result %d",FL,__func__, uuencode_error);
+            uu_result = 0;
         }
-        if (result == UUENCODE_STATUS_SHORT_FILE) result = 0;
-        glb.attachment_count += result;
+        glb.attachment_count += uu_result;
         if (strlen(hinfo->uudec_name))
         {
             if (strcasecmp(hinfo->uudec_name,"winmail.dat")==0)
             {
                 if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding TNEF format\n",FL,__func__);
-                snprintf(hinfo->filename, 128, "%s", hinfo->uudec_name);
-                MIME_decode_TNEF( unpack_metadata, hinfo);
+                MIME_decode_TNEF( unpack_metadata, MIME_element_find(hinfo->uudec_name) );
             }
             else LOGGER_log("%s:%d:%s:WARNING: hinfo has been clobbered.\n",FL,__func__);
         }
     }
-    MIME_element_deactivate(cur_mime, unpack_metadata);
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Closed file and free'd buffer\n",FL,__func__);
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: End[result = %d]\n",FL,__func__,result);
@@ -1210,17 +1576,26 @@ Errors:
 MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
 {
     int linecount = 0;                  // The number of lines
-    int file_has_uuencode = 0;          // Flag to indicate this text has UUENCODE in it
     char line[1024];                    // The input lines from the file we're decoding
     char *get_result = &line[0];
     int lastlinewasboundary = 0;
     int result = 0;
+    int uu_result = 0;
     int decodesize=0;
+    struct UUENCODE_inline uu;
+    struct YENC_inline yenc;
     MIME_element* cur_mime = NULL;
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding TEXT [encoding=%d] to %s\n",FL,__func__, hinfo->content_transfer_encoding, hinfo->filename);
 
-    cur_mime = MIME_element_add (NULL, unpack_metadata, hinfo->filename, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, glb.attachment_count, glb.filecount, __func__);
+    cur_mime = MIME_part_add (parent, unpack_metadata, hinfo, 1, __func__);
+    cur_mime->held = 1; // released by the caller once the post-decoders have seen it
+    if (cur_mime->stored)
+    {
+        MIME_element_deactivate(cur_mime, unpack_metadata);
+        cur_mime->decode_result_code = 0;
+        return cur_mime;
+    }
     if (!f)
     {
         /** If we cannot open the file for reading, leave an error and return -1 **/
@@ -1228,10 +1603,33 @@ MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME
         cur_mime->decode_result_code = _EXITERR_MIMEREAD_CANNOT_OPEN_INPUT;
         return cur_mime;
     }
+
+    // Any UUEncoded portions of the text are decoded as the lines go by.
+    //      NOTE - hinfo->uudec_name is a blank buffer which will be filled in once
+    //          a filename is located in the UUENCODED data.  A bit of a problem here
+    //          is that it can only hold ONE filename!
+    //
+    // PLD-20040627-1212
+    // Make sure uudec_name is blank too
+    //
+    hinfo->uudec_name[0] = '\0';
+    UUENCODE_inline_init(&uu, hinfo->uudec_name, 1, unpack_metadata, hinfo);
+    // and likewise yEnc, which news gateways pass through
+    YENC_inline_init(&yenc, unpack_metadata, hinfo);
+
     if (f)
     {
-        while ((get_result = FFGET_fgets(line,1023,f))&&(cur_mime->f))
+        MIME_element *enclosing = MIME_element_set_parent(cur_mime);
+
+        // Once the part has been aborted (part_data handler) the rest of it
+        //  is still read, up to the boundary, but not decoded.  A part which
+        //  is only too large to keep is still decoded for the uuencoded and
+        //  yEnc files inside it, which have size limits of their own.
+        //  Going over a budget abandons the message, so there we stop at once.
+        while ((get_result = FFGET_fgets(line,1023,f)))
         {
+            if (MIME_element_budget_exceeded()) break;
+
             int line_len = strlen(line);
             linecount++;
             //      if (MIME_DPEDANTIC) LOGGER_log("%s:%d:%s:DEBUG: line=%s",FL,__func__,line);
@@ -1249,22 +1647,20 @@ MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME
                 }
             }
 
-            if (lastlinewasboundary == 0)
+            if ((lastlinewasboundary == 0)&&((cur_mime->opened)||(cur_mime->discarded)))
             {
                 if (hinfo->content_transfer_encoding == _CTRANS_ENCODING_QP)
                 {
                     if (MIME_DNORMAL) LOGGER_log("%s:%d:MIME_DNORMAL:DEBUG: Hit a boundary on the line",FL,__func__);
                     decodesize = MDECODE_decode_qp_text(line);
-                    fwrite(line, 1, decodesize, cur_mime->f);
+                    MIME_element_write(cur_mime, line, decodesize);
+                    UUENCODE_inline_write(&uu, line, decodesize);
+                    YENC_inline_write(&yenc, line, decodesize);
 
                 } else {
-                    fprintf(cur_mime->f,"%s",line);
-                }
-
-                if ((!file_has_uuencode)&&( UUENCODE_is_uuencode_header( line )))
-                {
-                    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: UUENCODED data located in file.\n",FL,__func__);
-                    file_has_uuencode = 1;
+                    MIME_element_write(cur_mime, line, line_len);
+                    UUENCODE_inline_write(&uu, line, line_len);
+                    YENC_inline_write(&yenc, line, line_len);
                 }
             }
             //  linecount++;
@@ -1272,6 +1668,9 @@ MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME
         } // while
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done writing output file '%s'...now attempting to close.",FL,__func__, cur_mime->fullpath);
 
+        uu_result = UUENCODE_inline_done(&uu);
+        glb.attachment_count += YENC_inline_done(&yenc);
+        MIME_element_set_parent(enclosing);
         MIME_element_deactivate(cur_mime, unpack_metadata);
 
         if (linecount == 0)
@@ -1292,67 +1691,23 @@ MIME_element* MIME_decode_std_text( MIME_element* parent, FFGET_FILE *f, RIPMIME
         result = MIME_ERROR_FFGET_EMPTY; // 20040305-1323:PLD
     }
 
-    // If there was UUEncoded portions [potentially] in the email, the
-    // try to extract them using the MIME_decode_uu()
-    //
-    if (file_has_uuencode)
+    //      NOTE - the uudecoder gives the NUMBER of attachments it decoded!  Don't
+    //          propergate this value unintentionally to parent functions (ie, if you were thinking it was
+    //          an error-status return value
+    if (uu.found)
     {
-        FILE *fuue = NULL;
-        FFGET_FILE * ffg = NULL;
-        char *fn;
-        int fn_l = strlen(unpack_metadata->dir) + strlen(hinfo->filename) + sizeof(char) * 2;
-
-        fn = malloc(fn_l);
-        snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,hinfo->filename);
-
-        // PLD-20040627-1212
-        // Make sure uudec_name is blank too
-        //
-        hinfo->uudec_name[0] = '\0';
-        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding UUencoded data in file '%s'\n",FL,__func__,hinfo->filename);
-        //result = UUENCODE_decode_uu( NULL, info->filename, hinfo->uudec_name, 1 );
-        // Attempt to decode the UUENCODED data in the file,
-        //      NOTE - hinfo->uudec_name is a blank buffer which will be filled by the UUENCODE_decode_uu
-        //          function once it has located a filename in the UUENCODED data.  A bit of a problem here
-        //          is that it can only hold ONE filename!
-        //
-        //      NOTE - this function returns the NUMBER of attachments it decoded in the return value!  Don't
-        //          propergate this value unintentionally to parent functions (ie, if you were thinking it was
-        //          an error-status return value
-        fuue = UUENCODE_make_file_obj (fn);
-        free(fn);
-        ffg = UUENCODE_make_sourcestream(fuue);
-
-        result = UUENCODE_decode_uu( ffg, hinfo->uudec_name, 1, unpack_metadata, hinfo );
-        fclose(fuue);
-        if (result == -1)
+        if (uu_result == -1)
         {
-            switch (uuencode_error) {
-                case UUENCODE_STATUS_SHORT_FILE:
-                case UUENCODE_STATUS_CANNOT_OPEN_FILE:
-                case UUENCODE_STATUS_CANNOT_FIND_FILENAME:
-                    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Nullifying uuencode_error result %d",FL,__func__, uuencode_error);
-                    result = 0;
-                    break;
-                case UUENCODE_STATUS_CANNOT_ALLOCATE_MEMORY:
-                    LOGGER_log("%s:%d:%s:ERROR: Failure to allocate memory for UUdecode process",FL,__func__);
-                    cur_mime->decode_result_code = -1;
-                    return cur_mime;
-                    break;
-                default:
-                    LOGGER_log("%s:%d:%s:ERROR: Unknown return code from UUDecode process [%d]",FL,__func__,uuencode_error);
-                    cur_mime->decode_result_code = -1;
-                    return cur_mime;
-            }
+            if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Nullifying uuencode_error result %d",FL,__func__, uuencode_error);
+            uu_result = 0;
         }
-        if ( result > 0 ) { glb.attachment_count += result; result = 0; }
+        glb.attachment_count += uu_result;
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: hinfo = %p\n",FL,__func__,hinfo);
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done. [ UUName = '%s' ]\n",FL,__func__,hinfo->uudec_name);
         if (strncasecmp(hinfo->uudec_name,"winmail.dat",11)==0)
         {
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding TNEF format\n",FL,__func__);
-            snprintf(hinfo->filename, 128, "%s", hinfo->uudec_name);
-            MIME_decode_TNEF( unpack_metadata, hinfo );
+            MIME_decode_TNEF( unpack_metadata, MIME_element_find(hinfo->uudec_name) );
         }
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Completed decoding UUencoded data.\n",FL,__func__);
     }
@@ -1403,12 +1758,19 @@ MIME_element* MIME_decode_std_64( MIME_element* parent, FFGET_FILE *f, RIPMIME_o
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: attempting to decode '%s'", FL,__func__, hinfo->filename);
 
-    cur_mime = MIME_element_add (NULL, unpack_metadata, hinfo->filename, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, glb.attachment_count, glb.filecount, __func__);
-    if (cur_mime->f == NULL)
+    cur_mime = MIME_part_add (parent, unpack_metadata, hinfo, 1, __func__);
+    cur_mime->held = 1; // released by the caller once the post-decoders have seen it
+    if (!cur_mime->opened)
     {
         cur_mime->decode_result_code = -1;
         return cur_mime;
     }
+    if (cur_mime->stored)
+    {
+        MIME_element_deactivate(cur_mime, unpack_metadata);
+        cur_mime->decode_result_code = MIME_BASE64_STATUS_HIT_BOUNDARY;
+        return cur_mime;
+    }
 
     // Allocate the write buffer.  By using the write buffer we gain an additional 10% in performance
     // due to the lack of function call (fwrite) overheads
@@ -1556,7 +1918,7 @@ MIME_element* MIME_decode_std_64( MIME_element* parent, FFGET_FILE *f, RIPMIME_o
             {
                 if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: input stream broken for base64 decoding for file %s. %ld bytes of data in buffer to be written out\n",FL,__func__,hinfo->filename,wbcount);
                 status = MIME_ERROR_B64_INPUT_STREAM_EOF;
-                fwrite(writebuffer, 1, wbcount, cur_mime->f);
+                MIME_element_write(cur_mime, writebuffer, wbcount);
                 MIME_element_deactivate(cur_mime, unpack_metadata);
                 if (writebuffer)
                    free(writebuffer);
@@ -1626,7 +1988,13 @@ MIME_element* MIME_decode_std_64( MIME_element* parent, FFGET_FILE *f, RIPMIME_o
             //  interrupt costs.
             if ( wbcount > _MIME_WRITE_BUFFER_LIMIT )
             {
-                fwrite(writebuffer, 1, wbcount, cur_mime->f);
+                if ((MIME_element_write(cur_mime, writebuffer, wbcount) != 0)&&(MIME_element_budget_exceeded()))
+                {
+                    MIME_element_deactivate(cur_mime, unpack_metadata);
+                    free(writebuffer);
+                    cur_mime->decode_result_code = MIME_ERROR_BUDGET_EXCEEDED;
+                    return cur_mime;
+                }
                 wbpos = writebuffer;
                 wbcount = 0;
             }
@@ -1649,7 +2017,7 @@ MIME_element* MIME_decode_std_64( MIME_element* parent, FFGET_FILE *f, RIPMIME_o
             //  we'll end up with truncated files.
             if (wbcount > 0)
             {
-                fwrite(writebuffer, 1, wbcount, cur_mime->f);
+                MIME_element_write(cur_mime, writebuffer, wbcount);
             }
             /* close the output file, we're done writing to it */
             MIME_element_deactivate(cur_mime, unpack_metadata);
@@ -1678,33 +2046,545 @@ MIME_element* MIME_decode_std_64( MIME_element* parent, FFGET_FILE *f, RIPMIME_o
 }
 
 /*-----------------------------------------------------------------\
-  Function Name : MIME_decode_std_64_cleanup
+  Function Name : MIME_decode_std_64_cleanup
+  Returns Type  : int
+  ----Parameter List
+  1. FFGET_FILE *f,
+  2.  RIPMIME_output *unpack_metadata,
+  3.  struct MIMEH_header_info *hinfo,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_decode_std_64_cleanup( FFGET_FILE *f)
+{
+    int result = 0;
+    char buffer[128];
+
+    while (FFGET_fgets(buffer, sizeof(buffer), f))
+    {
+        if (FFGET_feof(f) != 0) break;
+        if (BS_cmp(buffer,strlen(buffer)) > 0) break;
+    }
+    return result;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_skip_estimate
+  Returns Type  : size_t
+  ----Parameter List
+  1. char *line, an encoded line of the part
+  2. size_t line_len,
+  3. int encoding, the part's _CTRANS_ENCODING_*
+  ------------------
+  Comments:
+  How many bytes the line would decode to, without decoding it.  The
+  BASE64 and UUENCODE figures are exact for well formed input, QP
+  only discounts the escapes and soft line breaks.
+
+  --------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static size_t MIME_skip_estimate( char *line, size_t line_len, int encoding )
+{
+    size_t decoded = 0;
+    size_t i;
+
+    switch (encoding) {
+        case _CTRANS_ENCODING_B64:
+            for (i = 0; i < line_len; i++)
+            {
+                if ((isalnum((int)line[i]))||(line[i] == '+')||(line[i] == '/')) decoded++;
+            }
+            return (decoded *3) /4;
+
+        case _CTRANS_ENCODING_QP:
+            decoded = line_len;
+            for (i = 0; i < line_len; i++)
+            {
+                if (line[i] != '=') continue;
+                if ((i +1 < line_len)&&((line[i +1] == '\n')||(line[i +1] == '\r')))
+                {
+                    // soft line break, nothing of the line ending survives
+                    return decoded -(line_len -i);
+                }
+                if (decoded >= 2) decoded -= 2;
+                i += 2;
+            }
+            return decoded;
+
+        case _CTRANS_ENCODING_UUENCODE:
+            if ((strncmp(line,"begin ",6) == 0)||(strncmp(line,"end",3) == 0)) return 0;
+            if ((line[0] < ' ')||(line[0] > '`')) return 0;
+            return (line[0] -' ') &0x3f;
+
+        default:
+            return line_len;
+    }
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_skip_lines
+  Returns Type  : int
+  ----Parameter List
+  1. FFGET_FILE *f, stream we're reading from
+  2. int encoding, the part's _CTRANS_ENCODING_*
+  3. size_t *encoded_size, returns the bytes read, without the boundary
+  4. size_t *decoded_size, returns the estimated decoded size
+  ------------------
+  Exit Codes    : 0 on reaching the boundary, MIME_STATUS_ZERO_FILE if
+                  there was nothing to read, MIME_ERROR_FFGET_EMPTY if the
+                  input ran out first (as for MIME_decode_std_text())
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Reads up to and including the next boundary, decoding nothing.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_skip_lines( FFGET_FILE *f, int encoding, size_t *encoded_size, size_t *decoded_size )
+{
+    char line[1024];
+    char *get_result;
+    int linecount = 0;
+
+    *encoded_size = 0;
+    *decoded_size = 0;
+
+    while ((get_result = FFGET_fgets(line,1023,f)))
+    {
+        size_t line_len = strlen(line);
+
+        linecount++;
+        if ((line[0] == '-')&&(BS_count() > 0)&&(BS_cmp(line,line_len))) break;
+
+        *encoded_size += line_len;
+        *decoded_size += MIME_skip_estimate(line, line_len, encoding);
+    }
+
+    if (linecount == 0) return MIME_STATUS_ZERO_FILE;
+    if (!get_result) return MIME_ERROR_FFGET_EMPTY;
+    return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     MIME_skip_part ID:1
+Purpose:       Metadata-only stand-in for the decoders, used when listing
+the mailpack (-l).  Reads up to the next boundary without
+decoding anything, recording how large the part is as
+found in the mailpack and an estimate of its decoded size.
+Input:         FFGET_FILE *f: stream we're reading from
+RIPMIME_output *unpack_metadata:
+struct MIMEH_header_info *hinfo: information from the part's headers
+Output:        The part's element, decode_result_code as for MIME_decode_std_text()
+Errors:
+------------------------------------------------------------------------*/
+MIME_element* MIME_skip_part( MIME_element* parent, FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
+{
+    MIME_element* cur_mime = NULL;
+
+    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Skipping [encoding=%d] %s\n",FL,__func__, hinfo->content_transfer_encoding, hinfo->filename);
+
+    cur_mime = MIME_element_add (parent, unpack_metadata, hinfo->filename, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, glb.attachment_count, glb.filecount, __func__);
+    cur_mime->decode_result_code = MIME_skip_lines(f, hinfo->content_transfer_encoding, &(cur_mime->encoded_size), &(cur_mime->size));
+    MIME_element_deactivate(cur_mime, unpack_metadata);
+
+    return cur_mime;
+}
+
+// Encoded parts up to this size are read ahead into memory, larger
+//  ones into an intermediate file, see MIME_span_read()
+#define MIME_SPAN_HOLD_SIZE (256 *1024)
+
+/* A part read ahead to the end of its boundary line */
+struct MIME_span {
+    char *data;             // the encoded lines, unless spilled
+    size_t len;
+    size_t alloc;
+    FILE *spill;            // holds the lines instead once past MIME_SPAN_HOLD_SIZE
+    size_t encoded_size;    // as for MIME_skip_lines()
+    size_t decoded_size;
+    int whole;              // all the lines are held
+    int nested;             // a uuencoded or yEnc file starts in it
+    int keyed;              // key is being taken, see MIME_span_key()
+    struct DIGEST_sha256 key;
+    FFGET_FILE f;           // reads the lines back for the decoders
+};
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_span_hold
+  Returns Type  : int
+  ----Parameter List
+  1. struct MIME_span *span,
+  2. const char *line,
+  3. size_t len,
+  4. RIPMIME_output *unpack_metadata,
+  ------------------
+  Exit Codes    : 0 on success, -1 if the line could not be kept
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_span_hold( struct MIME_span *span, const char *line, size_t len, RIPMIME_output *unpack_metadata )
+{
+    if ((span->spill == NULL)&&(span->len +len > MIME_SPAN_HOLD_SIZE))
+    {
+        span->spill = MIME_intermediate_open(unpack_metadata);
+        if ((span->spill != NULL)&&(span->len > 0)&&(fwrite(span->data, span->len, 1, span->spill) != 1)) return -1;
+        free(span->data);
+        span->data = NULL;
+        span->alloc = 0;
+        if (span->spill == NULL) return -1;
+    }
+    if (span->spill != NULL)
+    {
+        if (fwrite(line, len, 1, span->spill) != 1) return -1;
+        span->len += len;
+        return 0;
+    }
+
+    if (span->len +len > span->alloc)
+    {
+        size_t alloc = (span->alloc) ? span->alloc : 4096;
+        char *p;
+
+        while (alloc < span->len +len) alloc <<= 1;
+        p = realloc(span->data, alloc);
+        if (p == NULL) return -1;
+        span->data = p;
+        span->alloc = alloc;
+    }
+    memcpy(span->data +span->len, line, len);
+    span->len += len;
+    return 0;
+}
+
+/* Forgets the lines held so far */
+static void MIME_span_drop( struct MIME_span *span )
+{
+    if (span->spill != NULL) fclose(span->spill);
+    free(span->data);
+    span->spill = NULL;
+    span->data = NULL;
+    span->len = span->alloc = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_span_key
+  Returns Type  : void
+  ----Parameter List
+  1. struct MIME_span *span,
+  2. const char *line, the next line of the part
+  3. size_t len,
+  4. int encoding,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+The dedup store key is the SHA-256 of the encoded part, headed by the
+encoding and the options which change how it decodes, so that the
+same span never maps onto two different decodings.  Between
+boundaries the base64 decoder passes over line ends and spaces, so
+they are left out of the key, and the same data wrapped at another
+line length or with other line ends still matches.  Any other
+encoding is keyed by its lines as they are.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void MIME_span_key_start( struct MIME_span *span, int encoding )
+{
+    char tag[64];
+
+    // The tag's version changes whenever the decoders would decode the
+    //  same span differently
+    snprintf(tag, sizeof(tag), "ripmime-store-1:%d:%d:%d:", encoding, glb.decode_qp, ((encoding == _CTRANS_ENCODING_B64)&&(BS_count() > 0)));
+    DIGEST_sha256_init(&(span->key));
+    DIGEST_sha256_update(&(span->key), tag, strlen(tag));
+    span->keyed = 1;
+}
+
+static void MIME_span_key( struct MIME_span *span, const char *line, size_t len, int encoding )
+{
+    if ((encoding == _CTRANS_ENCODING_B64)&&(BS_count() > 0))
+    {
+        char group[1024];
+        size_t i, n = 0;
+
+        for (i = 0; i < len; i++)
+        {
+            if ((unsigned char)line[i] > ' ') group[n++] = line[i];
+        }
+        DIGEST_sha256_update(&(span->key), group, n);
+    }
+    else DIGEST_sha256_update(&(span->key), line, len);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_span_read
+  Returns Type  : struct MIME_span *
+  ----Parameter List
+  1. FFGET_FILE *f, stream we're reading from
+  2. RIPMIME_output *unpack_metadata, for the size limits
+  3. int encoding, the part's _CTRANS_ENCODING_*
+  4. int keyed, take the part's dedup store key too
+  5. int *result, set as for MIME_skip_lines()
+  ------------------
+  Exit Codes    : NULL if the part could not be read ahead, in which
+                  case nothing has been read
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Reads the part up to and including its boundary, as MIME_skip_lines()
+does, estimating its decoded size against the output's size limits
+before anything is decoded.  The lines are kept for MIME_span_stream()
+unless the part is already too large, in which case only what follows
+the start of a uuencoded or yEnc file is kept, as the decoders will
+still want those.  If keyed is set the lines, less the boundary, are
+hashed for the dedup store as they go by, see MIME_span_key().
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static struct MIME_span *MIME_span_read( FFGET_FILE *f, RIPMIME_output *unpack_metadata, int encoding, int keyed, int *result )
+{
+    struct MIME_span *span;
+    char line[1024];
+    char *get_result;
+    int linecount = 0;
+    int holding = 1;
+    int failed = 0;
+
+    span = calloc(1, sizeof(struct MIME_span));
+    if (span == NULL) return NULL;
+    span->whole = 1;
+    if (keyed) MIME_span_key_start(span, encoding);
+
+    while ((get_result = FFGET_fgets(line,1023,f)))
+    {
+        size_t line_len = strlen(line);
+        int boundary = 0;
+
+        linecount++;
+        if ((line[0] == '-')&&(BS_count() > 0)&&(BS_cmp(line,line_len))) boundary = 1;
+        else
+        {
+            span->encoded_size += line_len;
+            span->decoded_size += MIME_skip_estimate(line, line_len, encoding);
+            if (span->keyed) MIME_span_key(span, line, line_len, encoding);
+
+            // Only MIME_decode_std_text() looks inside the part
+            if ((!span->nested)&&(encoding != _CTRANS_ENCODING_B64))
+            {
+                if (((glb.decode_uu)&&(UUENCODE_is_uuencode_header(line)))
+                        ||((glb.decode_yenc)&&((strncmp(line, "=ybegin ", 8) == 0)||(strncmp(line, "=3Dybegin ", 10) == 0))))
+                {
+                    span->nested = 1;
+                    holding = !failed;
+                }
+            }
+            if ((holding)&&(!span->nested)&&(unpack_metadata->size_max > 0)&&(span->decoded_size > unpack_metadata->size_max))
+            {
+                if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Part is larger than %lu bytes, passing over it",FL,__func__,(unsigned long)unpack_metadata->size_max);
+                MIME_span_drop(span);
+                span->whole = 0;
+                holding = 0;
+            }
+        }
+
+        if ((holding)&&(MIME_span_hold(span, line, line_len, unpack_metadata) != 0))
+        {
+            LOGGER_log("%s:%d:%s:ERROR: Cannot hold the part for decoding (%s)",FL,__func__,strerror(errno));
+            MIME_span_drop(span);
+            span->whole = 0;
+            holding = 0;
+            failed = 1;
+        }
+        if (boundary) break;
+    }
+
+    if (linecount == 0) *result = MIME_STATUS_ZERO_FILE;
+    else if (!get_result) *result = MIME_ERROR_FFGET_EMPTY;
+    else *result = 0;
+
+    return span;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_span_stream
+  Returns Type  : FFGET_FILE *
+  ----Parameter List
+  1. struct MIME_span *span,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+The lines held by MIME_span_read(), for a decoder to read in place of
+the mailpack.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static FFGET_FILE *MIME_span_stream( struct MIME_span *span )
+{
+    if (span->spill != NULL)
+    {
+        fflush(span->spill);
+        rewind(span->spill);
+        FFGET_setstream(&(span->f), span->spill);
+    }
+    else FFGET_setbuffer(&(span->f), span->data ? span->data : "", span->len);
+
+    return &(span->f);
+}
+
+static void MIME_span_free( struct MIME_span *span )
+{
+    if (span == NULL) return;
+    MIME_span_drop(span);
+    free(span);
+}
+
+/* The encodings MIME_skip_estimate() can size, as decoded by
+ * MIME_decode_std_text() and MIME_decode_std_64() */
+static int MIME_span_sizable( struct MIMEH_header_info *hinfo )
+{
+    switch (hinfo->content_transfer_encoding) {
+        case _CTRANS_ENCODING_B64:
+        case _CTRANS_ENCODING_7BIT:
+        case _CTRANS_ENCODING_8BIT:
+        case _CTRANS_ENCODING_QP:
+        case _CTRANS_ENCODING_UNSPECIFIED:
+            return 1;
+        case _CTRANS_ENCODING_UNKNOWN:
+            return (hinfo->content_disposition != _CDISPOSITION_FORMDATA);
+        default:
+            return 0;
+    }
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_filter_list_match
+  Returns Type  : int
+  ----Parameter List
+  1. char *list, lower-cased comma separated list
+  2. char *value, lower-cased value to look for
+  3. int globbing, the list entries are fnmatch() patterns
+  ------------------
+  Exit Codes    : 1 if the value is in the list, 0 if not
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Blanks around entries, and a leading '.' on plain entries (so that
+".pdf" and "pdf" are the same extension), are ignored.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int MIME_filter_list_match( char *list, char *value, int globbing )
+{
+    char entry[_MIME_STRLEN_MAX +1];
+    char *p = list;
+
+    while (*p)
+    {
+        size_t len;
+
+        while ((*p == ' ')||(*p == ',')) p++;
+        if ((!globbing)&&(*p == '.')) p++;
+        len = strcspn(p, ",");
+        snprintf(entry, sizeof(entry), "%.*s", (int)len, p);
+        p += len;
+        while ((len > 0)&&(entry[len -1] == ' ')) entry[--len] = '\0';
+        if (len == 0) continue;
+
+        if (globbing)
+        {
+            if (fnmatch(entry, value, 0) == 0) return 1;
+        }
+        else if (strcmp(entry, value) == 0) return 1;
+    }
+
+    return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_part_wanted
   Returns Type  : int
   ----Parameter List
-  1. FFGET_FILE *f,
-  2.  RIPMIME_output *unpack_metadata,
-  3.  struct MIMEH_header_info *hinfo,
+  1. struct MIMEH_header_info *hinfo, headers of the part about to be decoded
   ------------------
-  Exit Codes    :
+  Exit Codes    : 1 if the part passes the include/exclude filters, 0 if
+                  it is to be skipped
   Side Effects  :
   --------------------------------------------------------------------
 Comments:
+Decided on the headers alone, so that unwanted parts are never decoded.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int MIME_decode_std_64_cleanup( FFGET_FILE *f)
+static int MIME_part_wanted( struct MIMEH_header_info *hinfo )
 {
-    int result = 0;
-    char buffer[128];
+    char value[_MIME_STRLEN_MAX +1];
+    char *p;
 
-    while (FFGET_fgets(buffer, sizeof(buffer), f))
+    if ((glb.include_types[0])||(glb.exclude_types[0]))
     {
-        if (FFGET_feof(f) != 0) break;
-        if (BS_cmp(buffer,strlen(buffer)) > 0) break;
+        PLD_strncpy(value, hinfo->content_type_string, _MIME_STRLEN_MAX);
+        for (p = value; *p; p++) *p = tolower((int)*p);
+        if ((glb.include_types[0])&&(!MIME_filter_list_match(glb.include_types, value, 1))) return 0;
+        if ((glb.exclude_types[0])&&(MIME_filter_list_match(glb.exclude_types, value, 1))) return 0;
     }
-    return result;
+
+    if ((glb.include_extensions[0])||(glb.exclude_extensions[0]))
+    {
+        p = strrchr(hinfo->filename, '.');
+        PLD_strncpy(value, (p != NULL)?p +1:"", _MIME_STRLEN_MAX);
+        for (p = value; *p; p++) *p = tolower((int)*p);
+        if ((glb.include_extensions[0])&&(!MIME_filter_list_match(glb.include_extensions, value, 0))) return 0;
+        if ((glb.exclude_extensions[0])&&(MIME_filter_list_match(glb.exclude_extensions, value, 0))) return 0;
+    }
+
+    if (glb.include_dispositions[0])
+    {
+        switch (hinfo->content_disposition) {
+            case _CDISPOSITION_INLINE:
+                p = "inline";
+                break;
+            case _CDISPOSITION_ATTACHMENT:
+                p = "attachment";
+                break;
+            case _CDISPOSITION_FORMDATA:
+                p = "formdata";
+                break;
+            default:
+                p = "none";
+        }
+        if (!MIME_filter_list_match(glb.include_dispositions, p, 0)) return 0;
+    }
+
+    return 1;
 }
 
 /*------------------------------------------------------------------------
@@ -1723,39 +2603,53 @@ int MIME_doubleCR_decode( char *filename, RIPMIME_output *unpack_metadata, struc
 {
     int result = 0;
     struct MIMEH_header_info h;
-    char *p;
-    // PLD:260303-1317
-    //  if ((p=strrchr(filename,'/'))) p++;
-    //  else p = filename;
+    MIME_element *m;
+    FILE *f;
 
-    p = filename;
-    // * Initialise the header fields
-    h.uudec_name[0] = '\0';
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: filename=%s, path=%s, recursion=%d", FL,__func__, filename, unpack_metadata->dir, current_recursion_level );
+
+    // The doubleCR data was saved through the output sink while the
+    // headers were being read, so read it back from there.
+    m = MIME_element_find(filename);
+    if (m == NULL) return 0;
+
     memcpy(&h, hinfo, sizeof(h));
-    // Works for ripMIME    snprintf(h.filename, sizeof(h.filename), "%s/%s", unpackdir, p);
-    snprintf(h.filename, sizeof(h.filename), "%s", p); /// Works for Xamime
+    h.uudec_name[0] = '\0';
+    snprintf(h.filename, sizeof(h.filename), "%s", filename); /// Works for Xamime
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: header.filename = %s", FL,__func__, h.filename );
-    if (MIME_is_diskfile_RFC822(filename))
+
+    f = MIME_element_open_read(m, unpack_metadata);
+    if (f == NULL)
+    {
+        MIME_element_release(m, unpack_metadata);
+        return 0;
+    }
+
+    if (MIME_is_file_RFC822(f) == 1)
     {
         if (MIME_VERBOSE) LOGGER_log("Attempting to decode Double-CR delimeted MIME attachment '%s'\n",filename);
-        result = MIME_unpack( unpack_metadata, filename, current_recursion_level ); // 20040305-1303:PLD - Capture the result of the unpack and propagate up
+        fseek(f, 0, SEEK_SET);
+        result = MIME_unpack_stream( unpack_metadata, f, current_recursion_level ); // 20040305-1303:PLD - Capture the result of the unpack and propagate up
     }
-    else if (UUENCODE_is_diskfile_uuencoded(h.filename))
+    else
     {
-        FILE *fuue = NULL;
-        FFGET_FILE * ffg = NULL;
-
-        if (MIME_VERBOSE) LOGGER_log("Attempting to decode UUENCODED attachment from Double-CR delimeted attachment '%s'\n",filename);
-        fuue = UUENCODE_make_file_obj (filename);
-        ffg = UUENCODE_make_sourcestream(fuue);
-        UUENCODE_set_doubleCR_mode(1);
-        result = UUENCODE_decode_uu(ffg, h.uudec_name, 1, unpack_metadata, hinfo );
-        fclose(fuue);
-        UUENCODE_set_doubleCR_mode(0);
-        glb.attachment_count += result;
-        result = 0;
+        fseek(f, 0, SEEK_SET);
+        if (UUENCODE_is_file_uuencoded(f) > 0)
+        {
+            FFGET_FILE * ffg = NULL;
+
+            if (MIME_VERBOSE) LOGGER_log("Attempting to decode UUENCODED attachment from Double-CR delimeted attachment '%s'\n",filename);
+            ffg = UUENCODE_make_sourcestream(f);
+            UUENCODE_set_doubleCR_mode(1);
+            result = UUENCODE_decode_uu(ffg, h.uudec_name, 1, unpack_metadata, hinfo );
+            UUENCODE_set_doubleCR_mode(0);
+            glb.attachment_count += result;
+            result = 0;
+        }
     }
+    fclose(f);
+    MIME_element_release(m, unpack_metadata);
+
     return result;
 }
 
@@ -1916,7 +2810,9 @@ void MIME_init( void )
 {
     BS_init();          // Boundary-stack initialisations
     MIMEH_init();       // Initialise MIME header routines.
+    MIME_element_set_keep_test(MIME_part_kept);
     UUENCODE_init();    // uuen:coding decoding initialisations
+    YENC_init();        // yEnc decoding
     FNFILTER_init();    // Filename filtering
     MDECODE_init();     // ISO filename decoding initialisation
     TNEF_init();        // TNEF decoder
@@ -1934,6 +2830,7 @@ void MIME_init( void )
     glb.dump_headers = 0;
     glb.no_nameless = 0;
     glb.mailbox_format = 0;
+    glb.intermediates_in_memory = 0;
     glb.name_by_type = 0;
 
     glb.header_longsearch = 0;
@@ -1944,9 +2841,19 @@ void MIME_init( void )
     glb.decode_tnef = 1;
     glb.decode_ole = 1;
     glb.decode_uu = 1;
+    glb.decode_yenc = 1;
     glb.decode_mht = 1;
 
     glb.multiple_filenames = 1;
+    glb.discard_part = 0;
+    glb.part_keyed = 0;
+    glb.reparse_part = 0;
+
+    glb.include_types[0] = '\0';
+    glb.exclude_types[0] = '\0';
+    glb.include_extensions[0] = '\0';
+    glb.exclude_extensions[0] = '\0';
+    glb.include_dispositions[0] = '\0';
 
     glb.blankzone_save_option = MIME_BLANKZONE_SAVE_TEXTFILE;
     glb.blankzone_saved = 0;
@@ -1981,40 +2888,39 @@ Changes:
 void MIME_generate_multiple_hardlink_filenames(struct MIMEH_header_info *hinfo, RIPMIME_output *unpack_metadata)
 {
     char *name;
-    char *oldfn;
-    int fn_l = strlen(unpack_metadata->dir) + strlen(hinfo->filename) + sizeof(char) * 2;
+    int dirfd;
 
     if (glb.multiple_filenames == 0)
        return;
 
-    //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Generating hardlinks for %s",FL,__func__, hinfo->filename);
-    oldfn = malloc(fn_l);
-    snprintf(oldfn,fn_l,"%s/%s",unpack_metadata->dir,hinfo->filename);
+    // Other sinks have nothing to link, but the names are popped all the
+    // same so that later parts are named as they would be on disk
+    if (MIME_output_sink(unpack_metadata) == &MIME_sink_directory) dirfd = MIME_output_dirfd(unpack_metadata);
+    else dirfd = -1;
 
+    //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Generating hardlinks for %s",FL,__func__, hinfo->filename);
 
     if (SS_count(&(hinfo->ss_names)) > 1)
     {
         do
         {
             name = SS_pop(&(hinfo->ss_names));
-            if (name != NULL)
+            if ((name != NULL)&&(dirfd != -1))
             {
                 char *np;
-                char newname[1024];
                 int rv;
 
                 /** Strip off any leading path **/
                 np = strrchr(name, '/');
                 if (np) np++; else np = name;
 
-                snprintf(newname,sizeof(newname),"%s/%s",unpack_metadata->dir, np);
-                //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Linking %s->%s",FL,__func__,newname, oldfn);
-                rv = link(oldfn, newname);
+                //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Linking %s->%s",FL,__func__,np, hinfo->filename);
+                rv = linkat(dirfd, hinfo->filename, dirfd, np, 0);
                 if (rv == -1)
                 {
                     if (errno != EEXIST)
                     {
-                        LOGGER_log("%s:%d:%s:WARNING: While trying to create '%s' link to '%s' (%s)",FL,__func__, newname, oldfn,strerror(errno));
+                        LOGGER_log("%s:%d:%s:WARNING: While trying to create '%s/%s' link to '%s' (%s)",FL,__func__, unpack_metadata->dir, np, hinfo->filename,strerror(errno));
                     }
 
                 } else {
@@ -2031,19 +2937,17 @@ void MIME_generate_multiple_hardlink_filenames(struct MIMEH_header_info *hinfo,
         do
         {
             name = SS_pop(&(hinfo->ss_filenames));
-            if (name != NULL)
+            if ((name != NULL)&&(dirfd != -1))
             {
-                char newname[1024];
                 int rv;
 
-                snprintf(newname,sizeof(newname),"%s/%s",unpack_metadata->dir, name);
-                //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Linking %s->%s",FL,__func__,newname, oldfn);
-                rv = link(oldfn, newname);
+                //LOGGER_log("%s:%d:MIME_generate_multiple_hardlink_filenames:DEBUG: Linking %s->%s",FL,__func__,name, hinfo->filename);
+                rv = linkat(dirfd, hinfo->filename, dirfd, name, 0);
                 if (rv == -1)
                 {
                     if (errno != EEXIST)
                     {
-                        LOGGER_log("%s:%d:%s:WARNING: While trying to create '%s' link to '%s' (%s)",FL,__func__, newname, oldfn,strerror(errno));
+                        LOGGER_log("%s:%d:%s:WARNING: While trying to create '%s/%s' link to '%s' (%s)",FL,__func__, unpack_metadata->dir, name, hinfo->filename,strerror(errno));
                     }
 
                 } else {
@@ -2055,14 +2959,39 @@ void MIME_generate_multiple_hardlink_filenames(struct MIMEH_header_info *hinfo,
             }
         } while(name != NULL);
     }
-    free(oldfn);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name : MIME_forget_part_names
+  Returns Type  : void
+  ----Parameter List
+  1. struct MIMEH_header_info *hinfo,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Drops the names gathered for a part which was not written out, so
+that MIME_generate_multiple_hardlink_filenames() doesn't later try to
+link them to some other part.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void MIME_forget_part_names( struct MIMEH_header_info *hinfo )
+{
+    while (SS_pop(&(hinfo->ss_names)) != NULL);
+    while (SS_pop(&(hinfo->ss_filenames)) != NULL);
 }
 
 MIME_element * resencapsulate(MIME_element *decoded_mime, int decode_result, struct MIMEH_header_info *hinfo)
 {
     if (decoded_mime == NULL)
     {
-        decoded_mime = malloc(sizeof(MIME_element));
+        // Placeholder for parts which did not produce an element of their own (x-uuencode)
+        decoded_mime = calloc(1, sizeof(MIME_element));
+        decoded_mime->released = 1;
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoded MIME NULL!! filename = '%s'",FL,__func__,hinfo->filename);
     }
     decoded_mime->decode_result_code = decode_result;
@@ -2082,10 +3011,15 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
 {
     int keep = 1;
     int decode_result = -1;
+    int oversized = 0;
+    int keyed = 0;
+    struct MIME_span *span = NULL;
     MIME_element* decoded_mime = NULL;
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Start:DEBUG: (%s)\n",FL,__func__, hinfo->filename);
 
+    if (MIME_element_budget_exceeded()) return resencapsulate(NULL, MIME_ERROR_BUDGET_EXCEEDED, hinfo);
+
     // If we have a valid filename, then put it through the process of
     //  cleaning and filtering
     if (isprint((int)hinfo->filename[0]))
@@ -2132,10 +3066,67 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
         // need to increment the attachment count
         glb.attachment_count++;
     }
+    // Parts which the include/exclude filters rule out are read over
+    //  to the next boundary, without being decoded or stored anywhere
+    if (!MIME_part_wanted(hinfo))
+    {
+        size_t encoded_size, decoded_size;
+
+        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Filtered out '%s' (%s)\n",FL,__func__, hinfo->filename, hinfo->content_type_string);
+        decode_result = MIME_skip_lines(input_f, hinfo->content_transfer_encoding, &encoded_size, &decoded_size);
+        MIME_forget_part_names(hinfo);
+        return resencapsulate(NULL, decode_result, hinfo);
+    }
+
+    // Likewise parts outside the size limits, which are read ahead to the
+    //  boundary to size them before anything is decoded; the decoder then
+    //  reads the part from there.  Parts in other encodings are caught as
+    //  they are written.  Parts for the dedup store are read ahead in the
+    //  same way to key them, so that one the store has already need not be
+    //  decoded at all.  Parts which go to the part events are always
+    //  decoded, for the part_data handler.
+    if ((keep)&&(unpack_metadata->dedup_store != NULL)&&(unpack_metadata->events == NULL)&&(MIME_output_sink(unpack_metadata) == &MIME_sink_directory)) keyed = 1;
+    if ((unpack_metadata->unpack_mode != RIPMIME_UNPACK_MODE_LIST_MIME)&&((unpack_metadata->size_min > 0)||(unpack_metadata->size_max > 0)||(keyed))&&(MIME_span_sizable(hinfo)))
+    {
+        span = MIME_span_read(input_f, unpack_metadata, hinfo->content_transfer_encoding, keyed, &decode_result);
+    }
+    if (span != NULL)
+    {
+        if (!MIME_output_size_wanted(unpack_metadata, span->decoded_size))
+        {
+            if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: '%s' comes to about %lu bytes, outside the size limits\n",FL,__func__, hinfo->filename, (unsigned long)span->decoded_size);
+            oversized = 1;
+        }
+        if ((!oversized)&&(!span->whole))
+        {
+            LOGGER_log("%s:%d:%s:ERROR: '%s' could not be held for decoding, passing over it",FL,__func__, hinfo->filename);
+            oversized = 1;
+        }
+        if ((oversized)&&(!span->nested))
+        {
+            MIME_span_free(span);
+            MIME_forget_part_names(hinfo);
+            return resencapsulate(NULL, decode_result, hinfo);
+        }
+
+        // A text part which is not wanted itself is still decoded, to
+        //  nowhere, for the uuencoded and yEnc files it holds.  Nor is the
+        //  decoding of one which holds them, or which ran out before its
+        //  boundary, passed over for the store.
+        if (oversized) keep = 0;
+        if ((span->keyed)&&(!oversized)&&(span->whole)&&(!span->nested)&&(decode_result == 0))
+        {
+            DIGEST_sha256_final(&(span->key), glb.part_key);
+            glb.part_keyed = 1;
+        }
+        input_f = MIME_span_stream(span);
+    }
+
     // If we are required to have "unique" filenames for everything, rather than
     //  allowing ripMIME to overwrite stuff, then we put the filename through
-    //      its tests here
-    if ((unpack_metadata->unique_names)&&(keep))
+    //      its tests here, whatever the sink, so that parts handed to an
+    //      embedder in memory are named just as they would be on disk
+    if ((unpack_metadata->unique_names)&&(keep)&&(MIME_output_sink(unpack_metadata) != &MIME_sink_null))
     {
         MIME_test_uniquename( unpack_metadata, hinfo->filename );
     }
@@ -2175,6 +3166,7 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
         } // If we were using the new filename telling format
     } // If we were telling the filename (verbosity)
 
+    if (keep)
     {
         char *fp;
         /** Find the start of the filename. **/
@@ -2188,10 +3180,19 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
         // Store the filename we're going to use to save the file to in the filename stack
         SS_push(ss, fp, strlen(fp));
     }
+    // Listing the mailpack only needs the extent of each part, so
+    //  there's nothing to decode and nothing to post-decode.
+    if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_LIST_MIME)
+    {
+        decoded_mime = MIME_skip_part(parent_mime, input_f, unpack_metadata, hinfo);
+        return resencapsulate(decoded_mime, decoded_mime->decode_result_code, hinfo);
+    }
+
     // Select the decoding method based on the content transfer encoding
     //  method which we read from the headers
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: ENCODING = %d\n",FL,__func__, hinfo->content_transfer_encoding);
+    glb.discard_part = !keep;
     switch (hinfo->content_transfer_encoding)
     {
         case _CTRANS_ENCODING_B64:
@@ -2273,17 +3274,12 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
             //      because dud headers will always result in a UNSPECIFIED encoding
             //
             //  Original sample mailpack was sent by Farit - thanks.
-            char *fn;
-            int fn_l = strlen(unpack_metadata->dir) + strlen(hinfo->filename) + sizeof(char) * 2;
-            fn = malloc(fn_l);
-            snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,hinfo->filename);
-            LOGGER_log("%s:%d:%s:DEBUG:REMOVEME: Testing for RFC822 headers in file %s",FL,__func__,fn);
-            if (MIME_is_diskfile_RFC822(fn) > 0 )
+            LOGGER_log("%s:%d:%s:DEBUG:REMOVEME: Testing for RFC822 headers in file %s",FL,__func__,decoded_mime->fullpath);
+            if (MIME_is_element_RFC822(decoded_mime, unpack_metadata) > 0 )
             {
                 // 20040305-1304:PLD: unpack the file, propagate result upwards
-                decode_result = MIME_unpack_single_diskfile( unpack_metadata, fn, (hinfo->current_recursion_level+ 1),ss );
+                decode_result = MIME_unpack_single_element( unpack_metadata, decoded_mime, (hinfo->current_recursion_level+ 1),ss );
             }
-            free(fn);
             break;
         default:
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding format is not defined (%d)\n",FL,__func__, hinfo->content_transfer_encoding);
@@ -2291,6 +3287,21 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
             decode_result = decoded_mime->decode_result_code;
             break;
     }
+    glb.discard_part = 0;
+    glb.part_keyed = 0;
+    MIME_span_free(span);
+    if ((oversized)&&(decoded_mime != NULL)) decoded_mime->discarded = 1;
+
+    // Going over a budget abandons the rest of the message, the part
+    //  in hand included, so it is not post-decoded either
+    if (MIME_element_budget_exceeded())
+    {
+        MIMEH_set_defect(hinfo, MIMEH_DEFECT_BUDGET_EXCEEDED);
+        glb.header_defect_count++;
+        MIME_forget_part_names(hinfo);
+        return resencapsulate(decoded_mime, MIME_ERROR_BUDGET_EXCEEDED, hinfo);
+    }
+
     // Analyze our results
     switch (decode_result) {
         case 0:
@@ -2308,31 +3319,28 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
             return resencapsulate(decoded_mime, decode_result, hinfo);
     }
 
-    if ((decode_result != -1)&&(decode_result != MIME_STATUS_ZERO_FILE))
+    if ((decode_result != -1)&&(decode_result != MIME_STATUS_ZERO_FILE)&&(!oversized))
     {
 #ifdef RIPOLE
         // If we have OLE decoding active and compiled in, then
-        //      do a quick attempt at decoding the file, fortunately
-        //      because the ripOLE engine detects if the file is not an
-        //      OLE file, it does not have a major impact on the
-        //      performance of the ripMIME decoding engine
-        if (glb.decode_ole > 0)
+        //      hand the part to the ripOLE engine, but only if its first
+        //      bytes (kept by MIME_element_write) carry the OLE2 id, so
+        //      that the bulk of attachments are never even looked at again
+        if ((glb.decode_ole > 0)&&(decoded_mime != NULL)&&(OLE_is_signature(decoded_mime->head, decoded_mime->head_l)))
         {
-            MIME_decode_OLE_diskfile( unpack_metadata, hinfo );
+            MIME_decode_OLE_element( unpack_metadata, decoded_mime );
         }
 #endif
 
-        // If our content-type was TNEF, then we need to decode it
-        //      using an external decoding engine (see tnef/tnef.c)
-        // Admittingly, this is not the most ideal way of picking out
-        //      TNEF files from our decoded attachments, but, for now
-        //      it'll have to do, besides, it does work fine, without any
-        //      side-effects
-        if (hinfo->content_type == _CTYPE_TNEF)
+        // If the part is TNEF, then we need to decode it using an
+        //      external decoding engine (see tnef/tnef.c).  The part is
+        //      picked out by the TNEF signature rather than by its
+        //      content-type, which is often just application/octet-stream
+        if ((decoded_mime != NULL)&&(TNEF_is_signature(decoded_mime->head, decoded_mime->head_l)))
         {
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding TNEF format\n",FL,__func__);
             glb.attachment_count++;
-            MIME_decode_TNEF( unpack_metadata, hinfo );
+            MIME_decode_TNEF( unpack_metadata, decoded_mime );
         } // Decode TNEF
 
         // Look for Microsoft MHT files... and try decode them.
@@ -2344,63 +3352,22 @@ MIME_element* MIME_process_content_transfer_encoding( MIME_element* parent_mime,
         {
             if (glb.decode_mht != 0)
             {
-                char *fn;
-                int fn_l = strlen(unpack_metadata->dir) + strlen(hinfo->filename) + sizeof(char) * 2;
-
                 //  Patched 26-01-03: supplied by Chris Hine
                 if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Microsoft MHT format email filename='%s'\n",FL,__func__, hinfo->filename);
-                fn = malloc(fn_l);
-                snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,hinfo->filename);
 
                 // 20040305-1304:PLD: unpack the file, propagate result upwards
-                decode_result = MIME_unpack_single_diskfile( unpack_metadata, fn, (hinfo->current_recursion_level+ 1),ss );
-                free(fn);
+                decode_result = MIME_unpack_single_element( unpack_metadata, decoded_mime, (hinfo->current_recursion_level+ 1),ss );
             }
         } // Decode MHT files
     } // If decode_result != -1
     // End.
 
-    MIME_generate_multiple_hardlink_filenames(hinfo,unpack_metadata);
+    if ((!keep)||((decoded_mime != NULL)&&(decoded_mime->discarded))) MIME_forget_part_names(hinfo);
+    else MIME_generate_multiple_hardlink_filenames(hinfo,unpack_metadata);
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done for filename = '%s'",FL,__func__,hinfo->filename);
     return resencapsulate(decoded_mime, decode_result, hinfo);
 }
 
-/*------------------------------------------------------------------------
-Procedure:     MIME_postdecode_cleanup ID:1
-Purpose:       Performs any cleanup operations required after the immediate completion of the mailpack decoding.
-Input:         RIPMIME_output *unpack_metadata - directory where the mailpack was unpacked to
-Output:        none
-Errors:
-------------------------------------------------------------------------*/
-int MIME_postdecode_cleanup( RIPMIME_output *unpack_metadata, struct SS_object *ss )
-{
-    int result = 0;
-    do {
-        char *filename;
-        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s Popping file...",FL,__func__);
-        filename = SS_pop(ss);
-        if (filename == NULL) break;
-        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s Popped file '%s'",FL,__func__, filename);
-        if ( strncmp( glb.blankfileprefix, filename, strlen( glb.blankfileprefix ) ) == 0 )
-        {
-            char *fn;
-            int fn_l = strlen(unpack_metadata->dir) + strlen(filename) + sizeof(char) * 2;
-
-            fn = malloc(fn_l);
-            snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,filename);
-
-            result = unlink( fn );
-            if (MIME_VERBOSE)
-            {
-                if (result == -1) LOGGER_log("Error removing '%s'; %s", fn, strerror(errno));
-                else LOGGER_log("Removed %s [status = %d]\n", fn, result );
-            }
-            free(fn);
-        }
-    } while (1);
-    return 0;
-}
-
 /*-----------------------------------------------------------------\
   Function Name : MIME_handle_multipart
   Returns Type  : int
@@ -2451,19 +3418,10 @@ int MIME_handle_multipart( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMI
         result = decoded_mime->decode_result_code;
         if (result == 0)
         {
-            char *fn;
-            int fn_l = strlen(unpack_metadata->dir) + strlen(h->filename) + sizeof(char) * 2;
-
-            fn = malloc(fn_l);
-            snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,h->filename);
-            // Because we're calling MIME_unpack_single_diskfile again [ie, recursively calling it
-            // we need to now adjust the input-filename so that it correctly is prefixed
-            // with the directory we unpacked to.
-
             //result = MIME_unpack_single_diskfile( unpackdir, fn, current_recursion_level + 1, ss);
-            result = MIME_unpack_single_diskfile( unpack_metadata, fn, current_recursion_level, ss );
-            free(fn);
+            result = MIME_unpack_single_element( unpack_metadata, decoded_mime, current_recursion_level, ss );
         }
+        MIME_element_release( decoded_mime, unpack_metadata );
 
     } // else-if transfer-encoding != B64 && filename was empty
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: done handling '%s' result = %d",FL,__func__,h->filename, result);
@@ -2526,21 +3484,14 @@ int MIME_handle_rfc822( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMIME_
         result = decoded_mime->decode_result_code;
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Result of extracting %s is %d",FL,__func__,h->filename, result);
         if (result == 0) {
-            char * fn;
-            int fn_l = strlen(unpack_metadata->dir) + strlen(h->filename) + sizeof(char) * 2;
-
-            fn = malloc(fn_l);
-            snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,h->filename);
-
-            /** Because we're calling MIME_unpack_single_diskfile again [ie, recursively calling it
-              we need to now adjust the input-filename so that it correctly is prefixed
-              with the directory we unpacked to. **/
+            /** Now unpack the message we have just decoded, straight from
+              wherever it was decoded to **/
             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Now attempting to extract contents of '%s'",FL,__func__,h->filename);
 
-            result = MIME_unpack_single_diskfile( unpack_metadata, fn, current_recursion_level, ss );
-            free(fn);
+            result = MIME_unpack_single_element( unpack_metadata, decoded_mime, current_recursion_level, ss );
             result = 0;
         }
+        MIME_element_release( decoded_mime, unpack_metadata );
     } /** else-if transfer-encoding != B64 && filename was empty **/
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: done handling '%s' result = %d",FL,__func__,h->filename, result);
     return result;
@@ -2577,19 +3528,15 @@ int MIME_handle_plain( MIME_element* parent_mime, FFGET_FILE *input_f, RIPMIME_o
     if ((result == MIME_ERROR_FFGET_EMPTY)||(result == 0))
     {
         /** Test for RFC822 content... if so, go decode it **/
-        char *fn;
-        int fn_l = strlen(unpack_metadata->dir) + strlen(h->filename) + sizeof(char) * 2;
-        fn = malloc(fn_l);
-        snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,h->filename);
-        if (MIME_is_diskfile_RFC822(fn)==1)
+        if (MIME_is_element_RFC822(decoded_mime, unpack_metadata)==1)
         {
-            /** If the file is RFC822, then decode it using MIME_unpack_single_diskfile() **/
+            /** If the file is RFC822, then decode it using MIME_unpack_single_element() **/
             if (glb.header_longsearch != 0) MIMEH_set_header_longsearch(glb.header_longsearch);
-            result = MIME_unpack_single_diskfile( unpack_metadata, fn, current_recursion_level, ss );
+            result = MIME_unpack_single_element( unpack_metadata, decoded_mime, current_recursion_level, ss );
             if (glb.header_longsearch != 0) MIMEH_set_header_longsearch(0);
         }
-        free(fn);
     }
+    MIME_element_release( decoded_mime, unpack_metadata );
     return result;
 }
 
@@ -2617,6 +3564,7 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
                 ,FL,__func__, current_recursion_level, glb.max_recursion_level);
         return MIME_ERROR_RECURSION_LIMIT_REACHED; // 20040306-1301:PLD
     }
+    if (MIME_element_budget_exceeded()) return MIME_ERROR_BUDGET_EXCEEDED;
     h = hinfo;
     // Get our headers and determin what we have...
     //
@@ -2709,6 +3657,7 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
         // the start of this function.
         decoded_mime = MIME_process_content_transfer_encoding( parent_mime, input_f, unpack_metadata, h, ss);
         result = decoded_mime->decode_result_code;
+        MIME_element_release( decoded_mime, unpack_metadata );
         if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done decoding, result = %d",FL,__func__,result);
         if (result == 0)
         {
@@ -2719,6 +3668,8 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
                 // and get the attachment details
                 while ((result == 0)||(result == MIME_STATUS_ZERO_FILE)||(result == MIME_ERROR_RECURSION_LIMIT_REACHED))
                 {
+                    if (MIME_element_budget_exceeded()) return MIME_ERROR_BUDGET_EXCEEDED;
+
                     h->content_type = -1;
                     h->filename[0] = '\0';
                     h->name[0]     = '\0';
@@ -2822,23 +3773,22 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
 
                         } else {
                             if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: RFC822 Message to be decoded...\n",FL,__func__);
+                            glb.reparse_part = 1;
                             decoded_mime = MIME_process_content_transfer_encoding( parent_mime, input_f, unpack_metadata, h, ss );
+                            glb.reparse_part = 0;
                             result = decoded_mime->decode_result_code;
-                            if (result != 0) return result; // 20040305-1313:PLD
+                            if (result != 0)
+                            {
+                                MIME_element_release( decoded_mime, unpack_metadata );
+                                return result; // 20040305-1313:PLD
+                            }
                             else
                             {
-                                char * fn;
-                                int fn_l = strlen(unpack_metadata->dir) + strlen(h->filename) + sizeof(char) * 2;
                                 if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Now running ripMIME over decoded RFC822 message...\n",FL,__func__);
 
-                                // Because we're calling MIME_unpack_single_diskfile again [ie, recursively calling it
-                                // we need to now adjust the input-filename so that it correctly is prefixed
-                                // with the directory we unpacked to.
-                                fn = malloc(fn_l);
-                                snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,h->filename);
                                 //result = MIME_unpack_single_diskfile( unpackdir, fn, current_recursion_level + 1, ss);
-                                result = MIME_unpack_single_diskfile( unpack_metadata, fn, current_recursion_level,ss );
-                                free(fn);
+                                result = MIME_unpack_single_element( unpack_metadata, decoded_mime, current_recursion_level,ss );
+                                MIME_element_release( decoded_mime, unpack_metadata );
                             }
 
                         } // else-if transfer-encoding wasn't B64 and filename was blank
@@ -2857,22 +3807,20 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
                             // Added 24 Aug 2003 by PLD
                             //      Ricardo Kleemann supplied offending mailpack to display
                             //      this behavior
-                            if (result != 0) return result; // 20040305-1314:PLD
+                            if (result != 0)
+                            {
+                                MIME_element_release( decoded_mime, unpack_metadata );
+                                return result; // 20040305-1314:PLD
+                            }
                             else
                             {
-                                char *mime_fname;
-
-                                mime_fname = PLD_dprintf("%s/%s", unpack_metadata->dir, h->filename);
-                                if(mime_fname != NULL)
+                                if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Testing '%s' for email type",FL,__func__,h->filename);
+                                if (MIME_is_element_RFC822(decoded_mime, unpack_metadata))
                                 {
-                                    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Testing '%s' for email type",FL,__func__,mime_fname);
-                                    if (MIME_is_diskfile_RFC822(mime_fname))
-                                    {
-                                        //MIME_unpack_single_diskfile( unpackdir, mime_fname, (hinfo->current_recursion_level+ 1), ss);
-                                        MIME_unpack_single_diskfile( unpack_metadata, mime_fname, current_recursion_level+ 1,ss);
-                                    }
-                                    free(mime_fname);
+                                    //MIME_unpack_single_diskfile( unpackdir, mime_fname, (hinfo->current_recursion_level+ 1), ss);
+                                    MIME_unpack_single_element( unpack_metadata, decoded_mime, current_recursion_level+ 1,ss);
                                 }
+                                MIME_element_release( decoded_mime, unpack_metadata );
                             }
                         } // if there was a boundary, RFC822 content or it was multi-part
                     } else {
@@ -2892,6 +3840,49 @@ int MIME_unpack_stage2( FFGET_FILE *input_f, RIPMIME_output *unpack_metadata, st
     return result;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name : MIME_intermediate_open
+  Returns Type  : FILE *
+  ----Parameter List
+  1. RIPMIME_output *unpack_metadata,
+  ------------------
+  Exit Codes    : NULL if neither a memfd nor a temporary file can be had
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+An anonymous read/write stream for data which is written once and
+read straight back, see MIME_set_intermediates_in_memory().  Kernels
+without memfd_create() get a file in the temporary directory (the
+output directory if none is set), unlinked as soon as it is made.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static FILE *MIME_intermediate_open( RIPMIME_output *unpack_metadata )
+{
+    char fname[_MIME_STRLEN_MAX +32];
+    FILE *f;
+    int fd;
+
+    fd = memfd_create("ripmime-mailpack", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        snprintf(fname, sizeof(fname), "%s/ripmime.XXXXXX", (glb.tempdirectory[0] != '\0') ? glb.tempdirectory : unpack_metadata->dir);
+        fd = mkstemp(fname);
+        if (fd == -1)
+        {
+            LOGGER_log("%s:%d:%s:ERROR: Cannot create temporary file '%s' (%s)",FL,__func__, fname, strerror(errno));
+            return NULL;
+        }
+        unlink(fname);
+    }
+
+    f = fdopen(fd, "w+");
+    if (f == NULL) close(fd);
+    return f;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_decode_mailbox ID:1
 Purpose:       Decodes mailbox formatted email files
@@ -2925,7 +3916,8 @@ int MIME_unpack_mailbox( RIPMIME_output *unpack_metadata, char *mpname, int curr
         }
     }
 
-    fo = fopen(fname,"w");
+    if (glb.intermediates_in_memory) fo = MIME_intermediate_open(unpack_metadata);
+    else fo = fopen(fname,"w");
     if (!fo)
     {
         LOGGER_log("%s:%d:%s:ERROR: Cannot open '%s' for writing  (%s)",FL,__func__, fname,strerror(errno));
@@ -2939,7 +3931,18 @@ int MIME_unpack_mailbox( RIPMIME_output *unpack_metadata, char *mpname, int curr
         //      can be -pretty- sure that a new email is about
         //      to start
 
-        if ((lastlinewasblank==1)&&(strncasecmp(line,"From ",5)==0))
+        if ((lastlinewasblank==1)&&(strncasecmp(line,"From ",5)==0)&&(glb.intermediates_in_memory))
+        {
+            // Decode the mailpack, then empty the stream for the next one
+            rewind(fo);
+            MIME_unpack_single_file(unpack_metadata, fo, current_recursion_level, ss);
+            rewind(fo);
+            if (ftruncate(fileno(fo), 0) == -1)
+            {
+                LOGGER_log("%s:%d:%s:ERROR: Cannot empty temporary mailpack (%s)",FL,__func__, strerror(errno));
+            }
+        }
+        else if ((lastlinewasblank==1)&&(strncasecmp(line,"From ",5)==0))
         {
             // Close the mailpack
             fclose(fo);
@@ -2985,6 +3988,14 @@ int MIME_unpack_mailbox( RIPMIME_output *unpack_metadata, char *mpname, int curr
     // Now, even though we have run out of lines from our main input file
     //  it DOESNT mean we dont have some more decoding to do, in fact
     //      quite the opposite, we still have one more file to decode
+    if (glb.intermediates_in_memory)
+    {
+        rewind(fo);
+        MIME_unpack_single_file(unpack_metadata, fo, current_recursion_level, ss);
+        fclose(fo);
+        return 0;
+    }
+
     // Close the mailpack
     fclose(fo);
 
@@ -3061,6 +4072,56 @@ int MIME_unpack_single_diskfile( RIPMIME_output *unpack_metadata, char *mpname,
     return result;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name : MIME_unpack_single_element
+  Returns Type  : int
+  ----Parameter List
+  1. RIPMIME_output *unpack_metadata,
+  2.  MIME_element *m, decoded part which holds a nested message
+  3.  int current_recursion_level,
+  4.  struct SS_object *ss ,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+As MIME_unpack_single_diskfile(), but reads the nested message back
+from wherever its part was decoded to, so that in-memory mode never
+needs to go via the filesystem.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIME_unpack_single_element( RIPMIME_output *unpack_metadata, MIME_element *m, int current_recursion_level, struct SS_object *ss )
+{
+    FILE *fi;
+    MIME_element *parent;
+    int result = 0;
+
+    if (current_recursion_level > glb.max_recursion_level)
+    {
+        LOGGER_log("%s:%d:%s:WARNING: Current recursion level of %d is greater than permitted %d",FL,__func__, current_recursion_level, glb.max_recursion_level);
+        return MIME_ERROR_RECURSION_LIMIT_REACHED;
+    }
+
+    fi = MIME_element_open_read(m, unpack_metadata);
+    if (fi == NULL)
+    {
+        if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: No decoded content to unpack",FL,__func__);
+        return 0;
+    }
+
+    // Whatever is found inside belongs to m
+    parent = MIME_element_set_parent(m);
+    result = MIME_unpack_single_file(unpack_metadata,fi,current_recursion_level , ss);
+    MIME_element_set_parent(parent);
+    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: result = %d, recursion = %d, filename = '%s'", FL,__func__, result, current_recursion_level, m->fullpath );
+    if ((current_recursion_level > 1)&&(result == MIME_ERROR_FFGET_EMPTY)) result = 0;
+    fclose(fi);
+    return result;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_unpack_single_diskfile ID:1
 Purpose:       Decodes a single mailpack file (as apposed to mailbox format) into its
@@ -3098,25 +4159,26 @@ int MIME_unpack_single_file( RIPMIME_output *unpack_metadata, FILE *fi, int curr
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: DumpHeaders = %d\n",FL,__func__, glb.dump_headers);
     if ((!hf)&&(glb.dump_headers))
     {
-        char * fn;
-        int fn_l = strlen(unpack_metadata->dir) + strlen(glb.headersname) + sizeof(char) * 2;
-
-        fn = malloc(fn_l);
-        snprintf(fn,fn_l,"%s/%s",unpack_metadata->dir,glb.headersname);
+        int dirfd = MIME_output_dirfd(unpack_metadata);
+        int fd;
 
-        // Prepend the unpackdir path to the headers file name
-        hf = fopen(fn,"w");
+        // The headers file goes in the output directory along with the parts
+        fd = (dirfd == -1) ? -1 : openat(dirfd, glb.headersname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+        if (fd != -1)
+        {
+            hf = fdopen(fd, "w");
+            if (!hf) close(fd);
+        }
         if (!hf)
         {
             glb.dump_headers = 0;
-            LOGGER_log("%s:%d:%s:ERROR: Cannot open '%s' for writing  (%s)", FL,__func__, fn, strerror(errno));
+            LOGGER_log("%s:%d:%s:ERROR: Cannot open '%s/%s' for writing  (%s)", FL,__func__, unpack_metadata->dir, glb.headersname, strerror(errno));
         }
         else
         {
             headers_save_set_here = 1;
             h.header_file = hf;
         }
-        free(fn);
     }
 
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Setting up streams to decode\n",FL,__func__);
@@ -3163,6 +4225,33 @@ int MIME_unpack_single_file( RIPMIME_output *unpack_metadata, FILE *fi, int curr
     //  return status; // 20040305-1318:PLD
 }
 
+/*------------------------------------------------------------------------
+Procedure:     MIME_unpack_status ID:1
+Purpose:       If the result is a non-critical one (ie, just running out of
+data from the file we attempted to decode - then don't propergate it
+Input:         int result: status from the unpack run
+Output:        status to hand back to the caller
+Errors:
+------------------------------------------------------------------------*/
+static int MIME_unpack_status( int result )
+{
+    switch (result) {
+        case 1:
+            result = 0;
+            break;
+        case MIME_STATUS_ZERO_FILE:
+            result = 0;
+            break;
+        case MIME_ERROR_FFGET_EMPTY:
+        case MIME_ERROR_RECURSION_LIMIT_REACHED:
+            result = 0;
+            break;
+        default:
+            break;
+    }
+    return result;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_unpack ID:1
 Purpose:       Front end to unpack_mailbox and unpack_single.  Decides
@@ -3191,11 +4280,6 @@ int MIME_unpack( RIPMIME_output *unpack_metadata, char *mpname, int current_recu
         result = MIME_unpack_single_diskfile( unpack_metadata, mpname, (current_recursion_level + 1), &ss );
     }
 
-    if (glb.no_nameless)
-    {
-        MIME_postdecode_cleanup( unpack_metadata, &ss );
-    }
-
     if (MIME_DNORMAL)
     {
         LOGGER_log("%s:%d:%s: Files unpacked from '%s' (recursion=%d);",FL,__func__,mpname,current_recursion_level);
@@ -3204,33 +4288,59 @@ int MIME_unpack( RIPMIME_output *unpack_metadata, char *mpname, int current_recu
 
     SS_done(&ss);
     if (MIME_DNORMAL) SS_set_debug(&ss,1);
-    // If the result is a non-critical one (ie, just running out of data from the
-    //      file we attempted to decode - then don't propergate it, on the other
-    switch (result) {
-        case 1:
-            result = 0;
-            break;
-        case MIME_STATUS_ZERO_FILE:
-            result = 0;
-            break;
-        case MIME_ERROR_FFGET_EMPTY:
-        case MIME_ERROR_RECURSION_LIMIT_REACHED:
-            result = 0;
-            break;
-        default:
-            break;
-    }
+    result = MIME_unpack_status(result);
 
     if (current_recursion_level == 0)
     {
         //LOGGER_log("%s:%d:%s:DEBUG: Clearing boundary stack",FL,__func__);
         BS_clear();
+        // yEnc posts still waiting on parts go out with what they have, as
+        //      their other parts cannot turn up in a later mailpack
+        glb.attachment_count += YENC_flush();
+        // The nested decoders do not all pass their results back up
+        if (MIME_element_budget_exceeded()) result = MIME_ERROR_BUDGET_EXCEEDED;
     }
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: Unpacking of %s is done.",FL,__func__,mpname);
     if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: -----------------------------------",FL,__func__);
     return result;
 }
 
+/*------------------------------------------------------------------------
+Procedure:     MIME_unpack_stream ID:1
+Purpose:       Unpacks a single mailpack from an already open stream, such
+as the read end of the push parser's pipe.  The stream is read
+through to the end of the mailpack, but is not closed.
+Input:         RIPMIME_output *unpack_metadata: output settings
+FILE *fi: the mailpack stream
+int current_recursion_level: Level of recursion we're currently at.
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int MIME_unpack_stream( RIPMIME_output *unpack_metadata, FILE *fi, int current_recursion_level )
+{
+    int result = 0;
+    struct SS_object ss;
+
+    if (current_recursion_level > glb.max_recursion_level) return MIME_ERROR_RECURSION_LIMIT_REACHED;
+    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: Unpacking stream to %s, recursion level is %d",FL,__func__,unpack_metadata->dir,current_recursion_level);
+    if (MIME_DNORMAL) SS_set_debug(&ss,1);
+    SS_init(&ss);
+
+    result = MIME_unpack_single_file( unpack_metadata, fi, (current_recursion_level + 1), &ss );
+
+    SS_done(&ss);
+    result = MIME_unpack_status(result);
+
+    if (current_recursion_level == 0)
+    {
+        BS_clear();
+        glb.attachment_count += YENC_flush();
+        if (MIME_element_budget_exceeded()) result = MIME_ERROR_BUDGET_EXCEEDED;
+    }
+    if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: Unpacking of stream is done (result=%d)",FL,__func__,result);
+    return result;
+}
+
 /*--------------------------------------------------------------------
  * MIME_close
  *
@@ -3239,8 +4349,13 @@ int MIME_unpack( RIPMIME_output *unpack_metadata, char *mpname, int current_recu
  */
 void MIME_close(RIPMIME_output *unpack_metadata)
 {
+    struct mime_events *events = unpack_metadata->events;
+
+    // Hand over anything which has not been released yet
+    MIME_element_release_all(unpack_metadata);
 
-    if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_IN_MEMORY)
+    // Embedders with a part_complete handler get the buffers, not files
+    if ((unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_IN_MEMORY)&&((events == NULL)||(events->part_complete == NULL)))
         write_all_to_FS_files(unpack_metadata);
 
     if (MIME_DNORMAL) {
@@ -3249,6 +4364,10 @@ void MIME_close(RIPMIME_output *unpack_metadata)
     }
 
     freeArray(all_MIME_elements.mime_arr, unpack_metadata);
+
+    // Leave a fresh element list behind so that the next mailpack (ripMIME -i <dir>,
+    //      or another RIPMIME_feed() run) has somewhere to record its parts
+    all_MIME_elements_init();
 }
 
 /* EOF */
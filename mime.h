@@ -20,6 +20,7 @@
 #define MIME_ERROR_RECURSION_LIMIT_REACHED				240
 #define MIME_ERROR_FFGET_EMPTY							241
 #define MIME_ERROR_B64_INPUT_STREAM_EOF					242
+#define MIME_ERROR_BUDGET_EXCEEDED						243
 
 #define _MIME_STRLEN_MAX 1023
 
@@ -52,6 +53,7 @@ int MIME_version( void );
 size_t MIME_read_raw( char *src_mpname, char *dest_mpname, size_t rw_buffer_size );
 int MIME_read( char *mpname ); /* returns filesize in KB */
 int MIME_unpack( RIPMIME_output *unpack_metadata, char *mpname, int current_recusion_level );
+int MIME_unpack_stream( RIPMIME_output *unpack_metadata, FILE *fi, int current_recursion_level );
 int MIME_insert_Xheader( char *fname, char *xheader );
 int MIME_set_blankfileprefix( char *prefix );
 int MIME_set_recursion_level(int level);
@@ -68,6 +70,7 @@ int MIME_set_dumpheaders( int level );
 int MIME_set_headersname( char *fname );
 
 int MIME_set_decode_uudecode( int level );
+int MIME_set_decode_yenc( int level );
 int MIME_set_decode_tnef( int level );
 int MIME_set_decode_ole( int level );
 int MIME_set_decode_qp( int level );
@@ -88,10 +91,16 @@ int MIME_set_uniquenames( int level );
 int MIME_set_renamemethod( int method );
 int MIME_set_paranoid( int level );
 int MIME_set_mailboxformat( int level );
+int MIME_set_intermediates_in_memory( int level );
 int MIME_set_webform( int level );
 int MIME_get_attachment_count( void );
 int MIME_set_name_by_type( int level );
 int MIME_set_multiple_filenames( int level );
+int MIME_set_include_types( char *globs );
+int MIME_set_exclude_types( char *globs );
+int MIME_set_include_extensions( char *extensions );
+int MIME_set_exclude_extensions( char *extensions );
+int MIME_set_include_dispositions( char *dispositions );
 int MIME_get_header_defect_count( void );
 
 int MIME_is_file_mime( char *fname );
@@ -1,13 +1,21 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/mman.h>
 
 #include "mime_element.h"
 #include "logger.h"
 #include "pldstr.h"
+#include "digest.h"
 
 #ifndef FL
 #define FL __FILE__, __LINE__
@@ -31,6 +39,8 @@ void deleteItem(dynamic_array* container, int i);
 
 struct MIME_globals {
 	int debug;
+	int (*keep_test)( MIME_element *m, int final );	// see MIME_element_set_keep_test()
+	MIME_element *parent;	// see MIME_element_set_parent()
 };
 
 static struct MIME_globals glb;
@@ -43,86 +53,1364 @@ int MIMEELEMENT_set_debug( int level )
     return glb.debug;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_set_keep_test
+ Returns Type	: int
+ ----Parameter List
+ 1. int (*fn)( MIME_element *m, int final ), NULL to keep every part
+ ------------------
+ Comments:
+ The digest and discard sinks do not keep a part unless this says the
+ post-decoders are going to read it back.  fn is given what has been
+ written so far in m->mem_filearea, at least the head unless final is
+ set at the end of the part, and returns 1 to keep the part, 0 to
+ drop it or, if not final, -1 to be asked again after the next write.
+ \------------------------------------------------------------------*/
+int MIME_element_set_keep_test( int (*fn)( MIME_element *m, int final ) )
+{
+	glb.keep_test = fn;
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_set_parent
+ Returns Type	: MIME_element *, the parent set before
+ ----Parameter List
+ 1. MIME_element *m, part being looked inside, NULL for none
+ ------------------
+ Comments:
+ Parts added with no parent of their own, as the TNEF, OLE, uuencode
+ and yEnc decoders add them, are given m as their parent until the
+ previous parent is set back.
+ \------------------------------------------------------------------*/
+MIME_element *MIME_element_set_parent( MIME_element *m )
+{
+	MIME_element *previous = glb.parent;
+
+	glb.parent = m;
+	return previous;
+}
+
+/* The output directory, opened once per message.  Parts are created,
+ * linked, unlinked and examined relative to it, so the kernel does not
+ * walk the whole directory path again for every file, and a directory
+ * renamed or replaced part way through cannot split the output. */
+static struct
+{
+	char *dir;
+	int fd;
+} MIME_outdir = { NULL, -1 };
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_output_dirfd
+ Returns Type	: int
+ ----Parameter List
+ 1. RIPMIME_output *unpack_metadata,
+ ------------------
+ Exit Codes	: descriptor of unpack_metadata->dir, -1 if it cannot be opened
+ Comments:
+ The descriptor stays open until the end of the message, and
+ belongs to this module; callers must not close it.
+ \------------------------------------------------------------------*/
+int MIME_output_dirfd( RIPMIME_output *unpack_metadata )
+{
+	if ((MIME_outdir.fd != -1)&&(strcmp(MIME_outdir.dir, unpack_metadata->dir) == 0)) return MIME_outdir.fd;
+
+	MIME_output_dirfd_close();
+	MIME_outdir.fd = open(unpack_metadata->dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (MIME_outdir.fd == -1)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot open output directory '%s' (%s)",FL,__func__,unpack_metadata->dir,strerror(errno));
+		return -1;
+	}
+	MIME_outdir.dir = strdup(unpack_metadata->dir);
+	if (MIME_outdir.dir == NULL)
+	{
+		close(MIME_outdir.fd);
+		MIME_outdir.fd = -1;
+	}
+	return MIME_outdir.fd;
+}
+
+void MIME_output_dirfd_close( void )
+{
+	if (MIME_outdir.fd != -1) close(MIME_outdir.fd);
+	free(MIME_outdir.dir);
+	MIME_outdir.dir = NULL;
+	MIME_outdir.fd = -1;
+}
+
+/* The content-addressed store which MIME_sink_store links parts into,
+ * see RIPMIME_output.dedup_store.  Opened, and created if need be, on
+ * the first part of each message which goes there. */
+static struct
+{
+	char *dir;
+	int fd;
+} MIME_store = { NULL, -1 };
+
+static void MIME_store_dirfd_close( void )
+{
+	if (MIME_store.fd != -1) close(MIME_store.fd);
+	free(MIME_store.dir);
+	MIME_store.dir = NULL;
+	MIME_store.fd = -1;
+}
+
+static int MIME_store_dirfd( RIPMIME_output *unpack_metadata )
+{
+	if ((MIME_store.fd != -1)&&(strcmp(MIME_store.dir, unpack_metadata->dedup_store) == 0)) return MIME_store.fd;
+
+	MIME_store_dirfd_close();
+	if ((mkdir(unpack_metadata->dedup_store, S_IRWXU) == -1)&&(errno != EEXIST))
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot create dedup store '%s' (%s)",FL,__func__,unpack_metadata->dedup_store,strerror(errno));
+		return -1;
+	}
+	MIME_store.fd = open(unpack_metadata->dedup_store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (MIME_store.fd == -1)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot open dedup store '%s' (%s)",FL,__func__,unpack_metadata->dedup_store,strerror(errno));
+		return -1;
+	}
+	MIME_store.dir = strdup(unpack_metadata->dedup_store);
+	if (MIME_store.dir == NULL)
+	{
+		close(MIME_store.fd);
+		MIME_store.fd = -1;
+	}
+	return MIME_store.fd;
+}
+
+/* The tar or cpio stream which MIME_sink_archive appends parts to, see
+ * MIME_archive_open() */
+struct mime_sink_fd;
+
+static struct
+{
+	struct mime_sink_fd *out;	// NULL while no archive is open
+	int format;
+	time_t mtime;
+	unsigned long ino;	// cpio entries need distinct inode numbers
+	char *manifest;
+	size_t manifest_l, manifest_size;
+} MIME_archive;
+
+/* Output names issued so far, relative to the output directory.  'next' is the
+ * suffix count to carry on from when the same name is asked for again,
+ * so a mailpack with hundreds of image001.png parts does not probe
+ * image001_1.png, image001_2.png ... over and over. */
+struct MIME_name
+{
+	char *path;
+	int next;
+	struct MIME_name *chain;
+};
+
+static struct
+{
+	struct MIME_name **buckets;
+	size_t size;
+	size_t count;
+} MIME_names;
+
+static size_t MIME_name_hash( const char *path, size_t size )
+{
+	size_t h = 2166136261u;
+
+	while (*path) { h ^= (unsigned char)*path++; h *= 16777619u; }
+	return h & (size -1);
+}
+
+static struct MIME_name *MIME_name_find( const char *name )
+{
+	struct MIME_name *n;
+
+	if (MIME_names.size == 0) return NULL;
+	for (n = MIME_names.buckets[MIME_name_hash(name, MIME_names.size)]; n != NULL; n = n->chain)
+	{
+		if (strcmp(n->path, name) == 0) return n;
+	}
+	return NULL;
+}
+
+static struct MIME_name *MIME_name_add( const char *name )
+{
+	struct MIME_name *n;
+	size_t h;
+
+	// Keep the chains short by doubling the table once it is full
+	if (MIME_names.count >= MIME_names.size)
+	{
+		size_t size = MIME_names.size ? MIME_names.size *2 : 64;
+		struct MIME_name **buckets = calloc(size, sizeof(struct MIME_name *));
+		size_t i;
+
+		if (buckets == NULL) return NULL;
+		for (i = 0; i < MIME_names.size; i++)
+		{
+			while ((n = MIME_names.buckets[i]) != NULL)
+			{
+				MIME_names.buckets[i] = n->chain;
+				h = MIME_name_hash(n->path, size);
+				n->chain = buckets[h];
+				buckets[h] = n;
+			}
+		}
+		free(MIME_names.buckets);
+		MIME_names.buckets = buckets;
+		MIME_names.size = size;
+	}
+
+	n = malloc(sizeof(struct MIME_name));
+	if (n == NULL) return NULL;
+	n->path = strdup(name);
+	if (n->path == NULL) { free(n); return NULL; }
+	n->next = 1;
+	h = MIME_name_hash(name, MIME_names.size);
+	n->chain = MIME_names.buckets[h];
+	MIME_names.buckets[h] = n;
+	MIME_names.count++;
+	return n;
+}
+
+static void MIME_names_clear( void )
+{
+	size_t i;
+	struct MIME_name *n;
+
+	for (i = 0; i < MIME_names.size; i++)
+	{
+		while ((n = MIME_names.buckets[i]) != NULL)
+		{
+			MIME_names.buckets[i] = n->chain;
+			free(n->path);
+			free(n);
+		}
+	}
+	free(MIME_names.buckets);
+	MIME_names.buckets = NULL;
+	MIME_names.size = 0;
+	MIME_names.count = 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_name_claim
+ Returns Type	: int
+ ----Parameter List
+ 1. int dirfd, the output directory
+ 2. const char *name, candidate output file within it
+ ------------------
+ Exit Codes	: 1 if the name is now ours, 0 if it is taken
+ Comments:
+ Names already issued are refused without going near the disk.  For
+ the rest, creating the file with O_EXCL both tests and reserves the
+ name in one step; the sink later truncates the empty file.  Errors
+ other than EEXIST are left for the sink to report when it opens.
+ \------------------------------------------------------------------*/
+static int MIME_name_claim( int dirfd, const char *name )
+{
+	int fd;
+
+	if (MIME_name_find(name) != NULL) return 0;
+
+	// Archive members only need to be unique within the archive
+	if (dirfd == -1)
+	{
+		MIME_name_add(name);
+		return 1;
+	}
+
+	fd = openat(dirfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if ((fd == -1)&&(errno == EEXIST)) return 0;
+	if (fd != -1) close(fd);
+
+	MIME_name_add(name);
+	return 1;
+}
+
+
+void all_MIME_elements_init (void)
+{
+	all_MIME_elements.mime_count = 0;
+	arrayInit(&(all_MIME_elements.mime_arr));
+	all_MIME_elements.total_bytes = 0;
+	all_MIME_elements.files = 0;
+	all_MIME_elements.memory_bytes = 0;
+	all_MIME_elements.budget_exceeded = NULL;
+	glb.parent = NULL;
+	// An archive spans every message unpacked while it is open, so its
+	//	names have to stay unique across them
+	if (MIME_archive.out == NULL) MIME_names_clear();
+	MIME_output_dirfd_close();
+	MIME_store_dirfd_close();
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_exceed_budget
+ Returns Type	: void
+ ----Parameter List
+ 1. const char *budget, which of the struct mime_budget limits it was
+ ------------------
+ Comments:
+ Records that the message has gone over one of its budgets.  From
+ here on no new part is opened and no further data is accepted, so
+ the decoders unwind as quickly as they can.
+ \------------------------------------------------------------------*/
+void MIME_element_exceed_budget( const char *budget )
+{
+	if (all_MIME_elements.budget_exceeded != NULL) return;
+
+	all_MIME_elements.budget_exceeded = budget;
+	LOGGER_log("%s:%d:%s:WARNING: The %s budget has been exceeded, abandoning the message",FL,__func__,budget);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_budget_exceeded
+ Returns Type	: const char *
+ ----Parameter List
+ ------------------
+ Comments:
+ The budget the message went over, or NULL if it is within them all.
+ \------------------------------------------------------------------*/
+const char *MIME_element_budget_exceeded( void )
+{
+	return all_MIME_elements.budget_exceeded;
+}
+
+/* The part ends up as a file of its own in the output directory */
+static int MIME_element_on_disk( MIME_element *cur )
+{
+	return (cur->sink == &MIME_sink_directory)||(cur->sink == &MIME_sink_store);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_unclaim
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element *cur, a part which will not be opened after all
+ ------------------
+ Comments:
+ Removes the empty file left by MIME_name_claim() for the part.
+ \------------------------------------------------------------------*/
+static void MIME_element_unclaim( MIME_element *cur )
+{
+	struct stat st;
+
+	if (!MIME_element_on_disk(cur)) return;
+	if ((MIME_outdir.fd == -1)||(MIME_name_find(cur->filename) == NULL)) return;
+	if ((fstatat(MIME_outdir.fd, cur->filename, &st, AT_SYMLINK_NOFOLLOW) == 0)&&(st.st_size == 0)) unlinkat(MIME_outdir.fd, cur->filename, 0);
+}
+
+/* The part is, or may yet be, held in memory */
+static int MIME_element_in_memory( MIME_element *cur )
+{
+	return (cur->sink == &MIME_sink_memory)||(cur->sink == &MIME_sink_discard)||(cur->sink == &MIME_sink_scratch)||(cur->mem_filearea != NULL);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_forget_resident
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element *cur,
+ ------------------
+ Comments:
+ The part's buffer has been freed or handed over to the embedder, so
+ it no longer counts against the memory budget.
+ \------------------------------------------------------------------*/
+static void MIME_element_forget_resident( MIME_element *cur )
+{
+	all_MIME_elements.memory_bytes -= cur->resident;
+	cur->resident = 0;
+}
+
+all_MIME_elements_s all_MIME_elements;
+
+static char * dup_ini(char* s)
+{
+	return (s != NULL) ? strdup(s) : "\0";
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_sink_*
+ Returns Type	: int, 0 on success
+ ------------------
+ Comments:
+ The built-in output sinks.
+
+ directory	writes each part to its own file with plain write(2)
+		calls, gathering the small writes of the text decoders
+		into a per-part buffer first.
+ memory		grows a malloc'd buffer per part, which becomes the
+		element's mem_filearea.
+ callback	keeps nothing; the data only goes to the part events.
+ digest		computes the MD5 and SHA-256 of the part as it is written.
+		The content is only kept if the post-decoders are
+		going to look inside the part, see MIME_sink_head_write().
+		Nothing is written to disk.
+ null		throws the data away and fires no events.
+ discard	as null, but like digest holds on to a part the
+		post-decoders are going to look inside.
+ scratch	as memory, but fires no events; for sections which are
+		read back and then thrown away.
+ archive	appends each part, once complete, to the open tar or
+		cpio archive; see MIME_sink_archive_open().
+ store		as directory, but parts whose encoded form has been
+		seen before are hardlinked from the dedup store rather
+		than decoded again, see MIME_element_store_key().
+ \------------------------------------------------------------------*/
+#define MIME_SINK_BUFFER_SIZE 8192
+
+struct mime_sink_fd
+{
+	int dirfd;
+	int fd;
+	size_t used;
+	char buffer[MIME_SINK_BUFFER_SIZE];
+};
+
+struct mime_sink_mem
+{
+	size_t capacity;
+};
+
+struct mime_sink_head
+{
+	struct mime_sink_mem mem;
+	int keep;	// -1 until the keep test has decided
+	size_t ask;	// held bytes at which to ask it again
+};
+
+struct mime_sink_digest
+{
+	struct mime_sink_head head;
+	struct DIGEST_md5 md5;
+	struct DIGEST_sha256 sha256;
+};
+
+static int MIME_sink_write_fd( int fd, const char *buf, size_t len )
+{
+	while (len > 0)
+	{
+		ssize_t written = write(fd, buf, len);
+
+		if (written == -1)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int MIME_sink_directory_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	struct mime_sink_fd *s;
+
+	s = malloc(sizeof(struct mime_sink_fd));
+	if (s == NULL) return -1;
+
+	s->dirfd = MIME_output_dirfd(unpack_metadata);
+	s->fd = (s->dirfd == -1) ? -1 : openat(s->dirfd, m->filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (s->fd == -1)
+	{
+		free(s);
+		return -1;
+	}
+	s->used = 0;
+	m->sink_data = s;
+	return 0;
+}
+
+static int MIME_sink_fd_write( struct mime_sink_fd *s, const char *buf, size_t len )
+{
+	if (s->used + len > MIME_SINK_BUFFER_SIZE)
+	{
+		if (MIME_sink_write_fd(s->fd, s->buffer, s->used) != 0) return -1;
+		s->used = 0;
+		if (len >= MIME_SINK_BUFFER_SIZE) return MIME_sink_write_fd(s->fd, buf, len);
+	}
+	memcpy(s->buffer + s->used, buf, len);
+	s->used += len;
+	return 0;
+}
+
+static int MIME_sink_directory_write( MIME_element *m, const char *buf, size_t len )
+{
+	return MIME_sink_fd_write(m->sink_data, buf, len);
+}
+
+static int MIME_sink_directory_close( MIME_element *m )
+{
+	struct mime_sink_fd *s = m->sink_data;
+	int result;
+
+	result = MIME_sink_write_fd(s->fd, s->buffer, s->used);
+	if (close(s->fd) != 0) result = -1;
+	free(s);
+	m->sink_data = NULL;
+	return result;
+}
+
+static int MIME_sink_directory_abort( MIME_element *m )
+{
+	struct mime_sink_fd *s = m->sink_data;
+
+	close(s->fd);
+	unlinkat(s->dirfd, m->filename, 0);
+	free(s);
+	m->sink_data = NULL;
+	return 0;
+}
+
+static int MIME_sink_memory_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	m->sink_data = calloc(1, sizeof(struct mime_sink_mem));
+	return (m->sink_data == NULL) ? -1 : 0;
+}
+
+static int MIME_sink_memory_write( MIME_element *m, const char *buf, size_t len )
+{
+	struct mime_sink_mem *s = m->sink_data;
+
+	// Keep one spare byte so the buffer can always be NUL terminated
+	if (m->mem_filearea_l + len >= s->capacity)
+	{
+		size_t capacity = s->capacity ? s->capacity : 4096;
+		char *p;
+
+		while (m->mem_filearea_l + len >= capacity) capacity <<= 1;
+		p = realloc(m->mem_filearea, capacity);
+		if (p == NULL) return -1;
+		m->mem_filearea = p;
+		s->capacity = capacity;
+	}
+	memcpy(m->mem_filearea + m->mem_filearea_l, buf, len);
+	m->mem_filearea_l += len;
+	m->mem_filearea[m->mem_filearea_l] = '\0';
+	return 0;
+}
+
+static int MIME_sink_memory_close( MIME_element *m )
+{
+	free(m->sink_data);
+	m->sink_data = NULL;
+	return 0;
+}
+
+static int MIME_sink_memory_abort( MIME_element *m )
+{
+	MIME_sink_memory_close(m);
+	free(m->mem_filearea);
+	m->mem_filearea = NULL;
+	m->mem_filearea_l = 0;
+	return 0;
+}
+
+static void MIME_sink_head_decide( MIME_element *m, int final )
+{
+	struct mime_sink_head *s = m->sink_data;
+
+	s->keep = (glb.keep_test == NULL) ? 1 : glb.keep_test(m, final);
+	if ((s->keep == -1)&&(final)) s->keep = 1;
+	if (s->keep == 0)
+	{
+		free(m->mem_filearea);
+		m->mem_filearea = NULL;
+		m->mem_filearea_l = 0;
+		s->mem.capacity = 0;
+	}
+	if ((s->keep != -1)&&(MIME_DNORMAL)) LOGGER_log("%s:%d:%s:DEBUG: %s %s",FL,__func__,m->fullpath,s->keep ? "kept for the post-decoders" : "not kept");
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_sink_head_write
+ Returns Type	: int, 0 on success
+ ----Parameter List
+ 1. MIME_element *m,
+ 2. const char *buf,
+ 3. size_t len,
+ ------------------
+ Comments:
+ For the sinks which keep a part only if the post-decoders are going
+ to read it back (TNEF, OLE, a message to reparse).  The part is held
+ in mem_filearea until the keep test can tell, which is once the head
+ is full for most parts, or once the first lines have been seen for
+ those which might be a message; then it is either kept whole or
+ dropped, and nothing more is held.  The test is asked again each
+ time what is held doubles.
+ \------------------------------------------------------------------*/
+static int MIME_sink_head_write( MIME_element *m, const char *buf, size_t len )
+{
+	struct mime_sink_head *s = m->sink_data;
+
+	if (s->keep == 0) return 0;
+	if (MIME_sink_memory_write(m, buf, len) != 0) return -1;
+	if ((s->keep == -1)&&(m->mem_filearea_l >= s->ask))
+	{
+		MIME_sink_head_decide(m, 0);
+		s->ask = m->mem_filearea_l *2;
+	}
+	return 0;
+}
+
+static int MIME_sink_head_close( MIME_element *m )
+{
+	struct mime_sink_head *s = m->sink_data;
+
+	if (s->keep == -1) MIME_sink_head_decide(m, 1);
+	return MIME_sink_memory_close(m);
+}
+
+static int MIME_sink_digest_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	struct mime_sink_digest *s;
+
+	s = calloc(1, sizeof(struct mime_sink_digest));
+	if (s == NULL) return -1;
+
+	s->head.keep = -1;
+	s->head.ask = MIME_ELEMENT_HEAD_SIZE;
+	DIGEST_md5_init(&(s->md5));
+	DIGEST_sha256_init(&(s->sha256));
+	m->sink_data = s;
+	return 0;
+}
+
+static int MIME_sink_digest_write( MIME_element *m, const char *buf, size_t len )
+{
+	struct mime_sink_digest *s = m->sink_data;
+
+	DIGEST_md5_update(&(s->md5), buf, len);
+	DIGEST_sha256_update(&(s->sha256), buf, len);
+	return MIME_sink_head_write(m, buf, len);
+}
+
+static int MIME_sink_digest_close( MIME_element *m )
+{
+	struct mime_sink_digest *s = m->sink_data;
+
+	DIGEST_md5_final(&(s->md5), m->md5);
+	DIGEST_sha256_final(&(s->sha256), m->sha256);
+	m->digested = 1;
+	return MIME_sink_head_close(m);
+}
+
+static int MIME_sink_discard_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	struct mime_sink_head *s;
+
+	s = calloc(1, sizeof(struct mime_sink_head));
+	if (s == NULL) return -1;
+
+	s->keep = -1;
+	s->ask = MIME_ELEMENT_HEAD_SIZE;
+	m->sink_data = s;
+	return 0;
+}
+
+static int MIME_sink_none_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	return 0;
+}
+
+static int MIME_sink_none_write( MIME_element *m, const char *buf, size_t len )
+{
+	return 0;
+}
+
+static int MIME_sink_none_close( MIME_element *m )
+{
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_archive_pad
+ Returns Type	: int
+ ----Parameter List
+ 1. size_t len, bytes written since the last boundary
+ 2. size_t block, 512 for tar, 4 for cpio
+ ------------------
+ \------------------------------------------------------------------*/
+static int MIME_archive_pad( size_t len, size_t block )
+{
+	static const char zeros[512];
+
+	if (len % block == 0) return 0;
+	return MIME_sink_fd_write(MIME_archive.out, zeros, block -(len % block));
+}
+
+static int MIME_archive_tar_header( const char *name, size_t size, char type )
+{
+	char h[512];
+	unsigned int sum = 0;
+	int i;
+
+	memset(h, 0, sizeof(h));
+	strncpy(h, name, 100);
+	snprintf(h +100, 8, "%07o", 0644);
+	snprintf(h +108, 8, "%07o", 0);
+	snprintf(h +116, 8, "%07o", 0);
+	snprintf(h +124, 12, "%011lo", (unsigned long)size);
+	snprintf(h +136, 12, "%011lo", (unsigned long)MIME_archive.mtime);
+	memset(h +148, ' ', 8);
+	h[156] = type;
+	memcpy(h +257, "ustar", 6);
+	memcpy(h +263, "00", 2);
+
+	for (i = 0; i < 512; i++) sum += (unsigned char)h[i];
+	snprintf(h +148, 8, "%06o", sum);
+
+	return MIME_sink_fd_write(MIME_archive.out, h, sizeof(h));
+}
+
+/* Appends a pax 'length key=value\n' record, whose length counts its own digits */
+static size_t MIME_archive_pax_record( char *pax, size_t size, const char *key, const char *value )
+{
+	int n = strlen(key) + strlen(value) + 3;
+	int l = n + 1;
+
+	while (l != n + snprintf(NULL, 0, "%d", l)) l = n + snprintf(NULL, 0, "%d", l);
+	return snprintf(pax, size, "%d %s=%s\n", l, key, value);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_archive_tar_start
+ Returns Type	: int
+ ----Parameter List
+ 1. const char *name,
+ 2. size_t len, of the data to follow
+ ------------------
+ Comments:
+ Names longer than the 100 bytes of a ustar header, and sizes beyond
+ its 11 octal digits, go in a pax extended header ahead of the entry.
+ \------------------------------------------------------------------*/
+static int MIME_archive_tar_start( const char *name, size_t len )
+{
+	char pax[_FS_PATH_MAX +64];
+	size_t pax_l = 0;
+
+	if (strlen(name) > 100)
+	{
+		pax_l += MIME_archive_pax_record(pax +pax_l, sizeof(pax) -pax_l, "path", name);
+	}
+	if ((unsigned long long)len > 077777777777ULL)
+	{
+		char value[24];
+
+		snprintf(value, sizeof(value), "%llu", (unsigned long long)len);
+		pax_l += MIME_archive_pax_record(pax +pax_l, sizeof(pax) -pax_l, "size", value);
+	}
+	if (pax_l > sizeof(pax) -1) return -1;
+
+	if (pax_l > 0)
+	{
+		if (MIME_archive_tar_header("PaxHeader", pax_l, 'x') != 0) return -1;
+		if (MIME_sink_fd_write(MIME_archive.out, pax, pax_l) != 0) return -1;
+		if (MIME_archive_pad(pax_l, 512) != 0) return -1;
+	}
+
+	return MIME_archive_tar_header(name, (len > 077777777777ULL) ? 0 : len, '0');
+}
+
+/* The newc header is the magic and thirteen 8 digit hex fields; h has
+ * room for 16 digit fields so that nothing is cut short if a value is
+ * ever more than 32 bits, which is caught instead. */
+#define MIME_CPIO_HEADER_SIZE 110
+
+static int MIME_archive_cpio_start( const char *name, size_t len, unsigned long mode )
+{
+	char h[6 +13*16 +1];
+	size_t name_l = strlen(name) +1;
+
+	if ((unsigned long long)len > 0xffffffffULL)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: %s is too large for a cpio archive",FL,__func__,name);
+		return -1;
+	}
+
+	if (snprintf(h, sizeof(h), "070701%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX%08lX"
+			, ++MIME_archive.ino, mode, 0UL, 0UL, 1UL, (unsigned long)MIME_archive.mtime, (unsigned long)len
+			, 0UL, 0UL, 0UL, 0UL, (unsigned long)name_l, 0UL) != MIME_CPIO_HEADER_SIZE)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot fit the cpio header for %s",FL,__func__,name);
+		return -1;
+	}
+	if (MIME_sink_fd_write(MIME_archive.out, h, MIME_CPIO_HEADER_SIZE) != 0) return -1;
+	if (MIME_sink_fd_write(MIME_archive.out, name, name_l) != 0) return -1;
+	return MIME_archive_pad(MIME_CPIO_HEADER_SIZE +name_l, 4);
+}
+
+/* A member is started with the header for len bytes, which the caller
+ * then writes, and ended with the padding after them */
+static int MIME_archive_start( const char *name, size_t len )
+{
+	if (MIME_archive.format == MIME_ARCHIVE_CPIO) return MIME_archive_cpio_start(name, len, 0100644);
+	return MIME_archive_tar_start(name, len);
+}
+
+static int MIME_archive_end( size_t len )
+{
+	return MIME_archive_pad(len, (MIME_archive.format == MIME_ARCHIVE_CPIO) ? 4 : 512);
+}
+
+static int MIME_archive_entry( const char *name, const char *data, size_t len )
+{
+	if (MIME_archive_start(name, len) != 0) return -1;
+	if (MIME_sink_fd_write(MIME_archive.out, data, len) != 0) return -1;
+	return MIME_archive_end(len);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_archive_open
+ Returns Type	: int
+ ----Parameter List
+ 1. const char *path, file to write the archive to, "-" for stdout
+ 2. int format, MIME_ARCHIVE_TAR or MIME_ARCHIVE_CPIO
+ ------------------
+ Exit Codes	: 0 on success, -1 if the archive cannot be created
+ Comments:
+ From here until MIME_archive_close(), parts given to
+ MIME_sink_archive are appended to the one archive, whatever the
+ number of messages unpacked in between.
+ \------------------------------------------------------------------*/
+int MIME_archive_open( const char *path, int format )
+{
+	int fd;
+
+	if (MIME_archive.out != NULL) MIME_archive_close();
+
+	fd = (strcmp(path, "-") == 0) ? STDOUT_FILENO : open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd == -1)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot open archive '%s' for writing (%s)",FL,__func__,path,strerror(errno));
+		return -1;
+	}
+
+	MIME_archive.out = malloc(sizeof(struct mime_sink_fd));
+	if (MIME_archive.out == NULL)
+	{
+		if (fd != STDOUT_FILENO) close(fd);
+		return -1;
+	}
+	MIME_archive.out->dirfd = -1;
+	MIME_archive.out->fd = fd;
+	MIME_archive.out->used = 0;
+	MIME_archive.format = format;
+	MIME_archive.mtime = time(NULL);
+	MIME_archive.ino = 0;
+	MIME_archive.manifest = NULL;
+	MIME_archive.manifest_l = MIME_archive.manifest_size = 0;
+	MIME_names_clear();
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_archive_close
+ Returns Type	: int
+ ----Parameter List
+ ------------------
+ Exit Codes	: 0 on success, -1 if the archive could not be completed
+ Comments:
+ Appends the manifest, a line of 'id|name|size|content type|parent id'
+ for every member, as the last member '_manifest_', then the end of
+ archive marker.  The parent is the part the member was found inside
+ (a message, TNEF, OLE or text part), 0 if none.
+ \------------------------------------------------------------------*/
+int MIME_archive_close( void )
+{
+	int result = 0;
+
+	if (MIME_archive.out == NULL) return 0;
+
+	if (MIME_archive_entry("_manifest_", MIME_archive.manifest ? MIME_archive.manifest : "", MIME_archive.manifest_l) != 0) result = -1;
+
+	if (MIME_archive.format == MIME_ARCHIVE_CPIO)
+	{
+		if (MIME_archive_cpio_start("TRAILER!!!", 0, 0) != 0) result = -1;
+	}
+	else
+	{
+		static const char zeros[1024];
+
+		if (MIME_sink_fd_write(MIME_archive.out, zeros, sizeof(zeros)) != 0) result = -1;
+	}
+
+	if (MIME_sink_write_fd(MIME_archive.out->fd, MIME_archive.out->buffer, MIME_archive.out->used) != 0) result = -1;
+	if (MIME_archive.out->fd != STDOUT_FILENO)
+	{
+		if (close(MIME_archive.out->fd) != 0) result = -1;
+	}
+	if (result != 0) LOGGER_log("%s:%d:%s:ERROR: Cannot complete the archive (%s)",FL,__func__,strerror(errno));
+
+	free(MIME_archive.out);
+	MIME_archive.out = NULL;
+	free(MIME_archive.manifest);
+	MIME_archive.manifest = NULL;
+	MIME_names_clear();
+
+	return result;
+}
+
+static int MIME_archive_manifest_add( MIME_element *m )
+{
+	int l;
+
+	l = snprintf(NULL, 0, "%d|%s|%lu|%s|%d\n", m->id +1, m->filename, (unsigned long)m->size, m->content_type_string ? m->content_type_string : "", m->parent ? m->parent->id +1 : 0);
+	if (MIME_archive.manifest_l +l +1 > MIME_archive.manifest_size)
+	{
+		size_t size = MIME_archive.manifest_size ? MIME_archive.manifest_size : 4096;
+		char *p;
+
+		while (MIME_archive.manifest_l +l +1 > size) size <<= 1;
+		p = realloc(MIME_archive.manifest, size);
+		if (p == NULL) return -1;
+		MIME_archive.manifest = p;
+		MIME_archive.manifest_size = size;
+	}
+	snprintf(MIME_archive.manifest +MIME_archive.manifest_l, l +1, "%d|%s|%lu|%s|%d\n", m->id +1, m->filename, (unsigned long)m->size, m->content_type_string ? m->content_type_string : "", m->parent ? m->parent->id +1 : 0);
+	MIME_archive.manifest_l += l;
+	return 0;
+}
+
+/* The size has to be known before a member's header can be written, so
+ * the archive sink holds each part until it is complete, then appends
+ * it to the archive.  Parts which outgrow the hold buffer are spooled to
+ * an anonymous memfd, or an unlinked file in the output directory, and
+ * copied across from there.  Like the digest sink it also keeps a part
+ * in mem_filearea for the post-decoders if the keep test wants it. */
+#define MIME_ARCHIVE_HOLD_SIZE (64 *1024)
+
+struct mime_sink_archive
+{
+	struct mime_sink_head head;	// see MIME_sink_head_write()
+	int spool;			// -1 while the part is held
+	size_t held;
+	char hold[MIME_ARCHIVE_HOLD_SIZE];
+};
+
+static int MIME_sink_archive_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	struct mime_sink_archive *s;
+
+	if (MIME_archive.out == NULL)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: No archive is open, see MIME_archive_open()",FL,__func__);
+		return -1;
+	}
+
+	s = malloc(sizeof(struct mime_sink_archive));
+	if (s == NULL) return -1;
+
+	memset(&(s->head), 0, sizeof(s->head));
+	s->head.keep = -1;
+	s->head.ask = MIME_ELEMENT_HEAD_SIZE;
+	s->spool = -1;
+	s->held = 0;
+	m->sink_data = s;
+	return 0;
+}
+
+static int MIME_sink_archive_spill( MIME_element *m, struct mime_sink_archive *s )
+{
+	char fname[_FS_PATH_MAX +32];
+
+	s->spool = memfd_create("ripmime-archive", MFD_CLOEXEC);
+	if (s->spool == -1)
+	{
+		snprintf(fname, sizeof(fname), "%s/ripmime.XXXXXX", m->directory);
+		s->spool = mkstemp(fname);
+		if (s->spool == -1)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot create temporary file '%s' (%s)",FL,__func__, fname, strerror(errno));
+			return -1;
+		}
+		unlink(fname);
+	}
+	if (MIME_sink_write_fd(s->spool, s->hold, s->held) != 0) return -1;
+	s->held = 0;
+	return 0;
+}
+
+static int MIME_sink_archive_write( MIME_element *m, const char *buf, size_t len )
+{
+	struct mime_sink_archive *s = m->sink_data;
+
+	if ((s->spool == -1)&&(s->held +len > sizeof(s->hold)))
+	{
+		if (MIME_sink_archive_spill(m, s) != 0) return -1;
+	}
+	if (s->spool != -1)
+	{
+		if (MIME_sink_write_fd(s->spool, buf, len) != 0) return -1;
+	}
+	else
+	{
+		memcpy(s->hold +s->held, buf, len);
+		s->held += len;
+	}
+	return MIME_sink_head_write(m, buf, len);
+}
 
-void all_MIME_elements_init (void)
+/* Copies the spooled part into the archive */
+static int MIME_sink_archive_copy( struct mime_sink_archive *s, size_t len )
 {
-	all_MIME_elements.mime_count = 0;
-	arrayInit(&(all_MIME_elements.mime_arr));
+	off_t offset = 0;
+
+	while ((size_t)offset < len)
+	{
+		ssize_t got = pread(s->spool, s->hold, sizeof(s->hold), offset);
+
+		if (got == -1)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (got == 0) return -1;
+		if (MIME_sink_fd_write(MIME_archive.out, s->hold, got) != 0) return -1;
+		offset += got;
+	}
+	return 0;
 }
 
-all_MIME_elements_s all_MIME_elements;
+static void MIME_sink_archive_free( MIME_element *m )
+{
+	struct mime_sink_archive *s = m->sink_data;
 
-static char * dup_ini(char* s)
+	if (s->spool != -1) close(s->spool);
+	free(s);
+	m->sink_data = NULL;
+}
+
+static int MIME_sink_archive_close( MIME_element *m )
 {
-	return (s != NULL) ? strdup(s) : "\0";
+	struct mime_sink_archive *s = m->sink_data;
+	int result;
+
+	result = MIME_archive_start(m->filename, m->size);
+	if (result == 0)
+	{
+		if (s->spool != -1) result = MIME_sink_archive_copy(s, m->size);
+		else result = MIME_sink_fd_write(MIME_archive.out, s->hold, s->held);
+	}
+	if (result == 0) result = MIME_archive_end(m->size);
+	if (result == 0) result = MIME_archive_manifest_add(m);
+	if (s->head.keep == -1) MIME_sink_head_decide(m, 1);
+	MIME_sink_archive_free(m);
+	return result;
+}
+
+static int MIME_sink_archive_abort( MIME_element *m )
+{
+	MIME_sink_archive_free(m);
+	free(m->mem_filearea);
+	m->mem_filearea = NULL;
+	m->mem_filearea_l = 0;
+	return 0;
+}
+
+/* The store sink is given the key of a part's encoded span before the
+ * part is decoded, see MIME_element_store_key().  A part the store has
+ * already is linked in from there and never decoded at all; any other
+ * is written out like the directory sink does, and linked into the
+ * store once complete.  Small parts are held in memory until then, so
+ * one which fails part way is never created. */
+#define MIME_STORE_HOLD_SIZE (256 *1024)
+
+struct mime_sink_store
+{
+	struct mime_sink_fd out;	// out.fd is -1 while the part is held
+	int storefd;			// -1 if the store could not be opened
+	int keyed;			// key is set
+	char entry[DIGEST_SHA256_LEN *2 +2];	// the key as a store entry, ab/cdef...
+	size_t held;
+	char hold[MIME_STORE_HOLD_SIZE];
+};
+
+static int MIME_sink_store_open( MIME_element *m, RIPMIME_output *unpack_metadata )
+{
+	struct mime_sink_store *s;
+
+	s = malloc(sizeof(struct mime_sink_store));
+	if (s == NULL) return -1;
+
+	s->out.dirfd = MIME_output_dirfd(unpack_metadata);
+	if (s->out.dirfd == -1)
+	{
+		free(s);
+		return -1;
+	}
+	s->out.fd = -1;
+	s->out.used = 0;
+	s->storefd = MIME_store_dirfd(unpack_metadata);
+	s->keyed = 0;
+	s->held = 0;
+	m->sink_data = s;
+	return 0;
+}
+
+static int MIME_sink_store_spill( MIME_element *m, struct mime_sink_store *s )
+{
+	// A file of the same name may be a link to a store entry, which
+	//	must not be truncated along with it
+	unlinkat(s->out.dirfd, m->filename, 0);
+	s->out.fd = openat(s->out.dirfd, m->filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (s->out.fd == -1) return -1;
+	if (MIME_sink_fd_write(&(s->out), s->hold, s->held) != 0) return -1;
+	s->held = 0;
+	return 0;
+}
+
+static int MIME_sink_store_write( MIME_element *m, const char *buf, size_t len )
+{
+	struct mime_sink_store *s = m->sink_data;
+
+	if (m->stored) return 0;
+	if ((s->out.fd == -1)&&(s->held + len <= MIME_STORE_HOLD_SIZE))
+	{
+		memcpy(s->hold + s->held, buf, len);
+		s->held += len;
+		return 0;
+	}
+	if ((s->out.fd == -1)&&(MIME_sink_store_spill(m, s) != 0)) return -1;
+	return MIME_sink_fd_write(&(s->out), buf, len);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_sink_store_close
+ Returns Type	: int
+ ----Parameter List
+ 1. MIME_element *m,
+ ------------------
+ Comments:
+ The part just decoded is linked into the store under its key.
+ Should the store be on another filesystem the part is simply kept
+ as it is.
+ \------------------------------------------------------------------*/
+static int MIME_sink_store_close( MIME_element *m )
+{
+	struct mime_sink_store *s = m->sink_data;
+	int result = 0;
+
+	if (!m->stored)
+	{
+		if (s->out.fd == -1) result = MIME_sink_store_spill(m, s);
+		if ((s->out.fd != -1)&&(MIME_sink_write_fd(s->out.fd, s->out.buffer, s->out.used) != 0)) result = -1;
+		if ((s->out.fd != -1)&&(close(s->out.fd) != 0)) result = -1;
+	}
+
+	if ((result == 0)&&(!m->stored)&&(s->keyed)&&(s->storefd != -1))
+	{
+		s->entry[2] = '\0';
+		mkdirat(s->storefd, s->entry, S_IRWXU);
+		s->entry[2] = '/';
+		if ((linkat(s->out.dirfd, m->filename, s->storefd, s->entry, 0) != 0)&&(errno != EEXIST)&&(MIME_DNORMAL))
+		{
+			LOGGER_log("%s:%d:%s:DEBUG: Cannot add %s to the store (%s)",FL,__func__,m->filename,strerror(errno));
+		}
+	}
+	free(s);
+	m->sink_data = NULL;
+	return result;
+}
+
+static int MIME_sink_store_abort( MIME_element *m )
+{
+	struct mime_sink_store *s = m->sink_data;
+
+	if (s->out.fd != -1) close(s->out.fd);
+	unlinkat(s->out.dirfd, m->filename, 0);
+	free(s);
+	m->sink_data = NULL;
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_store_key
+ Returns Type	: int
+ ----Parameter List
+ 1. MIME_element* cur, a part just added, nothing written to it yet
+ 2. const unsigned char *key, DIGEST_SHA256_LEN bytes
+ ------------------
+ Exit Codes	: 1 if the part was found in the store, 0 otherwise
+ Comments:
+ Names the part by the SHA-256 of its encoded span, taken together
+ with whatever decides how the span decodes.  Store entries are named
+ by the key in hex, split as ab/cdef... to keep the directories small.
+ On a hit the entry is linked in under a temporary name and renamed
+ over the part, its size and head are filled in from there, and
+ cur->stored is set; the decoder then has nothing to do but close the
+ part.  On a miss the part is decoded and goes into the store when it
+ is closed.  Does nothing for any sink but the store sink.
+ \------------------------------------------------------------------*/
+int MIME_element_store_key(MIME_element* cur, const unsigned char *key)
+{
+	struct mime_sink_store *s;
+	struct stat st;
+	char tmp[64];
+	int fd;
+
+	if ((cur == NULL)||(!cur->opened)||(cur->sink != &MIME_sink_store)) return 0;
+
+	s = cur->sink_data;
+	DIGEST_to_hex(key, DIGEST_SHA256_LEN, s->entry +1);
+	s->entry[0] = s->entry[1];
+	s->entry[1] = s->entry[2];
+	s->entry[2] = '/';
+	s->keyed = 1;
+	if (s->storefd == -1) return 0;
+
+	fd = openat(s->storefd, s->entry, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return 0;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return 0;
+	}
+	cur->head_l = 0;
+	while (cur->head_l < sizeof(cur->head))
+	{
+		ssize_t got = pread(fd, cur->head +cur->head_l, sizeof(cur->head) -cur->head_l, cur->head_l);
+
+		if ((got == -1)&&(errno == EINTR)) continue;
+		if (got <= 0) break;
+		cur->head_l += got;
+	}
+	close(fd);
+
+	snprintf(tmp, sizeof(tmp), ".ripmime-store.%d", (int)getpid());
+	if (linkat(s->storefd, s->entry, s->out.dirfd, tmp, 0) != 0)
+	{
+		cur->head_l = 0;
+		return 0;
+	}
+	if (renameat(s->out.dirfd, tmp, s->out.dirfd, cur->filename) != 0)
+	{
+		unlinkat(s->out.dirfd, tmp, 0);
+		cur->head_l = 0;
+		return 0;
+	}
+
+	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: %s is already stored as %s",FL,__func__,cur->filename,s->entry);
+	cur->size = st.st_size;
+	cur->stored = 1;
+	return 1;
+}
+
+const struct mime_sink MIME_sink_directory = { "directory", MIME_sink_directory_open, MIME_sink_directory_write, MIME_sink_directory_close, MIME_sink_directory_abort };
+const struct mime_sink MIME_sink_memory = { "memory", MIME_sink_memory_open, MIME_sink_memory_write, MIME_sink_memory_close, MIME_sink_memory_abort };
+const struct mime_sink MIME_sink_callback = { "callback", MIME_sink_none_open, MIME_sink_none_write, MIME_sink_none_close, MIME_sink_none_close };
+const struct mime_sink MIME_sink_digest = { "digest", MIME_sink_digest_open, MIME_sink_digest_write, MIME_sink_digest_close, MIME_sink_memory_abort };
+const struct mime_sink MIME_sink_null = { "null", MIME_sink_none_open, MIME_sink_none_write, MIME_sink_none_close, MIME_sink_none_close };
+const struct mime_sink MIME_sink_discard = { "discard", MIME_sink_discard_open, MIME_sink_head_write, MIME_sink_head_close, MIME_sink_memory_abort };
+const struct mime_sink MIME_sink_scratch = { "scratch", MIME_sink_memory_open, MIME_sink_memory_write, MIME_sink_memory_close, MIME_sink_memory_abort };
+const struct mime_sink MIME_sink_archive = { "archive", MIME_sink_archive_open, MIME_sink_archive_write, MIME_sink_archive_close, MIME_sink_archive_abort };
+const struct mime_sink MIME_sink_store = { "store", MIME_sink_store_open, MIME_sink_store_write, MIME_sink_store_close, MIME_sink_store_abort };
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_output_sink
+ Returns Type	: const struct mime_sink *
+ ----Parameter List
+ 1. RIPMIME_output *unpack_metadata,
+ ------------------
+ Comments:
+ The sink new parts will be written through: the one set on the
+ output, else the directory sink when unpacking to a directory, the
+ digest sink in digest mode, the null sink when only listing and the
+ memory sink otherwise.
+ \------------------------------------------------------------------*/
+const struct mime_sink *MIME_output_sink( RIPMIME_output *unpack_metadata )
+{
+	if (unpack_metadata->sink != NULL) return unpack_metadata->sink;
+	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_TO_DIRECTORY) return &MIME_sink_directory;
+	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_DIGEST) return &MIME_sink_digest;
+	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_LIST_MIME) return &MIME_sink_null;
+	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_ARCHIVE) return &MIME_sink_archive;
+	return &MIME_sink_memory;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_output_size_wanted
+ Returns Type	: int
+ ----Parameter List
+ 1. RIPMIME_output *unpack_metadata,
+ 2. size_t size, decoded size of a part, known or estimated up front
+ ------------------
+ Exit Codes	: 1 if the size is within the output's limits, else 0
+ Comments:
+ For producers which can tell how large a part is before creating
+ it, so that parts outside the limits never reach a sink.  The rest
+ are caught as they are written, see MIME_element_write().
+ \------------------------------------------------------------------*/
+int MIME_output_size_wanted( RIPMIME_output *unpack_metadata, size_t size )
+{
+	if ((unpack_metadata->size_min > 0)&&(size < unpack_metadata->size_min)) return 0;
+	if ((unpack_metadata->size_max > 0)&&(size > unpack_metadata->size_max)) return 0;
+	return 1;
+}
+
+static int MIME_element_has_events( MIME_element *cur )
+{
+	return (cur->events != NULL)&&(cur->sink != &MIME_sink_null)&&(cur->sink != &MIME_sink_discard)&&(cur->sink != &MIME_sink_scratch);
 }
 
 MIME_element* MIME_element_add(struct MIME_element* parent, RIPMIME_output *unpack_metadata,
 							   char* filename, char* content_type_string, char* content_transfer_encoding, char* name,
 							   int current_recursion_level, int attachment_count, int filecount, const char* func)
 {
-	MIME_element *cur = malloc(sizeof(MIME_element));
+	MIME_element *cur = calloc(1, sizeof(MIME_element));
 	int fullpath_len = 0;
 
 	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:start\n",FL,__func__);
 
 	fullpath_len = strlen(unpack_metadata->dir) + strlen(filename) + 3 * sizeof(char);
 	insertItem(all_MIME_elements.mime_arr, cur);
-	cur->parent = parent;
+	cur->parent = (parent != NULL) ? parent : glb.parent;
 	cur->decode_result_code = -1;
+	cur->sink = MIME_output_sink(unpack_metadata);
+	cur->events = unpack_metadata->events;
 	cur->id = all_MIME_elements.mime_count++;
 	cur->directory = unpack_metadata->dir;
 	cur->filename = dup_ini(filename);
 	cur->content_type_string = dup_ini(content_type_string);
 	cur->content_transfer_encoding = dup_ini(content_transfer_encoding);
 	cur->name = dup_ini(name);
+	cur->attachment_count = attachment_count;
+	cur->filecount = filecount;
+	cur->recursion_level = current_recursion_level;
+	cur->size_max = unpack_metadata->size_max;
+	cur->budget = &(unpack_metadata->budget);
 
 	cur->fullpath = (char*)malloc(fullpath_len);
 	snprintf(cur->fullpath,fullpath_len,"%s/%s",unpack_metadata->dir,filename);
-	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_TO_DIRECTORY)
-		cur->f = fopen(cur->fullpath,"wb");
-	else
-		cur->f = open_memstream (&cur->mem_filearea, &cur->mem_filearea_l);
 
-	if (cur->f == NULL) {
-		LOGGER_log("%s:%d:%s:ERROR: cannot open %s for writing",FL,func,cur->fullpath);
+	if ((cur->budget->parts > 0)&&(cur->id >= cur->budget->parts))
+	{
+		MIME_element_exceed_budget("parts");
+	}
+	else if ((MIME_element_on_disk(cur))&&(cur->budget->files > 0)&&(all_MIME_elements.files >= cur->budget->files))
+	{
+		MIME_element_exceed_budget("files");
+	}
+	if (all_MIME_elements.budget_exceeded != NULL)
+	{
+		MIME_element_unclaim(cur);
 		return cur;
 	}
 
-	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding [encoding=%d] to %s\n",FL,__func__, content_transfer_encoding, cur->fullpath);
-
-	if (unpack_metadata != NULL && unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_LIST_MIME && cur->f != NULL) {
-		fprintf (stdout, "%d|%d|%d|%d|%s|%s\n", all_MIME_elements.mime_count, attachment_count, filecount, current_recursion_level, cur->content_type_string, cur->filename);
+	if (cur->sink->open(cur, unpack_metadata) != 0) {
+		LOGGER_log("%s:%d:%s:ERROR: cannot open %s for writing (%s sink)",FL,func,cur->fullpath,cur->sink->name);
+		return cur;
 	}
-	return cur;
-}
-
-MIME_element* MIME_element_add_root(RIPMIME_output *unpack_metadata,
-							   char* filename)
-{
-	MIME_element *cur = malloc(sizeof(MIME_element));
-	int fullpath_len = 0;
-
-	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:start\n",FL,__func__);
+	cur->opened = 1;
+	if (MIME_element_on_disk(cur)) all_MIME_elements.files++;
 
-	fullpath_len = strlen(unpack_metadata->dir) + strlen(filename) + 3 * sizeof(char);
-	insertItem(all_MIME_elements.mime_arr, cur);
-	cur->parent = NULL;
-	cur->decode_result_code = 0;
-	cur->id = 0;
-	cur->directory = unpack_metadata->dir;
-	cur->filename = dup_ini(filename);
-	cur->content_type_string = NULL;
-	cur->content_transfer_encoding = NULL;
-	cur->name = NULL;
+	if (MIME_element_has_events(cur)&&(cur->events->part_start)) cur->events->part_start(cur->events->data, cur);
 
-	cur->fullpath = (char*)malloc(fullpath_len);
-	snprintf(cur->fullpath,fullpath_len,"%s/%s",unpack_metadata->dir,filename);
-	cur->f = fopen(cur->fullpath,"r");
-	if (cur->f == NULL) {
-		LOGGER_log("%s:%d:%s:ERROR: cannot open %s for reading",FL,"main",cur->fullpath);
-		return cur;
-	}
+	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Decoding [encoding=%s] to %s\n",FL,__func__, cur->content_transfer_encoding, cur->fullpath);
 	return cur;
 }
 
@@ -141,9 +1429,10 @@ void MIME_element_free (MIME_element* cur)
 		return;
 	}
 
-	if (cur->f != NULL) {
-		fclose(cur->f);
+	if (cur->opened) {
+		cur->sink->close(cur);
 	}
+	if (cur->mem_filearea != NULL) free(cur->mem_filearea);
 	dup_free(cur->fullpath);
 	dup_free(cur->filename);
 	dup_free(cur->content_type_string);
@@ -154,29 +1443,419 @@ void MIME_element_free (MIME_element* cur)
 	cur = NULL;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_write
+ Returns Type	: int
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. const void *buf, decoded data
+ 3. size_t len,
+ ------------------
+ Exit Codes	: 0 on success, -1 if the part is not (or no longer) open
+ Comments:
+ The one way decoded data leaves a producer.  If the sink cannot take
+ the data, or the part_data handler refuses it, the part is aborted and
+ any further writes to it are ignored.
+ \------------------------------------------------------------------*/
+int MIME_element_write(MIME_element* cur, const void *buf, size_t len)
+{
+	size_t held;
+
+	if ((cur == NULL)||(!cur->opened)) return -1;
+	if (len == 0) return 0;
+	held = cur->mem_filearea_l;
+
+	if (all_MIME_elements.budget_exceeded != NULL)
+	{
+		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Over budget, aborting %s",FL,__func__,cur->fullpath);
+	}
+	else if ((cur->budget->part_bytes > 0)&&(cur->size +len > cur->budget->part_bytes))
+	{
+		MIME_element_exceed_budget("part bytes");
+	}
+	else if ((cur->budget->total_bytes > 0)&&(all_MIME_elements.total_bytes +len > cur->budget->total_bytes))
+	{
+		MIME_element_exceed_budget("total bytes");
+	}
+	else if ((cur->budget->memory_bytes > 0)&&(MIME_element_in_memory(cur))&&(all_MIME_elements.memory_bytes +len > cur->budget->memory_bytes))
+	{
+		MIME_element_exceed_budget("memory bytes");
+	}
+	else if ((cur->size_max > 0)&&(cur->size +len > cur->size_max))
+	{
+		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: %s is larger than %lu bytes, discarding",FL,__func__,cur->fullpath,(unsigned long)cur->size_max);
+		cur->discarded = 1;
+	}
+	else if (MIME_element_has_events(cur)&&(cur->events->part_data)&&(cur->events->part_data(cur->events->data, cur, buf, len) != 0))
+	{
+		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: part_data handler aborted %s",FL,__func__,cur->fullpath);
+	}
+	else if (cur->sink->write(cur, buf, len) != 0)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot write %lu bytes to %s (%s)",FL,__func__,(unsigned long)len,cur->fullpath,strerror(errno));
+	}
+	else
+	{
+		if (cur->head_l < sizeof(cur->head))
+		{
+			size_t take = sizeof(cur->head) -cur->head_l;
+
+			if (take > len) take = len;
+			memcpy(cur->head +cur->head_l, buf, take);
+			cur->head_l += take;
+		}
+		cur->size += len;
+		all_MIME_elements.total_bytes += len;
+		// The digest sink drops what it held once it knows
+		//	the part is not wanted back
+		if (cur->mem_filearea_l > held)
+		{
+			cur->resident += cur->mem_filearea_l -held;
+			all_MIME_elements.memory_bytes += cur->mem_filearea_l -held;
+		}
+		else if (cur->mem_filearea == NULL) MIME_element_forget_resident(cur);
+		return 0;
+	}
+
+	cur->opened = 0;
+	cur->sink->abort(cur);
+	MIME_element_forget_resident(cur);
+	if (MIME_element_has_events(cur)&&(cur->events->part_end)) cur->events->part_end(cur->events->data, cur);
+	return -1;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_report_digest
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. RIPMIME_output *unpack_metadata,
+ ------------------
+ Comments:
+ Digest mode output, one line per part:
+ id|sha256|size|content-type|filename[|md5]
+ \------------------------------------------------------------------*/
+static void MIME_element_report_digest(MIME_element* cur, RIPMIME_output *unpack_metadata)
+{
+	char sha256[DIGEST_SHA256_LEN *2 +1];
+	char md5[DIGEST_MD5_LEN *2 +1];
+
+	DIGEST_to_hex(cur->sha256, DIGEST_SHA256_LEN, sha256);
+	if (unpack_metadata->digest_md5)
+	{
+		DIGEST_to_hex(cur->md5, DIGEST_MD5_LEN, md5);
+		fprintf (stdout, "%d|%s|%lu|%s|%s|%s\n", cur->id +1, sha256, (unsigned long)cur->size, cur->content_type_string, cur->filename, md5);
+	}
+	else
+	{
+		fprintf (stdout, "%d|%s|%lu|%s|%s\n", cur->id +1, sha256, (unsigned long)cur->size, cur->content_type_string, cur->filename);
+	}
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_report_list
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element* cur,
+ ------------------
+ Comments:
+ List mode output, one line per part:
+ id|attachment count|file count|recursion level|content-type|filename|encoded size|decoded size
+
+ Parts which were skipped over carry their size in the mailpack and
+ an estimate of the decoded size, anything ripMIME wrote out itself
+ (such as doubleCR sections) is reported at its written size.
+ \------------------------------------------------------------------*/
+static void MIME_element_report_list(MIME_element* cur)
+{
+	size_t encoded_size = (cur->encoded_size > 0) ? cur->encoded_size : cur->size;
+
+	fprintf (stdout, "%d|%d|%d|%d|%s|%s|%lu|%lu\n", cur->id +1, cur->attachment_count, cur->filecount, cur->recursion_level, cur->content_type_string, cur->filename, (unsigned long)encoded_size, (unsigned long)cur->size);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_deactivate
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. RIPMIME_output *unpack_metadata,
+ ------------------
+ Comments:
+ Called by the producer once it has written the last of the element's
+ data.  The sink is closed (which, for the memory sink, makes
+ mem_filearea final) but the element itself lives on in
+ all_MIME_elements until MIME_close(), so that callers may still look
+ at its result code and post-decode its content.
+
+ Unless the producer has marked the element as held, the part is
+ handed over to the embedder straight away.
+ \------------------------------------------------------------------*/
 void MIME_element_deactivate(MIME_element* cur, RIPMIME_output *unpack_metadata)
 {
-	if (unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_TO_DIRECTORY)
-		MIME_element_free(cur);
+	if (cur == NULL) return;
+
+	if (cur->opened)
+	{
+		cur->opened = 0;
+		if (!MIME_output_size_wanted(unpack_metadata, cur->size))
+		{
+			if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: %s is outside the size limits, discarding",FL,__func__,cur->fullpath);
+			cur->discarded = 1;
+			cur->sink->abort(cur);
+			MIME_element_forget_resident(cur);
+		}
+		else if (cur->sink->close(cur) != 0)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot complete %s (%s)",FL,__func__,cur->fullpath,strerror(errno));
+		}
+		if (cur->mem_filearea == NULL) MIME_element_forget_resident(cur);
+		if (MIME_element_has_events(cur)&&(cur->events->part_end)) cur->events->part_end(cur->events->data, cur);
+		if ((unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_DIGEST)&&(cur->digested)) MIME_element_report_digest(cur, unpack_metadata);
+		if ((unpack_metadata->unpack_mode == RIPMIME_UNPACK_MODE_LIST_MIME)&&(!cur->discarded)) MIME_element_report_list(cur);
+	}
+	if (!cur->held) MIME_element_release(cur, unpack_metadata);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_release
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. RIPMIME_output *unpack_metadata,
+ ------------------
+ Comments:
+ Declares the part finished - nothing in ripMIME will look at its
+ content again - and passes it to the part_complete handler.  The
+ MIME decoders hold their parts until the RFC822/OLE/TNEF/MHT
+ post-decoders have run over them.
+ \------------------------------------------------------------------*/
+void MIME_element_release(MIME_element* cur, RIPMIME_output *unpack_metadata)
+{
+	if ((cur == NULL)||(cur->released)) return;
+
+	cur->held = 0;
+	if (cur->opened)
+	{
+		MIME_element_deactivate(cur, unpack_metadata);
+		return;
+	}
+	cur->released = 1;
+
+	if (MIME_element_has_events(cur)&&(cur->events->part_complete != NULL))
+	{
+		if (cur->events->part_complete(cur->events->data, cur, cur->mem_filearea, cur->mem_filearea_l) == MIME_ELEMENT_TAKEN)
+		{
+			cur->mem_filearea = NULL;
+			cur->mem_filearea_l = 0;
+			MIME_element_forget_resident(cur);
+		}
+	}
+
+	// The digest, discard, scratch and archive sinks only kept the content for the post-decoders
+	if (((cur->sink == &MIME_sink_digest)||(cur->sink == &MIME_sink_discard)||(cur->sink == &MIME_sink_scratch)||(cur->sink == &MIME_sink_archive))&&(cur->mem_filearea != NULL))
+	{
+		free(cur->mem_filearea);
+		cur->mem_filearea = NULL;
+		cur->mem_filearea_l = 0;
+		MIME_element_forget_resident(cur);
+	}
+}
+
+void MIME_element_release_all(RIPMIME_output *unpack_metadata)
+{
+	int i;
+
+	for (i = 0; i < all_MIME_elements.mime_arr->size; i++)
+	{
+		MIME_element_release(all_MIME_elements.mime_arr->array[i], unpack_metadata);
+	}
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_open_read
+ Returns Type	: FILE *
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. RIPMIME_output *unpack_metadata,
+ ------------------
+ Exit Codes	: NULL if the element's content is not available
+ Comments:
+ Opens the decoded content of a (deactivated) element for reading,
+ from disk for the directory and store sinks or straight from the memory buffer
+ otherwise.  Sinks which keep no content have nothing to read back.
+ Close with fclose().
+ \------------------------------------------------------------------*/
+FILE *MIME_element_open_read(MIME_element* cur, RIPMIME_output *unpack_metadata)
+{
+	if ((cur == NULL)||(cur->fullpath == NULL)||(cur->opened)) return NULL;
+
+	if (MIME_element_on_disk(cur))
+	{
+		int dirfd = MIME_output_dirfd(unpack_metadata);
+		int fd = (dirfd == -1) ? -1 : openat(dirfd, cur->filename, O_RDONLY|O_CLOEXEC);
+		FILE *f;
+
+		if (fd == -1) return NULL;
+		f = fdopen(fd, "r");
+		if (f == NULL) close(fd);
+		return f;
+	}
+
+	if ((cur->mem_filearea == NULL)||(cur->mem_filearea_l == 0)) return NULL;
+	return fmemopen(cur->mem_filearea, cur->mem_filearea_l, "r");
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_map
+ Returns Type	: const char *
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. RIPMIME_output *unpack_metadata,
+ 3. size_t *len, set to the length of the content
+ ------------------
+ Exit Codes	: NULL if the element's content is not available
+ Comments:
+ As MIME_element_open_read(), but hands back the decoded content as
+ one read-only block, so that post-decoders (TNEF, OLE, uudecode) can
+ walk it in place instead of reading it through a FILE.  Parts kept in
+ memory are handed back as they are; parts on disk are mapped.
+ Release with MIME_element_unmap().
+ \------------------------------------------------------------------*/
+const char *MIME_element_map(MIME_element* cur, RIPMIME_output *unpack_metadata, size_t *len)
+{
+	*len = 0;
+	if ((cur == NULL)||(cur->fullpath == NULL)||(cur->opened)) return NULL;
+
+	if (MIME_element_on_disk(cur))
+	{
+		int dirfd = MIME_output_dirfd(unpack_metadata);
+		int fd = (dirfd == -1) ? -1 : openat(dirfd, cur->filename, O_RDONLY|O_CLOEXEC);
+		struct stat st;
+		void *map;
+
+		if (fd == -1) return NULL;
+		if ((fstat(fd, &st) == -1)||(st.st_size == 0))
+		{
+			close(fd);
+			return NULL;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot map '%s' (%s)",FL,__func__,cur->fullpath,strerror(errno));
+			return NULL;
+		}
+		*len = st.st_size;
+		return map;
+	}
+
+	if ((cur->mem_filearea == NULL)||(cur->mem_filearea_l == 0)) return NULL;
+	*len = cur->mem_filearea_l;
+	return cur->mem_filearea;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_unmap
+ Returns Type	: void
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. const char *map, as returned by MIME_element_map()
+ 3. size_t len,
+ ------------------
+ \------------------------------------------------------------------*/
+void MIME_element_unmap(MIME_element* cur, const char *map, size_t len)
+{
+	if ((map == NULL)||(!MIME_element_on_disk(cur))) return;
+	munmap((void *)map, len);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_next
+ Returns Type	: MIME_element*
+ ----Parameter List
+ 1. int *iterator, set to 0 before the first call
+ ------------------
+ Exit Codes	: NULL once all elements have been visited
+ Comments:
+ Walks the elements decoded so far, in the order they were created.
+ Elements remain valid until MIME_close().
+ \------------------------------------------------------------------*/
+MIME_element* MIME_element_next(int *iterator)
+{
+	if ((*iterator < 0)||(*iterator >= all_MIME_elements.mime_arr->size)) return NULL;
+	return all_MIME_elements.mime_arr->array[(*iterator)++];
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_find
+ Returns Type	: MIME_element*
+ ----Parameter List
+ 1. const char *filename, as passed to MIME_element_add()
+ ------------------
+ Exit Codes	: NULL if no element of that name exists
+ Comments:
+ Returns the most recently created element of the given name, for
+ the post-decoders which only know a part by the name it was
+ saved under (uudecoded winmail.dat, doubleCR saves).
+ \------------------------------------------------------------------*/
+MIME_element* MIME_element_find(const char *filename)
+{
+	int i;
+
+	for (i = all_MIME_elements.mime_arr->size -1; i >= 0; i--)
+	{
+		MIME_element *m = all_MIME_elements.mime_arr->array[i];
+		if ((m->filename != NULL)&&(strcmp(m->filename, filename) == 0)) return m;
+	}
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: MIME_element_take_buffer
+ Returns Type	: char *
+ ----Parameter List
+ 1. MIME_element* cur,
+ 2. size_t *len, set to the length of the returned buffer
+ ------------------
+ Exit Codes	: NULL if there is no (finished) memory buffer to hand over
+ Comments:
+ Transfers ownership of a memory mode element's decoded content to
+ the caller, who must free() it.  MIME_close() will then neither write
+ it to disk nor free it.
+ \------------------------------------------------------------------*/
+char *MIME_element_take_buffer(MIME_element* cur, size_t *len)
+{
+	char *buf;
+
+	if ((cur == NULL)||(cur->opened)) return NULL;
+
+	buf = cur->mem_filearea;
+	if (len) *len = cur->mem_filearea_l;
+	cur->mem_filearea = NULL;
+	cur->mem_filearea_l = 0;
+	MIME_element_forget_resident(cur);
+
+	return buf;
 }
 
 static inline int get_random_value(void) {
 	int randval;
-	FILE *fp;
-	size_t res = 0;
 
-	fp = fopen("/dev/urandom", "r");
-	res = fread(&randval, sizeof(randval), 1, fp);
-	if (res == 0) {
-		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: /dev/urandom Read error\n",FL,__func__);
-			exit(1);
+	// getrandom() on a few bytes never blocks once the pool is up;
+	//	should it fail regardless, any value will do for a file name
+	if (getrandom(&randval, sizeof(randval), 0) != sizeof(randval))
+	{
+		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s: getrandom() failed (%s)\n",FL,__func__,strerror(errno));
+		randval = rand();
 	}
-	fclose(fp);
 	if (randval < 0)
 	{ randval = randval *( -1); };
 	return randval;
 }
 
+static int MIME_uniquename( RIPMIME_output *unpack_metadata, char *fname, int dirfd );
+
 /*------------------------------------------------------------------------
 Procedure:     MIME_test_uniquename ID:1
 Purpose:       Checks to see that the filename specified is unique. If it's not
@@ -187,12 +1866,26 @@ Errors:
 ------------------------------------------------------------------------*/
 int MIME_test_uniquename( RIPMIME_output *unpack_metadata, char *fname )
 {
-	struct stat buf;
+	int dirfd = -1;
+
+	// Without the directory there is nothing to be unique against; the
+	//	sink will report the failure when it comes to open the part.
+	//	Parts which are not written to the directory as they are decoded
+	//	(memory, callback, digest, archive) are only checked against the
+	//	names issued, so the embedder never sees the same name twice.
+	if ((MIME_output_sink(unpack_metadata) == &MIME_sink_directory)&&((dirfd = MIME_output_dirfd(unpack_metadata)) == -1)) return 0;
+
+	return MIME_uniquename(unpack_metadata, fname, dirfd);
+}
 
+/* As MIME_test_uniquename(), against the names issued and, unless
+ * dirfd is -1, the files in the output directory */
+static int MIME_uniquename( RIPMIME_output *unpack_metadata, char *fname, int dirfd )
+{
 	char newname[ _FS_PATH_MAX + 1];
 	char scr[ _FS_PATH_MAX + 1]; /** Scratch var **/
 	char *frontname, *extention;
-	int cleared = 0;
+	struct MIME_name *base;
 	int count = 1;
 
 	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Start (%s)",FL,__func__,fname);
@@ -233,91 +1926,86 @@ int MIME_test_uniquename( RIPMIME_output *unpack_metadata, char *fname )
 		}
 	}
 
-	snprintf(newname, _FS_PATH_MAX,"%s/%s",unpack_metadata->dir,fname);
-	while (!cleared)
+	base = MIME_name_find(fname);
+	if ((base == NULL)&&(MIME_name_claim(dirfd, fname)))
 	{
-		if ((stat(newname, &buf) == -1))
-		{
-			cleared++;
-		}
-		else
-		{
-			int randval = get_random_value();
-
-			switch (unpack_metadata->rename_method) {
-				case _MIME_RENAME_METHOD_PREFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%d_%s",unpack_metadata->dir,count,fname);
-					break;
-				case _MIME_RENAME_METHOD_INFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%s_%d.%s",unpack_metadata->dir,frontname,count,extention);
-					break;
-				case _MIME_RENAME_METHOD_POSTFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%s_%d",unpack_metadata->dir,fname,count);
-					break;
-				case _MIME_RENAME_METHOD_RANDPREFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%d_%d_%s",unpack_metadata->dir,count,randval,fname);
-					break;
-				case _MIME_RENAME_METHOD_RANDINFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%s_%d_%d.%s",unpack_metadata->dir,frontname,count,randval,extention);
-					break;
-				case _MIME_RENAME_METHOD_RANDPOSTFIX:
-					snprintf(newname, _FS_PATH_MAX,"%s/%s_%d_%d",unpack_metadata->dir,fname,count,randval);
-			}
-			count++;
-		}
+		if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done (%s)",FL,__func__,fname);
+		return 0;
 	}
-	if (count > 1)
-	{
-		frontname = strrchr(newname,'/');
-		if (frontname) frontname++;
-		else frontname = newname;
 
-		PLD_strncpy(fname, frontname, _FS_PATH_MAX); //FIXME - this assumes that the buffer space is at least MIME_STRLEN_MAX sized.
-	}
+	// Taken, either by an earlier part or by a file already on disk.  Carry
+	//	on from wherever the last rename of this name got up to.
+	if (base == NULL) base = MIME_name_add(fname);
+	if (base != NULL) count = base->next;
+
+	do {
+		int randval = 0;
+
+		if (unpack_metadata->rename_method >= _MIME_RENAME_METHOD_RANDINFIX) randval = get_random_value();
+
+		switch (unpack_metadata->rename_method) {
+			case _MIME_RENAME_METHOD_PREFIX:
+				snprintf(newname, _FS_PATH_MAX,"%d_%s",count,fname);
+				break;
+			case _MIME_RENAME_METHOD_INFIX:
+				snprintf(newname, _FS_PATH_MAX,"%s_%d.%s",frontname,count,extention);
+				break;
+			case _MIME_RENAME_METHOD_POSTFIX:
+				snprintf(newname, _FS_PATH_MAX,"%s_%d",fname,count);
+				break;
+			case _MIME_RENAME_METHOD_RANDPREFIX:
+				snprintf(newname, _FS_PATH_MAX,"%d_%d_%s",count,randval,fname);
+				break;
+			case _MIME_RENAME_METHOD_RANDINFIX:
+				snprintf(newname, _FS_PATH_MAX,"%s_%d_%d.%s",frontname,count,randval,extention);
+				break;
+			case _MIME_RENAME_METHOD_RANDPOSTFIX:
+				snprintf(newname, _FS_PATH_MAX,"%s_%d_%d",fname,count,randval);
+		}
+		count++;
+	} while (!MIME_name_claim(dirfd, newname));
+
+	if (base != NULL) base->next = count;
+
+	PLD_strncpy(fname, newname, _FS_PATH_MAX); //FIXME - this assumes that the buffer space is at least MIME_STRLEN_MAX sized.
+
 	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Done (%s)",FL,__func__,fname);
 	return 0;
 }
 
-static void copyFILEcontent(FILE* src, FILE* dst)
+void write_FS_file(RIPMIME_output *unpack_metadata, MIME_element* cur)
 {
-	int c; /* Not CHAR! for EOF */
+	char fname[ _FS_PATH_MAX + 1];
+	int dirfd;
+	int fd;
 
-	fseek(src, 0, SEEK_SET);
-	// Read contents from file
-	while (EOF != (c = fgetc(src)))
+	// Only the memory sink's parts are waiting to be written out, and
+	// then only if the embedder has not taken the buffer
+	if ((cur->sink != &MIME_sink_memory)||(cur->mem_filearea == NULL)) return;
+
+	// The part normally keeps the name it was decoded under, which is
+	//	already unique within the message; only a file of that name left
+	//	in the directory from before forces another one.
+	PLD_strncpy(fname, cur->filename, _FS_PATH_MAX);
+	dirfd = MIME_output_dirfd(unpack_metadata);
+	fd = (dirfd == -1) ? -1 : openat(dirfd, fname, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+	if ((fd == -1)&&(errno == EEXIST))
 	{
-		fputc(c, dst);
+		MIME_uniquename(unpack_metadata, fname, dirfd);
+		fd = openat(dirfd, fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
 	}
-}
-
-void write_FS_file(RIPMIME_output *unpack_metadata, MIME_element* cur)
-{
-	char * wr_filename = NULL;
-	FILE* wf = NULL;
-	int fn_l = 0;
-
-	MIME_test_uniquename(unpack_metadata, cur->filename);
-	fn_l = strlen(unpack_metadata->dir) + strlen(cur->filename) + sizeof(char) * 2;
-	wr_filename = malloc(fn_l);
-	snprintf(wr_filename,fn_l,"%s/%s",unpack_metadata->dir,cur->filename);
-	if (cur->f == NULL) {
-		LOGGER_log("%s:%d:%s:ERROR: Cannot copy data from mime_element memory file, programming error (for %s)", FL,__func__, wr_filename, strerror(errno));
-		free(wr_filename);
+	if (fd == -1)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot open '%s/%s' for writing  (%s)", FL,__func__, unpack_metadata->dir, fname, strerror(errno));
 		return;
 	}
-	// Prepend the unpackdir path to the headers file name
-	wf = fopen(wr_filename,"w");
-	if (wf == NULL)
+	if (MIME_sink_write_fd(fd, cur->mem_filearea, cur->mem_filearea_l) != 0)
 	{
-		LOGGER_log("%s:%d:%s:ERROR: Cannot open '%s' for writing  (%s)", FL,__func__, wr_filename, strerror(errno));
-		free(wr_filename);
-		return;
+		LOGGER_log("%s:%d:%s:ERROR: Cannot write '%s/%s' (%s)", FL,__func__, unpack_metadata->dir, fname, strerror(errno));
 	}
-	copyFILEcontent(cur->f, wf);
-	if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Memory FILE have cpoied to %s",FL,__func__,wr_filename);
+	else if (MIME_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Memory FILE have cpoied to %s/%s",FL,__func__,unpack_metadata->dir,fname);
 
-	free(wr_filename);
-	fclose(wf);
+	close(fd);
 }
 
 void write_all_to_FS_files(RIPMIME_output *unpack_metadata)
@@ -418,10 +2106,9 @@ void printArray(dynamic_array* container)
 // Freeing the memory allocated to the array
 void freeArray(dynamic_array* container, RIPMIME_output *unpack_metadata)
 {
-	if (unpack_metadata->unpack_mode != RIPMIME_UNPACK_MODE_TO_DIRECTORY)
-		for (int i = 0; i < container->size; i++) {
-			MIME_element_free(container->array[i]);
-		}
+	for (int i = 0; i < container->size; i++) {
+		MIME_element_free(container->array[i]);
+	}
 	free(container->array);
 	free(container);
 }
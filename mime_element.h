@@ -7,6 +7,13 @@
 #define RIPMIME_UNPACK_MODE_TO_DIRECTORY	0
 #define RIPMIME_UNPACK_MODE_IN_MEMORY		1
 #define RIPMIME_UNPACK_MODE_LIST_MIME		2
+#define RIPMIME_UNPACK_MODE_DIGEST		3
+#define RIPMIME_UNPACK_MODE_ARCHIVE		4
+
+#define MIME_ELEMENT_HEAD_SIZE	512	// leading bytes of each part kept for format sniffing
+
+#define MIME_ARCHIVE_TAR	0
+#define MIME_ARCHIVE_CPIO	1
 
 #define _MIME_RENAME_METHOD_INFIX			1
 #define _MIME_RENAME_METHOD_PREFIX			2
@@ -15,6 +22,73 @@
 #define _MIME_RENAME_METHOD_RANDPREFIX		5
 #define _MIME_RENAME_METHOD_RANDPOSTFIX		6
 
+struct MIME_element;
+
+/* part_complete return codes */
+#define MIME_ELEMENT_KEEP	0
+#define MIME_ELEMENT_TAKEN	1
+
+/* Part events, fired as each MIME_element is created, written to and
+ * finished.  Used by the push parser (RIPMIME_feed) so that an embedder
+ * can scan parts while the message is still arriving.  A non-zero return
+ * from part_data aborts the part.  Events fire for every sink except the
+ * null, discard and scratch sinks.
+ *
+ * part_complete is called once a part and anything nested inside it have
+ * been fully decoded.  In memory mode buf/len is the decoded part; return
+ * MIME_ELEMENT_TAKEN to take ownership of buf (release it with free()).
+ * When a part_complete handler is set, memory mode never writes parts out
+ * to the filesystem.  With unique_names set, m->filename is unique within
+ * the message whatever the sink, as it would be on disk. */
+struct mime_events
+{
+	void *data;
+	int (*part_start)( void *data, struct MIME_element *m );
+	int (*part_data)( void *data, struct MIME_element *m, const char *buf, size_t len );
+	int (*part_end)( void *data, struct MIME_element *m );
+	int (*part_complete)( void *data, struct MIME_element *m, char *buf, size_t len );
+};
+
+struct mime_output;
+
+/* Output sinks.  Every producer (the MIME decoders, uudecode, TNEF, OLE
+ * and the doubleCR saver) hands its decoded data to MIME_element_write(),
+ * which passes it on to the sink chosen for the unpack.  open returns 0
+ * once the sink is ready for data; write returns 0 once all of buf has
+ * been accepted; close finishes a part normally; abort throws away a
+ * part which could not be completed. */
+struct mime_sink
+{
+	const char *name;
+	int (*open)( struct MIME_element *m, struct mime_output *unpack_metadata );
+	int (*write)( struct MIME_element *m, const char *buf, size_t len );
+	int (*close)( struct MIME_element *m );
+	int (*abort)( struct MIME_element *m );
+};
+
+extern const struct mime_sink MIME_sink_directory;	// one file per part in the output directory
+extern const struct mime_sink MIME_sink_memory;		// malloc'd buffer per part (mem_filearea)
+extern const struct mime_sink MIME_sink_callback;	// nothing kept, parts only reach the part events
+extern const struct mime_sink MIME_sink_digest;		// MD5 and SHA-256 of each part, content kept only for the post-decoders
+extern const struct mime_sink MIME_sink_null;		// discarded
+extern const struct mime_sink MIME_sink_discard;	// as null, content kept only for the post-decoders
+extern const struct mime_sink MIME_sink_scratch;	// kept whole in memory until released, no events
+extern const struct mime_sink MIME_sink_archive;	// appended to a tar or cpio archive, see MIME_archive_open()
+extern const struct mime_sink MIME_sink_store;		// as directory, repeats linked from the dedup store
+
+/* Resource budgets for a message, 0 for no limit.  Once any one is
+ * exceeded the part at hand is aborted, nothing further is decoded and
+ * MIME_unpack() returns MIME_ERROR_BUDGET_EXCEEDED. */
+struct mime_budget
+{
+	int parts;		// parts created, TNEF/OLE/uuencoded contents included
+	size_t part_bytes;	// decoded bytes in any one part
+	size_t total_bytes;	// decoded bytes in all the parts together
+	int files;		// files created in the output directory
+	size_t memory_bytes;	// decoded bytes held in memory at any one time
+	size_t header_bytes;	// bytes in any one block of headers
+};
+
 struct mime_output
 {
 	char *dir;
@@ -22,22 +96,49 @@ struct mime_output
 	// int fragment_number; will be used later
 	int rename_method;
 	int unique_names; // flague
+	struct mime_events *events; // NULL if no events are wanted
+	const struct mime_sink *sink; // NULL to pick the sink from unpack_mode
+	int digest_md5; // digest mode also reports the MD5 of each part
+	size_t size_min; // parts decoding to fewer bytes are discarded, 0 for no limit
+	size_t size_max; // parts decoding to more bytes are discarded, 0 for no limit
+	struct mime_budget budget;
+	char *dedup_store; // directory of parts already decoded, keyed by their encoding, NULL for none
 };
 typedef struct mime_output RIPMIME_output;
 
-typedef struct {
+typedef struct MIME_element {
 	struct MIME_element* parent;
 	int id;
 	char* directory;
 	char* filename;
 	char* fullpath;
-	FILE* f;
+	const struct mime_sink *sink;
+	void *sink_data;	// the sink's own per-part state
+	int opened;		// the sink is accepting data
+	size_t size;		// bytes written through MIME_element_write(), or the estimate when listing
+	size_t size_max;	// see RIPMIME_output
+	const struct mime_budget *budget;
+	size_t resident;	// bytes of this part counted against budget->memory_bytes
+	int discarded;		// dropped for being outside the output's size limits
+	int stored;		// linked in from the dedup store rather than decoded, see MIME_element_store_key()
+	size_t encoded_size;	// bytes of the part in the mailpack, set when listing
+	int attachment_count;	// counters at the time the part was found, for the listing
+	int filecount;
+	int recursion_level;
+	struct mime_events *events;
 	char* content_type_string;
 	char* content_transfer_encoding;
 	char* name;
 	char* mem_filearea;
 	size_t mem_filearea_l;
 	int decode_result_code;
+	int digested;		// md5/sha256 are set, see MIME_sink_digest
+	unsigned char md5[16];
+	unsigned char sha256[32];
+	unsigned char head[MIME_ELEMENT_HEAD_SIZE];	// first bytes written, whatever the sink
+	size_t head_l;
+	int held;		// part is still being post-decoded, see MIME_element_release()
+	int released;
 } MIME_element;
 
 typedef struct {
@@ -49,13 +150,29 @@ typedef struct {
 typedef struct {
 	int mime_count;
 	dynamic_array* mime_arr;
+
+	// Resources used so far, see struct mime_budget
+	size_t total_bytes;
+	int files;
+	size_t memory_bytes;
+	const char *budget_exceeded;	// the first budget exceeded, NULL if none
 } all_MIME_elements_s;
 
 extern all_MIME_elements_s all_MIME_elements;
 
 int MIMEELEMENT_set_debug( int level );
+int MIME_element_set_keep_test( int (*fn)( MIME_element *m, int final ) );
+MIME_element *MIME_element_set_parent( MIME_element *m );
+void MIME_element_exceed_budget( const char *budget );
+const char *MIME_element_budget_exceeded( void );
 
 void all_MIME_elements_init (void);
+const struct mime_sink *MIME_output_sink (RIPMIME_output *unpack_metadata);
+int MIME_output_size_wanted( RIPMIME_output *unpack_metadata, size_t size );
+int MIME_output_dirfd( RIPMIME_output *unpack_metadata );
+void MIME_output_dirfd_close( void );
+int MIME_archive_open( const char *path, int format );
+int MIME_archive_close( void );
 MIME_element* MIME_element_add (
 	struct MIME_element* parent,
 	RIPMIME_output *unpack_metadata,
@@ -68,7 +185,17 @@ MIME_element* MIME_element_add (
 	int filecount,
 	const char* func);
 // void MIME_element_free (MIME_element* cur);
+int MIME_element_write (MIME_element* cur, const void *buf, size_t len);
+int MIME_element_store_key (MIME_element* cur, const unsigned char *key);
 void MIME_element_deactivate (MIME_element* cur, RIPMIME_output *unpack_metadata);
+void MIME_element_release (MIME_element* cur, RIPMIME_output *unpack_metadata);
+void MIME_element_release_all (RIPMIME_output *unpack_metadata);
+FILE *MIME_element_open_read (MIME_element* cur, RIPMIME_output *unpack_metadata);
+const char *MIME_element_map (MIME_element* cur, RIPMIME_output *unpack_metadata, size_t *len);
+void MIME_element_unmap (MIME_element* cur, const char *map, size_t len);
+MIME_element* MIME_element_next (int *iterator);
+MIME_element* MIME_element_find (const char *filename);
+char *MIME_element_take_buffer (MIME_element* cur, size_t *len);
 void printArray(dynamic_array* container);
 void freeArray(dynamic_array* container, RIPMIME_output *unpack_metadata);
 void write_all_to_FS_files(RIPMIME_output *unpack_metadata);
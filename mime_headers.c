@@ -64,6 +64,7 @@ int MIMEH_read_primary_headers( FILE* header_file, FILE* original_header_file, c
 struct MIMEH_globals {
     int doubleCR;
     int doubleCR_save;
+    int doubleCR_in_memory; // doubleCR sections are only kept until MIME_doubleCR_decode() has read them
     char doubleCRname[_MIMEH_STRLEN_MAX + 1 * sizeof(char)];
 
     char appledouble_filename[_MIMEH_STRLEN_MAX + 1 * sizeof(char)];
@@ -128,6 +129,7 @@ void MIMEH_init( void )
     glb.webform = 0;
     glb.doubleCR_count = 0;
     glb.doubleCR_save = 1;
+    glb.doubleCR_in_memory = 0;
     glb.header_fix = 1;
     glb.verbose = 0;
     glb.verbose_contenttype = 0;
@@ -240,6 +242,29 @@ int MIMEH_get_doubleCR_save( void )
 {
     return glb.doubleCR_save;
 }
+
+/*-----------------------------------------------------------------\
+  Function Name : MIMEH_set_doubleCR_in_memory
+  Returns Type  : int
+  ----Parameter List
+  1. int level ,
+  ------------------
+  Exit Codes    :
+  Side Effects  :
+  --------------------------------------------------------------------
+Comments:
+Saves doubleCR sections to the scratch sink rather than the output,
+so they never reach the filesystem.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int MIMEH_set_doubleCR_in_memory( int level )
+{
+    glb.doubleCR_in_memory = level;
+    return glb.doubleCR_in_memory;
+}
 /*-----------------------------------------------------------------\
   Function Name : *MIMEH_get_doubleCR_name
   Returns Type  : char
@@ -575,19 +600,29 @@ int MIMEH_save_doubleCR( FFGET_FILE *f, RIPMIME_output *unpack_metadata, struct
     MIME_element* cur_mime = NULL;
 
     glb.doubleCR_count++;
-    snprintf(glb.doubleCRname,_MIMEH_STRLEN_MAX,"%s/%s_doubleCR.%d_", unpack_metadata->dir, hinfo->filename, glb.doubleCR_count);
+    snprintf(glb.doubleCRname,_MIMEH_STRLEN_MAX,"%s_doubleCR.%d_", hinfo->filename, glb.doubleCR_count);
 
-    cur_mime = MIME_element_add (NULL, unpack_metadata, glb.doubleCRname, "doubleCR", NULL, "doubleCR", hinfo->current_recursion_level + 1, 0, 0, __func__);
+    if (glb.doubleCR_in_memory)
+    {
+        const struct mime_sink *sink = unpack_metadata->sink;
+
+        unpack_metadata->sink = &MIME_sink_scratch;
+        cur_mime = MIME_element_add (NULL, unpack_metadata, glb.doubleCRname, "doubleCR", NULL, "doubleCR", hinfo->current_recursion_level + 1, 0, 0, __func__);
+        unpack_metadata->sink = sink;
+    }
+    else cur_mime = MIME_element_add (NULL, unpack_metadata, glb.doubleCRname, "doubleCR", NULL, "doubleCR", hinfo->current_recursion_level + 1, 0, 0, __func__);
+    cur_mime->held = 1; // released by MIME_doubleCR_decode() once it has read the section back
 
     if (MIMEH_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Saving DoubleCR header: %s\n", FL, __func__, glb.doubleCRname);
     while (1)
     {
+        char ch;
+
         c = FFGET_fgetc(f);
-        fprintf(cur_mime->f,"%c",c);
-        if ((c == EOF)||(c == '\n'))
-        {
-            break;
-        }
+        if (c == EOF) break;
+        ch = c;
+        MIME_element_write(cur_mime, &ch, 1);
+        if (c == '\n') break;
     }
     MIME_element_deactivate(cur_mime, unpack_metadata);
     return 0;
@@ -1030,6 +1065,16 @@ int MIMEH_read_headers( FILE* header_file, FILE* original_header_file, struct MI
 
             }   // If the hinfo->headerline_buffer already is allocated and we're appending to it.
 
+            // A header block which never ends would otherwise have us
+            //  reallocating for the rest of the input.
+            if ((unpack_metadata->budget.header_bytes > 0)&&((size_t)totalsize > unpack_metadata->budget.header_bytes))
+            {
+                MIMEH_set_defect(hinfo, MIMEH_DEFECT_BUDGET_EXCEEDED);
+                MIME_element_exceed_budget("header bytes");
+                result = -1;
+                break;
+            }
+
             if (f->trueblank)
             {
                 if (MIMEH_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Trueblank line detected in header reading",FL, __func__);
@@ -2492,6 +2537,9 @@ void MIMEH_headers_process( struct MIMEH_header_info *hinfo )
 
     if (MIMEH_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Start [hinfo=%p]\n",FL, __func__, hinfo);
 
+    // Input ran out before any header line was collected
+    if (hinfo->headerline_buffer == NULL) return;
+
     /** Duplicate the headers for processing - this way we don't 'taint' the
      ** original headers during our searching / altering. **/
 
@@ -2834,6 +2882,7 @@ void MIMEH_dump_defects( struct MIMEH_header_info *hinfo )
     MIMEH_defect_description_array[MIMEH_DEFECT_MULTIPLE_QUOTES] = strdup("Multiple quotes");
     MIMEH_defect_description_array[MIMEH_DEFECT_MULTIPLE_NAMES] = strdup("Multiple names");
     MIMEH_defect_description_array[MIMEH_DEFECT_MULTIPLE_FILENAMES] = strdup("Multiple filenames");
+    MIMEH_defect_description_array[MIMEH_DEFECT_BUDGET_EXCEEDED] = strdup("Resource budget exceeded");
 
     for (i = 0; i < _MIMEH_DEFECT_ARRAY_SIZE; i++)
     {
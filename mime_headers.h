@@ -96,6 +96,7 @@
 #define MIMEH_DEFECT_MISSING_SEPARATORS 8
 #define MIMEH_DEFECT_MULTIPLE_NAMES 9
 #define MIMEH_DEFECT_MULTIPLE_FILENAMES 10
+#define MIMEH_DEFECT_BUDGET_EXCEEDED 11
 
 struct MIMEH_header_info
 {
@@ -182,6 +183,7 @@ int MIMEH_set_mailbox( int level );
 int MIMEH_set_doubleCR( int level );
 int MIMEH_set_doubleCR_save( int level );
 int MIMEH_get_doubleCR_save( void );
+int MIMEH_set_doubleCR_in_memory( int level );
 int MIMEH_set_headerfix( int level );
 int MIMEH_set_headers_save( FILE *f );
 int MIMEH_set_headers_nosave( void );
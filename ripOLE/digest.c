@@ -0,0 +1 @@
+../digest.c
\ No newline at end of file
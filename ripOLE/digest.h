@@ -0,0 +1 @@
+../digest.h
\ No newline at end of file
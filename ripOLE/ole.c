@@ -5,10 +5,11 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "logger.h"
 #include "pldstr.h"
-#include "bt-int.h"
 #include "bytedecoders.h"
 #include "mime_element.h"
 #include "olestream-unwrap.h"
@@ -20,6 +21,26 @@
 #define OLE_SECTORID_SAT					-3 /** Sector used by sector allocation Table  **/
 #define OLE_SECTORID_MSAT					-4 /** Sector used by master sector allocation Table **/
 
+/** One wanted stream, as passed between the loader threads and the writer **/
+struct OLE_stream_job {
+	struct OLE_directory_entry *adir;
+	unsigned char *data; /** Loaded chain, NULL if it could not be read **/
+	int result;
+	int ready;
+};
+
+struct OLE_stream_pool {
+	struct OLE_object *ole;
+	struct OLE_stream_job *jobs;
+	int job_count;
+	int next_job; /** Next job for a loader to take **/
+	int consumed; /** Jobs the writer is done with **/
+	int window; /** Most jobs loaded ahead of the writer **/
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t slot_free;
+};
+
 // Main header accessors
 #define header_id(x)							((x) +0)
 #define header_clid(x)							((x) +0x08)
@@ -118,6 +139,8 @@ int OLE_init( struct OLE_object *ole )
 	ole->quiet = 0;
 	ole->filename_report_fn = NULL;
 	ole->f = NULL;
+	ole->data = NULL;
+	ole->map = NULL;
 	ole->file_size = 0;
 
 	ole->FAT = NULL;
@@ -127,7 +150,15 @@ int OLE_init( struct OLE_object *ole )
 
 	ole->header_block[0] = '\0';
 	ole->ministream = NULL;
+	ole->ministream_size = 0;
+	ole->ministream_start = -1;
 	ole->properties = NULL;
+	ole->directory = NULL;
+	ole->directory_count = 0;
+
+	ole->save_unknown_streams = 0;
+	ole->stream_filter = NULL;
+	ole->threads = 1;
 
 	ole->header.sector_shift = 0;
 	ole->header.mini_sector_shift = 0;
@@ -269,6 +300,104 @@ int OLE_set_save_unknown_streams( struct OLE_object  *ole, int level )
 	return OLE_OK;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_set_stream_filter
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  const char *names, comma separated, eg "Ole10Native,Package,CONTENTS"
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Only streams whose name contains one of the names are loaded and
+decoded, everything else is skipped without being read.  NULL (the
+default) picks the streams the unwrapper knows how to decode, or
+every stream when unknown streams are being saved.  The string is
+not copied.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_set_stream_filter( struct OLE_object *ole, const char *names )
+{
+	ole->stream_filter = names;
+
+	return OLE_OK;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_set_threads
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  int threads, number of stream loader threads, 1 for none
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+See OLE_decode_streams_parallel().
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_set_threads( struct OLE_object *ole, int threads )
+{
+	if (threads < 1) threads = 1;
+	if (threads > OLE_THREADS_MAX) threads = OLE_THREADS_MAX;
+	ole->threads = threads;
+
+	return OLE_OK;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_stream_wanted
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  char *name, stream name, as plain bytes
+  ------------------
+  Exit Codes	: 1 if the stream passes the filter, else 0
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int OLE_stream_wanted( struct OLE_object *ole, char *name )
+{
+	const char *p = ole->stream_filter;
+
+	if (p == NULL)
+	{
+		if (ole->save_unknown_streams) return 1;
+		return OLEUNWRAP_is_decodable_stream( name );
+	}
+
+	while (*p != '\0')
+	{
+		char token[OLE_DIRECTORY_ELEMENT_NAME_SIZE];
+		size_t len = strcspn(p, ",");
+
+		if ((len > 0)&&(len < sizeof(token)))
+		{
+			memcpy(token, p, len);
+			token[len] = '\0';
+			if (strstr(name, token) != NULL) return 1;
+		}
+		p += len;
+		if (*p == ',') p++;
+	}
+
+	return 0;
+}
+
 
 /*-----------------------------------------------------------------\
   Function Name	: OLE_sectorpos
@@ -302,80 +431,110 @@ int OLE_sectorpos( struct OLE_object *ole, int SID )
 
 
 /*-----------------------------------------------------------------\
-  Function Name	: OLE_get_block
+  Function Name	: OLE_sector_ptr
+  Returns Type	: const unsigned char *
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  int SID, sector ID, -1 for the header
+  3.  int count, number of consecutive sectors wanted
+  ------------------
+  Exit Codes	: NULL if the sectors are not wholly inside the image
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Resolves a sector ID to where that sector (and the count-1 following
+it) lies in the in-memory (or mapped) image.  Only valid when
+ole->data is set.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+const unsigned char *OLE_sector_ptr( struct OLE_object *ole, int SID, int count )
+{
+	long long offset;
+	size_t length = (size_t)count *ole->header.sector_size;
+
+	if ((ole->data == NULL)||(count < 1)) return NULL;
+
+	offset = 512 +((long long)SID *ole->header.sector_size);
+	if ((offset < 0)||((unsigned long long)offset > ole->file_size)||(ole->file_size -offset < length)) return NULL;
+
+	return ole->data +offset;
+}
+
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_get_blocks
   Returns Type	: int
   ----Parameter List
-  1. struct OLE_object *ole, 
+  1. struct OLE_object *ole,
   2.  int block_index,  Block indexes / Sector ID's are signed ints.
-  3.  unsigned char *block_buffer , 
+  3.  int count, number of consecutive sectors to read
+  4.  unsigned char *block_buffer, room for count sectors
   ------------------
-  Exit Codes	: 
-  Side Effects	: 
+  Exit Codes	:
+  Side Effects	:
   --------------------------------------------------------------------
 Comments:
+Reads a run of consecutive sectors in one go: a single copy out of
+the image, or a single seek and read when the file is not mapped.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int OLE_get_block( struct OLE_object *ole, int block_index, unsigned char *block_buffer )
+int OLE_get_blocks( struct OLE_object *ole, int block_index, int count, unsigned char *block_buffer )
 {
+	size_t length = (size_t)count *ole->header.sector_size;
+
 	if (block_buffer == NULL)
 	{
 		LOGGER_log("%s:%d:%s:ERROR: Block buffer is NULL",FL,__func__);
 		return -1;
 	}
 
-	if (ole->f != NULL)
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: BlockIndex=%d, count=%d, Buffer=%p",FL,__func__, block_index, count, block_buffer);
+
+	if (ole->data != NULL)
 	{
-		int read_count = 0;
-		int fseek_result = 0;
-		size_t offset = 0;
-		unsigned char *bb = NULL;
+		const unsigned char *sector = OLE_sector_ptr( ole, block_index, count );
 
-		bb = malloc(sizeof(unsigned char) *ole->header.sector_size);
-		if (bb == NULL)
+		if (sector == NULL)
 		{
-			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate %d bytes for OLE block",FL,__func__, ole->header.sector_size);
-			return -1;
+			VOLE LOGGER_log("%s:%d:%s:Blocks %d..%d are past the end of the %zu byte image\n", FL,__func__, block_index, block_index +count -1, ole->file_size);
+			return OLEER_GET_BLOCK_READ;
 		}
 
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: BlockIndex=%d, Buffer=0x%x",FL,__func__, block_index, block_buffer);
+		memcpy(block_buffer, sector, length);
+
+	} else if (ole->f != NULL)
+	{
+		size_t read_count = 0;
+		int fseek_result = 0;
+		size_t offset = 0;
 
 		//20051211-2343:PLD: offset = (block_index +1) << ole->header.sector_shift;
 		offset = OLE_sectorpos(ole, block_index);
 
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Read offset in file = 0x%x size to read= 0x%x",FL,__func__,offset,ole->header.sector_size);
+		DOLE LOGGER_log("%s:%d:%s:DEBUG: Read offset in file = 0x%zx size to read= 0x%zx",FL,__func__,offset,length);
 
 		fseek_result = fseek(ole->f, offset, SEEK_SET);
 		if (fseek_result != 0)
 		{
-			if (bb != NULL) { free(bb); bb = NULL; }
-			LOGGER_log("%s:%d:%s:ERROR: Seek failure (block=%d:%d)",FL,__func__, block_index,offset, strerror(errno));
+			LOGGER_log("%s:%d:%s:ERROR: Seek failure (block=%d:%zu) %s",FL,__func__, block_index,offset, strerror(errno));
 			return OLEER_GET_BLOCK_SEEK;
 		}
 
-		//read_count = fread(block_buffer, sizeof(unsigned char), ole->header.sector_size, ole->f);
-		read_count = fread(bb, sizeof(unsigned char), ole->header.sector_size, ole->f);
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Read %d byte of data",FL,__func__,read_count);
-		if (read_count != (int)ole->header.sector_size)
+		// Straight into the caller's buffer
+		read_count = fread(block_buffer, sizeof(unsigned char), length, ole->f);
+		DOLE LOGGER_log("%s:%d:%s:DEBUG: Read %zu byte of data",FL,__func__,read_count);
+		if (read_count != length)
 		{
-			if (bb != NULL){ free(bb); bb = NULL; }
-			VOLE LOGGER_log("%s:%d:Mismatch in bytes read. Requested %d, got %d\n", FL,__func__, ole->header.sector_size, read_count);
+			VOLE LOGGER_log("%s:%d:%s:Mismatch in bytes read. Requested %zu, got %zu\n", FL,__func__, length, read_count);
 			return OLEER_GET_BLOCK_READ;
 		}
 
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Copying over memory read from file",FL,__func__);
-
-		memcpy(block_buffer, bb, ole->header.sector_size);
-
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: memory block copied to block_buffer",FL,__func__);
-
-		/* We're now done with BB, dispose of it */
-		if (bb) { free(bb); bb = NULL; }
-
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Disposed of temporary bb block",FL,__func__);
-
 	} else {
 		LOGGER_log("%s:%d:%s:ERROR: OLE file is closed\n",FL,__func__);
 		return -1;
@@ -386,6 +545,28 @@ int OLE_get_block( struct OLE_object *ole, int block_index, unsigned char *block
 	return OLE_OK;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_get_block
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole, 
+  2.  int block_index,  Block indexes / Sector ID's are signed ints.
+  3.  unsigned char *block_buffer , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_get_block( struct OLE_object *ole, int block_index, unsigned char *block_buffer )
+{
+	return OLE_get_blocks( ole, block_index, 1, block_buffer );
+}
+
 
 /*-----------------------------------------------------------------\
   Function Name	: OLE_get_miniblock
@@ -406,12 +587,11 @@ Changes:
 \------------------------------------------------------------------*/
 int OLE_get_miniblock( struct OLE_object *ole, int block_index, unsigned char *block_buffer )
 {
-	if (ole->ministream)
-	{
-		int offset = block_index << ole->header.mini_sector_shift;
+	if (OLE_load_ministream( ole ) != OLE_OK) return OLEER_MINISTREAM_READ_FAIL;
 
-		memcpy( block_buffer, ole->ministream +offset, ole->header.mini_sector_size);
-	}
+	if ((block_index < 0)||((size_t)(block_index +1) << ole->header.mini_sector_shift > ole->ministream_size)) return OLEER_GET_BLOCK_READ;
+
+	memcpy( block_buffer, ole->ministream +((size_t)block_index << ole->header.mini_sector_shift), ole->header.mini_sector_size);
 
 	return OLE_OK;
 }
@@ -539,12 +719,34 @@ Changes:
 \------------------------------------------------------------------*/
 int OLE_is_file_OLE( struct OLE_object *ole )
 {
+	return OLE_is_signature( ole->header_block, sizeof(ole->header_block) );
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_is_signature
+  Returns Type	: int
+  ----Parameter List
+  1. const unsigned char *head, leading bytes of the data
+  2.  size_t len,
+  ------------------
+  Exit Codes	: 1 if the data starts with an OLE2 id, else 0
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Lets callers which already have the first bytes of a file in hand
+skip the decode of anything that cannot be OLE.
 
-	if (memcmp(OLE_id_v1, ole->header_block, sizeof(OLE_id_v1))==0) return 1;
-	if (memcmp(OLE_id_v2, ole->header_block, sizeof(OLE_id_v2))==0) return 1;
+--------------------------------------------------------------------
+Changes:
 
-	return 0;
+\------------------------------------------------------------------*/
+int OLE_is_signature( const unsigned char *head, size_t len )
+{
+	if (len < sizeof(OLE_id_v2)) return 0;
+	if (memcmp(OLE_id_v1, head, sizeof(OLE_id_v1))==0) return 1;
+	if (memcmp(OLE_id_v2, head, sizeof(OLE_id_v2))==0) return 1;
 
+	return 0;
 }
 
 /*-----------------------------------------------------------------\
@@ -1079,89 +1281,114 @@ int OLE_load_FAT( struct OLE_object *ole )
 }
 
 /*-----------------------------------------------------------------\
-  Function Name	: OLE_follow_chain
+  Function Name	: OLE_walk_chain
   Returns Type	: int
   ----Parameter List
-  1. struct OLE_object *ole, 
-  2.  int FAT_sector_start , 
+  1. struct OLE_object *ole,
+  2.  unsigned char *table, the FAT or the miniFAT
+  3.  unsigned char *table_limit,
+  4.  int sector_limit, sectors at or past this are not in the file
+  5.  int FAT_sector_start,
+  6.  struct OLE_extent **extents, if not NULL, set to the runs of
+      consecutive sectors making up the chain (free() it)
+  7.  int *extent_count,
   ------------------
-  Exit Codes	: 
-  Side Effects	: 
+  Exit Codes	: number of sectors in the chain, -1 if the chain
+  loops back on itself (or memory ran out)
+  Side Effects	:
   --------------------------------------------------------------------
 Comments:
+Single pass over the FAT (or miniFAT).  Each sector visited is ticked off in a
+bitmap sized from the file, so a loop is caught the moment a sector
+comes up a second time, and runs of ascending sectors (the usual
+layout) are merged into extents as we go.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int OLE_follow_chain( struct OLE_object *ole, int FAT_sector_start )
+static int OLE_walk_chain( struct OLE_object *ole, unsigned char *table, unsigned char *table_limit, int sector_limit, int FAT_sector_start, struct OLE_extent **extents, int *extent_count )
 {
 	int current_sector = FAT_sector_start;
-	int chain_length=0;
-	int last_sector_of_file = ole->last_sector;
-	int break_out = 0;
-	struct bti_node *n;
+	int chain_length = 0;
+	int ext_count = 0, ext_size = 0;
+	struct OLE_extent *ext = NULL;
+	unsigned char *seen;
 
-	BTI_init(&n);
+	if (extents) *extents = NULL;
+	if (extent_count) *extent_count = 0;
 
-	if (FAT_sector_start < 0) return 0;
+	// Every sector has to have an entry in the table as well as be in the file
+	if ((table == NULL)||(table_limit < table)) return 0;
+	if ((table_limit -table) /LEN_ULONG < sector_limit) sector_limit = (table_limit -table) /LEN_ULONG;
+	if ((FAT_sector_start < 0)||(FAT_sector_start >= sector_limit)) return 0;
 
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Starting chain follow at sector %d",FL,__func__, FAT_sector_start );
+	seen = calloc((sector_limit +7) /8, 1);
+	if (seen == NULL)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot allocate chain bitmap for %d sectors",FL,__func__, sector_limit);
+		return -1;
+	}
 
-	do {
-		unsigned int next_sector;
-		unsigned char *next_sector_location;
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Starting chain follow at sector %d",FL,__func__, FAT_sector_start );
 
-		next_sector_location = ole->FAT +(LEN_ULONG *current_sector);
-		if (next_sector_location > (ole->FAT_limit -4)) {
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: ERROR: Next sector was outside of the limits of this file (%ld > %ld)",FL,__func__, next_sector_location, ole->FAT_limit);
+	while ((current_sector >= 0)&&(current_sector < sector_limit))
+	{
+		if (seen[current_sector >> 3] & (1 << (current_sector & 7)))
+		{
+			DOLE LOGGER_log("%s:%d:%s:DEBUG: Sector collision at %d, terminating chain traversal",FL,__func__, current_sector);
+			chain_length = -1;
 			break;
 		}
+		seen[current_sector >> 3] |= (1 << (current_sector & 7));
 
-		//next_sector = get_4byte_value( ole->FAT +(LEN_ULONG *current_sector));
-		next_sector = get_uint32((char*) next_sector_location );
-
-		if (BTI_add(&n, next_sector) != 0)
+		if (extents)
 		{
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Sector collision, terminating chain traversal",FL,__func__);
-			chain_length=-1;
+			if ((ext_count > 0)&&(ext[ext_count -1].start +ext[ext_count -1].count == current_sector))
+			{
+				ext[ext_count -1].count++;
+			} else {
+				if (ext_count == ext_size)
+				{
+					struct OLE_extent *grown;
 
-			break;
+					ext_size = ext_size ? ext_size *2 : 16;
+					grown = realloc(ext, ext_size *sizeof(struct OLE_extent));
+					if (grown == NULL)
+					{
+						LOGGER_log("%s:%d:%s:ERROR: Cannot allocate %d chain extents",FL,__func__, ext_size);
+						chain_length = -1;
+						break;
+					}
+					ext = grown;
+				}
+				ext[ext_count].start = current_sector;
+				ext[ext_count].count = 1;
+				ext_count++;
+			}
 		}
-
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: 0x%0X:%d)->(0x%0X:%d)\n",FL,__func__, current_sector, current_sector, next_sector, next_sector);
-
-		// 20040729-10H37 Added this to prevent endless loop which sometimes occurs at sector 0
-
-		if (next_sector == current_sector) break;
-
-		//		fflush(stdout);
-		current_sector = next_sector;
 		chain_length++;
 
-		/** Test to see if we should terminate this chain traversal **/
-		switch (current_sector) {
-			case OLE_SECTORID_MSAT:
-			case OLE_SECTORID_SAT:
-			case OLE_SECTORID_ENDOFCHAIN:
-			case OLE_SECTORID_FREE:
-				break_out=1;
-				break;
-			default:
-				break_out=0;
-		};
-		 
-		if (current_sector < 0) break_out = 1;
+		// Sector IDs at and above 0xFFFFFFFC are the end-of-chain / free
+		//		markers, which come out negative here and end the walk.
+		current_sector = (int)get_uint32((char *)( table +(LEN_ULONG *current_sector)));
+	}
 
-	} while ((break_out==0)&&(current_sector < last_sector_of_file));
+	free(seen);
 
-	BTI_done(&n);
+	if ((chain_length < 0)||(extents == NULL))
+	{
+		if (ext) free(ext);
+	} else {
+		*extents = ext;
+		if (extent_count) *extent_count = ext_count;
+	}
 
 	return chain_length;
 }
 
 /*-----------------------------------------------------------------\
-  Function Name	: OLE_follow_minichain
+  Function Name	: OLE_follow_chain
   Returns Type	: int
   ----Parameter List
   1. struct OLE_object *ole, 
@@ -1176,56 +1403,32 @@ Comments:
 Changes:
 
 \------------------------------------------------------------------*/
-int OLE_follow_minichain( struct OLE_object *ole, int miniFAT_sector_start )
+int OLE_follow_chain( struct OLE_object *ole, int FAT_sector_start )
 {
-	//unsigned int current_sector = miniFAT_sector_start;
-	int current_sector = miniFAT_sector_start;
-	int chain_length=0;
-	int break_out = 0;
-
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Starting at sector %d",FL,__func__, miniFAT_sector_start);
-
-	if (miniFAT_sector_start < 0) return 0;
-
-	do {
-		unsigned int next_sector;
-
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Requesting 4-byte value at '%d'",FL,__func__, ole->miniFAT +(LEN_ULONG *current_sector));
-		if (ole->miniFAT +(LEN_ULONG *current_sector) > ole->miniFAT_limit) {
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Requested location is out of bounds\n",FL,__func__);
-			return 0;
-		}
-
-		next_sector = get_uint32((char*) ole->miniFAT +(LEN_ULONG *current_sector));
-
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Current Msector(0x%0X:%d)->next(0x%0X:%d)\n", FL,__func__, current_sector, current_sector, next_sector, next_sector);
-
-		/** Check for conditions that indicate we should stop traversing this chain **/
-
-		/** 1. We cannot point to ourselves **/
-		if (current_sector == next_sector) break;
+	return OLE_walk_chain( ole, ole->FAT, ole->FAT_limit, ole->last_sector, FAT_sector_start, NULL, NULL );
+}
 
-		chain_length++;
-		current_sector = next_sector;
-
-		/** Test for non-positive type sector ID's **/
-		switch (current_sector) {
-			case OLE_SECTORID_MSAT:
-			case OLE_SECTORID_SAT:
-			case OLE_SECTORID_ENDOFCHAIN:
-			case OLE_SECTORID_FREE:
-				break_out=1;
-				break;
-			default:
-				break_out=0;
-		};
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_follow_minichain
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole, 
+  2.  int FAT_sector_start , 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
 
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: current sector = %d",FL,__func__,current_sector);
-	} while ((break_out==0)&&(current_sector <= ole->last_sector ));
+--------------------------------------------------------------------
+Changes:
 
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Done.  Chainlength=%d",FL,__func__, chain_length);
+\------------------------------------------------------------------*/
+int OLE_follow_minichain( struct OLE_object *ole, int miniFAT_sector_start )
+{
+	if (OLE_load_ministream( ole ) != OLE_OK) return 0;
 
-	return chain_length;
+	return OLE_walk_chain( ole, ole->miniFAT, ole->miniFAT_limit, ole->ministream_size >> ole->header.mini_sector_shift, miniFAT_sector_start, NULL, NULL );
 }
 
 /*-----------------------------------------------------------------\
@@ -1251,7 +1454,9 @@ unsigned char *OLE_load_minichain( struct OLE_object *ole, int miniFAT_sector_st
 {
 
 	int chain_length = 0;
-	int current_sector = miniFAT_sector_start;
+	int extent_count = 0;
+	int i;
+	struct OLE_extent *extents = NULL;
 	unsigned char *buffer;
 	unsigned char *bp;
 
@@ -1260,29 +1465,31 @@ unsigned char *OLE_load_minichain( struct OLE_object *ole, int miniFAT_sector_st
 	// Added this sanity checking 2003 Aug 28
 	if (miniFAT_sector_start < 0) return NULL;
 
-	chain_length = OLE_follow_minichain( ole, miniFAT_sector_start );
+	if (OLE_load_ministream( ole ) != OLE_OK) return NULL;
+
+	// The walk is bounded by the ministream, so every extent it hands
+	//		back lies wholly inside it.
+	chain_length = OLE_walk_chain( ole, ole->miniFAT, ole->miniFAT_limit, ole->ministream_size >> ole->header.mini_sector_shift, miniFAT_sector_start, &extents, &extent_count );
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: Found %d mini-sectors to load (%d bytes)\n",FL,__func__, chain_length, chain_length *ole->header.mini_sector_size);
 
 	// 20040911-21H59
 	// If our chain is 0 length, then there's nothing to return
-	if (chain_length == 0) return NULL;
+	if (chain_length <= 0) return NULL;
 
-	bp = buffer = malloc( chain_length *ole->header.mini_sector_size *sizeof(unsigned char));
+	bp = buffer = malloc( (size_t)chain_length *ole->header.mini_sector_size *sizeof(unsigned char));
 	if (buffer != NULL)
 	{
-		do {
-			unsigned int next_sector;
-
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading sector %d",FL,__func__, current_sector);
-			OLE_get_miniblock( ole, current_sector, bp );
-			bp += ole->header.mini_sector_size;
+		for (i = 0; i < extent_count; i++)
+		{
+			size_t length = (size_t)extents[i].count << ole->header.mini_sector_shift;
 
-			next_sector = get_uint32((char *)( ole->miniFAT +(LEN_ULONG *current_sector)));
-			current_sector = next_sector;
-		} while ((current_sector != OLE_SECTORID_ENDOFCHAIN)&&(current_sector >= 0)&&(current_sector <= ole->last_sector));
+			memcpy( bp, ole->ministream +((size_t)extents[i].start << ole->header.mini_sector_shift), length );
+			bp += length;
+		}
 	} else {
-		LOGGER_log("%s:%d:OLE_get_miniblock:ERROR: Failed to allocate enough memory for miniChain",FL,__func__);
+		LOGGER_log("%s:%d:%s:ERROR: Failed to allocate enough memory for miniChain",FL,__func__);
 	}
+	free(extents);
 
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: Done. buffer=%p",FL,__func__, buffer);
 
@@ -1291,94 +1498,86 @@ unsigned char *OLE_load_minichain( struct OLE_object *ole, int miniFAT_sector_st
 
 
 /*-----------------------------------------------------------------\
-  Function Name	: char
-  Returns Type	: unsigned
+  Function Name	: OLE_read_chain
+  Returns Type	: unsigned char *
   ----Parameter List
-  1. *OLE_load_chain( struct OLE_object *ole, 
-  2.  int FAT_sector_start , 
+  1. struct OLE_object *ole,
+  2.  int FAT_sector_start,
+  3.  size_t *chain_size, set to the bytes loaded
+  4.  int *error, set if a sector cannot be read
   ------------------
-  Exit Codes	: 
-  Side Effects	: 
+  Exit Codes	: The loaded chain, or NULL
+  Side Effects	:
   --------------------------------------------------------------------
 Comments:
+The body of OLE_load_chain(), reporting through its parameters
+rather than the ole object so that it may be run from several
+threads at once, given a mapped image.
 
 --------------------------------------------------------------------
 Changes:
-Make the loading aware of negative-value sectors so that it can
-make more intelligent exit strategies.
 
 \------------------------------------------------------------------*/
-unsigned char *OLE_load_chain( struct OLE_object *ole, int FAT_sector_start )
+static unsigned char *OLE_read_chain( struct OLE_object *ole, int FAT_sector_start, size_t *chain_size, int *error )
 {
 
 	int chain_length = 0;
-	int current_sector = FAT_sector_start;
+	int extent_count = 0;
+	int i;
+	struct OLE_extent *extents = NULL;
 	unsigned char *buffer = NULL;
 	unsigned char *bp = NULL;
 
 
-	ole->last_chain_size = 0;
+	*chain_size = 0;
 
 	if (FAT_sector_start < 0) return NULL;
 
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading chain, starting at sector %d",FL,__func__,FAT_sector_start);
 
-	chain_length = OLE_follow_chain( ole, FAT_sector_start );
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: %d sectors need to be loaded",FL,__func__,chain_length);
+	chain_length = OLE_walk_chain( ole, ole->FAT, ole->FAT_limit, ole->last_sector, FAT_sector_start, &extents, &extent_count );
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: %d sectors in %d runs need to be loaded",FL,__func__,chain_length,extent_count);
 
 	if (chain_length > 0)
 	{
 		size_t offset;
 
-		offset = ole->last_chain_size = chain_length << ole->header.sector_shift;
+		offset = *chain_size = (size_t)chain_length << ole->header.sector_shift;
 		bp = buffer = malloc( offset *sizeof(unsigned char));
 		if (buffer == NULL)
 		{
-			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate %d bytes for OLE chain",FL,__func__,offset);
+			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate %zu bytes for OLE chain",FL,__func__,offset);
+			free(extents);
 			return NULL;
 		}
 
-		if (buffer != NULL)
+		for (i = 0; i < extent_count; i++)
 		{
-			int tick = 0;
-			unsigned char *bp_limit;
-			bp_limit = bp +offset;
-
-			do {
-				int next_sector;
-
-				DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading sector[%d] %d",FL,__func__, tick, current_sector );
-
-				ole->error = OLE_get_block( ole, current_sector, bp );
-				if (ole->error != OLE_OK)
-				{
-					//FREE5					if (bp != NULL) free(bp);
-					return NULL;
-				}
+			DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading sectors %d..%d",FL,__func__, extents[i].start, extents[i].start +extents[i].count -1);
 
-				bp += ole->header.sector_size;
-				if (bp > bp_limit) {  
-					if (buffer != NULL) { free(buffer); bp = buffer = NULL; }
-					VOLE LOGGER_log("%s:%d:%s:ERROR: Load-chain went over memory boundary",FL,__func__); 
-					return NULL;
-				};
-
-				next_sector = get_uint32((char *)( ole->FAT +(LEN_ULONG *current_sector)));
-				current_sector = next_sector;
-				tick++;
-			} while ((current_sector >= 0)&&(current_sector <= ole->last_sector));
+			*error = OLE_get_blocks( ole, extents[i].start, extents[i].count, bp );
+			if (*error != OLE_OK)
+			{
+				free(buffer);
+				buffer = NULL;
+				break;
+			}
+			bp += (size_t)extents[i].count << ole->header.sector_shift;
 		}
 	}
+	if (extents) free(extents);
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: Done loading chain",FL,__func__);
 
 	return buffer;
 }
 
+
 /*-----------------------------------------------------------------\
-  Function Name	: OLE_input_file_data_ini
-  Returns Type	: int
+  Function Name	: char
+  Returns Type	: unsigned
   ----Parameter List
-  1. struct OLE_object *ole, 
+  1. *OLE_load_chain( struct OLE_object *ole, 
+  2.  int FAT_sector_start , 
   ------------------
   Exit Codes	: 
   Side Effects	: 
@@ -1387,29 +1586,199 @@ Comments:
 
 --------------------------------------------------------------------
 Changes:
+Make the loading aware of negative-value sectors so that it can
+make more intelligent exit strategies.
+
 \------------------------------------------------------------------*/
-int OLE_input_file_data_ini( struct OLE_object *ole )
+unsigned char *OLE_load_chain( struct OLE_object *ole, int FAT_sector_start )
 {
-		fseek(ole->f, 0L, SEEK_END);
-		ole->file_size = ftell(ole->f);
-		fseek(ole->f, 0L, SEEK_SET);
-		if (ole->file_size < OLE_HEADER_BLOCK_SIZE) {
-			fclose(ole->f);
-			ole->f = NULL;
-			return OLEER_NOT_OLE_FILE;
-		}
-		ole->last_sector = -1;
-	return OLE_OK;
+	unsigned char *buffer;
+	int error = OLE_OK;
+
+	buffer = OLE_read_chain( ole, FAT_sector_start, &(ole->last_chain_size), &error );
+	if (error != OLE_OK) ole->error = error;
+
+	return buffer;
 }
 
 /*-----------------------------------------------------------------\
-  Function Name	: OLE_open_file
+  Function Name	: OLE_load_ministream
   Returns Type	: int
   ----Parameter List
-  1. struct OLE_object *ole, 
-  2.  char *fullpath , 
+  1. struct OLE_object *ole,
   ------------------
-  Exit Codes	: 
+  Exit Codes	: OLE_OK once the miniFAT and ministream are in memory
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Both are only needed for streams under the mini cutoff size, so they
+are loaded the first time such a stream is wanted, and only ever
+once per file.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_load_ministream( struct OLE_object *ole )
+{
+	if (ole->ministream != NULL) return OLE_OK;
+	if (ole->ministream_start < 0) return OLEER_MINISTREAM_READ_FAIL;
+
+	if (ole->miniFAT == NULL)
+	{
+		DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading miniFAT chain", FL,__func__);
+		ole->miniFAT = OLE_load_chain( ole, ole->header.mini_fat_start );
+		if (ole->miniFAT == NULL)
+		{
+			ole->ministream_start = -1;
+			return OLEER_MINIFAT_READ_FAIL;
+		}
+		ole->miniFAT_limit = ole->miniFAT +ole->last_chain_size;
+	}
+
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading ministream/SmallBlockArray",FL,__func__);
+	ole->ministream = OLE_load_chain( ole, ole->ministream_start );
+	if (ole->ministream == NULL)
+	{
+		// Don't try again for every stream
+		ole->ministream_start = -1;
+		return OLEER_MINISTREAM_READ_FAIL;
+	}
+	ole->ministream_size = ole->last_chain_size;
+
+	return OLE_OK;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_load_directory
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  ------------------
+  Exit Codes	: OLE_OK, or OLEER_PROPERTIES_READ_FAIL
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Loads the directory stream and parses it into ole->directory, one
+entry per directory ID (names, types, sizes, start sectors and the
+red-black tree links), up to the first entry which is empty or
+invalid.  The raw directory is released once parsed.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_load_directory( struct OLE_object *ole )
+{
+	unsigned char *current_property, *property_limit;
+	int count = 0;
+
+	if (ole->directory != NULL) return OLE_OK;
+
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading Directory stream chain", FL,__func__);
+	ole->properties = OLE_load_chain( ole, ole->header.directory_stream_start_sector );
+	if (ole->properties == NULL) return OLEER_PROPERTIES_READ_FAIL;
+
+	property_limit = ole->properties +ole->last_chain_size;
+
+	ole->directory = malloc( (ole->last_chain_size /128 +1) *sizeof(struct OLE_directory_entry) );
+	if (ole->directory == NULL)
+	{
+		LOGGER_log("%s:%d:%s:ERROR: Cannot allocate the directory index",FL,__func__);
+		return OLEER_PROPERTIES_READ_FAIL;
+	}
+
+	for (current_property = ole->properties; current_property +128 <= property_limit; current_property += 128)
+	{
+		struct OLE_directory_entry *adir = &(ole->directory[count]);
+
+		if (get_uint8((char *)current_property) < 1) break;
+
+		OLE_dir_init(adir);
+		OLE_convert_directory( ole, current_property, adir );
+
+		DOLE {
+			LOGGER_log("%s:%d:%s:DEBUG:--------- DIRECTORY INDEX: %d",FL,__func__,count);
+			OLE_print_directory( ole, adir);
+		}
+
+		if (adir->element_colour > 1) break;
+		if ((adir->element_type == STGTY_INVALID)||(adir->element_type > STGTY_ROOT))
+		{
+			DOLE LOGGER_log("%s:%d:%s:DEBUG: breaking out due to element type %d",FL,__func__, adir->element_type);
+			break;
+		}
+
+		memset(adir->name, '\0', sizeof(adir->name));
+		OLE_dbstosbs( adir->element_name, adir->element_name_byte_count, adir->name, sizeof(adir->name) );
+
+		// The root entry's chain is the ministream
+		if ((adir->element_type == STGTY_ROOT)&&(ole->ministream_start < 0)) ole->ministream_start = adir->start_sector;
+
+		count++;
+	}
+	ole->directory_count = count;
+
+	free(ole->properties);
+	ole->properties = NULL;
+
+	return OLE_OK;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_input_file_data_ini
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole, 
+  ------------------
+  Exit Codes	: 
+  Side Effects	: 
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+\------------------------------------------------------------------*/
+int OLE_input_file_data_ini( struct OLE_object *ole )
+{
+		int fd;
+
+		fseek(ole->f, 0L, SEEK_END);
+		ole->file_size = ftell(ole->f);
+		fseek(ole->f, 0L, SEEK_SET);
+		if (ole->file_size < OLE_HEADER_BLOCK_SIZE) {
+			fclose(ole->f);
+			ole->f = NULL;
+			return OLEER_NOT_OLE_FILE;
+		}
+		ole->last_sector = -1;
+
+		// Map the whole container if we can, so that sectors are
+		//		simply addressed in place rather than seek+read one
+		//		at a time.  Streams without a descriptor (fmemopen)
+		//		are still read through ole->f.
+		fd = fileno(ole->f);
+		if (fd != -1)
+		{
+			void *map = mmap(NULL, ole->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if (map != MAP_FAILED)
+			{
+				ole->map = map;
+				ole->data = map;
+			} else DOLE LOGGER_log("%s:%d:%s:DEBUG: Cannot map the file, reading by sector (%s)",FL,__func__,strerror(errno));
+		}
+	return OLE_OK;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_open_file
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole, 
+  2.  char *fullpath , 
+  ------------------
+  Exit Codes	: 
   Side Effects	: 
   --------------------------------------------------------------------
 Comments:
@@ -1512,12 +1881,19 @@ Changes:
 \------------------------------------------------------------------*/
 int OLE_store_stream( struct OLE_object *ole, char *stream_name, RIPMIME_output *unpack_metadata, char *stream, size_t stream_size )
 {
-	MIME_element* cur_mime = MIME_element_add (NULL, unpack_metadata, stream_name, "OLE", "OLE", "OLE", 0, 1, 0, __func__);
+	MIME_element* cur_mime;
 
-	size_t written_bytes = fwrite( stream, 1, stream_size, cur_mime->f );
-	if (written_bytes != stream_size)
+	if (!MIME_output_size_wanted(unpack_metadata, stream_size))
 	{
-		LOGGER_log("%s:%d:%s:WARNING: Only wrote %d of %d bytes to file %s",FL,__func__,written_bytes,stream_size,cur_mime->fullpath);
+		DOLE LOGGER_log("%s:%d:%s:DEBUG: '%s' is outside the size limits, not storing it",FL,__func__,stream_name);
+		return OLE_OK;
+	}
+
+	cur_mime = MIME_element_add (NULL, unpack_metadata, stream_name, "OLE", "OLE", "OLE", 0, 1, 0, __func__);
+
+	if (MIME_element_write( cur_mime, stream, stream_size ) != 0)
+	{
+		LOGGER_log("%s:%d:%s:WARNING: Could not write %d bytes to file %s",FL,__func__,stream_size,cur_mime->fullpath);
 	}
 	MIME_element_deactivate (cur_mime, unpack_metadata);
 
@@ -1552,6 +1928,20 @@ void OLE_decode_done( struct OLE_object *ole )
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: OLE streams",FL,__func__);
 	if (ole->ministream) free(ole->ministream);
 	if (ole->properties) free(ole->properties);
+	if (ole->directory) free(ole->directory);
+	ole->FAT = ole->miniFAT = ole->ministream = ole->properties = NULL;
+	ole->miniFAT_limit = NULL;
+	ole->ministream_size = 0;
+	ole->ministream_start = -1;
+	ole->directory = NULL;
+	ole->directory_count = 0;
+
+	if (ole->map)
+	{
+		munmap(ole->map, ole->file_size);
+		if (ole->data == ole->map) ole->data = NULL;
+		ole->map = NULL;
+	}
 }
 
 
@@ -1580,60 +1970,46 @@ int OLE_terminate_and_return( struct OLE_object *ole, int result )
 }
 
 /*-----------------------------------------------------------------\
-  Date Code:	: 20081101-020137
-  Function Name	: OLE_decode_stream
-  Returns Type	: int
-  	----Parameter List
-	1. struct OLE_object *ole, 
-	2.   struct OLE_directory_entry *adir, 
-	3.  char *decode_path , 
-	------------------
-Exit Codes	: 
-Side Effects	: 
---------------------------------------------------------------------
+  Function Name	: OLE_load_stream
+  Returns Type	: unsigned char *
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  struct OLE_directory_entry *adir,
+  3.  int *result, set to the read failure if NULL is returned
+  ------------------
+  Exit Codes	: The stream's chain, from the FAT or the ministream
+  Side Effects	:
+  --------------------------------------------------------------------
 Comments:
+Touches nothing in the ole object, so, with the image mapped and the
+ministream already loaded, it may run from several threads at once.
 
 --------------------------------------------------------------------
 Changes:
 
 \------------------------------------------------------------------*/
-int OLE_decode_stream( struct OLE_object *ole, struct OLE_directory_entry *adir, RIPMIME_output *unpack_metadata )
+static unsigned char *OLE_load_stream( struct OLE_object *ole, struct OLE_directory_entry *adir, int *result )
 {
 	unsigned char *stream_data;
-	struct OLEUNWRAP_object oleuw;
-	int decode_result = OLEUW_STREAM_NOT_DECODED;
-	char element_name[64];
-	int result = 0;
-
-	memset(element_name, '\0', 64);
-	OLE_dbstosbs( adir->element_name, adir->element_name_byte_count, element_name, 64 );
 
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Decoding stream '%s'",FL,__func__, element_name);
-
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Initializing stream unwrapper",FL,__func__);
-	OLEUNWRAP_init(&oleuw);
-	OLEUNWRAP_set_debug(&oleuw,ole->debug);
-	OLEUNWRAP_set_verbose(&oleuw,ole->verbose);
-	OLEUNWRAP_set_filename_report_fn(&oleuw, ole->filename_report_fn);
-	OLEUNWRAP_set_save_unknown_streams(&oleuw, ole->save_unknown_streams);
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Unwrap engine set.",FL,__func__);
+	*result = 0;
 
 	if (adir->stream_size >= ole->header.mini_cutoff_size)
 	{
 		/** Standard size sector stored stream **/
 		/** Standard size sector stored stream **/
 		/** Standard size sector stored stream **/
+		size_t chain_size;
+		int error = OLE_OK;
+
 		DOLE LOGGER_log("%s:%d:%s:DEBUG:  Loading normal sized chain starting at sector %d",FL,__func__, adir->start_sector);
-		stream_data = OLE_load_chain( ole, (int)adir->start_sector );
+		stream_data = OLE_read_chain( ole, (int)adir->start_sector, &chain_size, &error );
 		if (stream_data == NULL)
 		{
 			DOLE LOGGER_log("%s:%d:%s:DEBUG: Terminating from stream data being NULL  ",FL,__func__);
 			//OLE_decode_done(ole);
-			return OLEER_MINISTREAM_STREAM_READ_FAIL;
+			*result = OLEER_MINISTREAM_STREAM_READ_FAIL;
 		}
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Normal decode START. element name ='%s' stream size = '%ld'",FL,__func__, element_name, adir->stream_size);
-		decode_result = OLEUNWRAP_decodestream( &oleuw, element_name, (char *)stream_data, adir->stream_size, unpack_metadata );
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Normal decode done.",FL,__func__);
 	} else {
 
 		/** Minichain/Minisector stored stream **/
@@ -1646,14 +2022,50 @@ int OLE_decode_stream( struct OLE_object *ole, struct OLE_directory_entry *adir,
 		{
 			DOLE LOGGER_log("%s:%d:%s:DEBUG: Ministream was non-existant, terminating",FL,__func__);
 			//OLE_decode_done(ole);
-			return OLEER_NORMALSTREAM_STREAM_READ_FAIL;
+			*result = OLEER_NORMALSTREAM_STREAM_READ_FAIL;
 		}
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Mini decode START.",FL,__func__);
-		decode_result = OLEUNWRAP_decodestream( &oleuw, element_name, (char *)stream_data, adir->stream_size, unpack_metadata );
-		DOLE LOGGER_log("%s:%d:%s:DEBUG: Mini decode done.",FL,__func__);
 	}
 
-	if ((stream_data != NULL)&&(decode_result == OLEUW_STREAM_NOT_DECODED)&&(ole->save_unknown_streams))
+	return stream_data;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_unwrap_stream
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  struct OLE_directory_entry *adir,
+  3.  unsigned char *stream_data, as returned by OLE_load_stream()
+  4.  RIPMIME_output *unpack_metadata ,
+  ------------------
+  Exit Codes	:
+  Side Effects	: writes out the unwrapped attachment, or the raw stream
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int OLE_unwrap_stream( struct OLE_object *ole, struct OLE_directory_entry *adir, unsigned char *stream_data, RIPMIME_output *unpack_metadata )
+{
+	struct OLEUNWRAP_object oleuw;
+	int decode_result = OLEUW_STREAM_NOT_DECODED;
+	char *element_name = adir->name;
+
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Initializing stream unwrapper",FL,__func__);
+	OLEUNWRAP_init(&oleuw);
+	OLEUNWRAP_set_debug(&oleuw,ole->debug);
+	OLEUNWRAP_set_verbose(&oleuw,ole->verbose);
+	OLEUNWRAP_set_filename_report_fn(&oleuw, ole->filename_report_fn);
+	OLEUNWRAP_set_save_unknown_streams(&oleuw, ole->save_unknown_streams);
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Unwrap engine set.",FL,__func__);
+
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Decode START. element name ='%s' stream size = '%ld'",FL,__func__, element_name, adir->stream_size);
+	decode_result = OLEUNWRAP_decodestream( &oleuw, element_name, (char *)stream_data, adir->stream_size, unpack_metadata );
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Decode done.",FL,__func__);
+
+	if ((decode_result == OLEUW_STREAM_NOT_DECODED)&&(ole->save_unknown_streams))
 	{
 		char *lfname;
 
@@ -1666,16 +2078,183 @@ int OLE_decode_stream( struct OLE_object *ole, struct OLE_directory_entry *adir,
 		} 
 	} // If we needed to save an unknown stream
 
+	return decode_result;
+}
+
+/*-----------------------------------------------------------------\
+  Date Code:	: 20081101-020137
+  Function Name	: OLE_decode_stream
+  Returns Type	: int
+  	----Parameter List
+	1. struct OLE_object *ole, 
+	2.   struct OLE_directory_entry *adir, 
+	3.  char *decode_path , 
+	------------------
+Exit Codes	: 
+Side Effects	: 
+--------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_decode_stream( struct OLE_object *ole, struct OLE_directory_entry *adir, RIPMIME_output *unpack_metadata )
+{
+	unsigned char *stream_data;
+	int result = 0;
+
+	DOLE LOGGER_log("%s:%d:%s:DEBUG: Decoding stream '%s'",FL,__func__, adir->name);
+
+	stream_data = OLE_load_stream( ole, adir, &result );
+	if (stream_data == NULL) return result;
+
+	OLE_unwrap_stream( ole, adir, stream_data, unpack_metadata );
+
 	// Clean up an stream_data which we may have 
 	// read in from the chain-loader.
-	if (stream_data) free(stream_data);
+	free(stream_data);
 
 	return result;
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_stream_loader
+  Returns Type	: void *
+  ----Parameter List
+  1. void *arg, the struct OLE_stream_pool being worked
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Body of each loader thread.  Takes the next job in directory order,
+never running more than pool->window jobs ahead of the writer, so
+the memory held in loaded streams stays bounded.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static void *OLE_stream_loader( void *arg )
+{
+	struct OLE_stream_pool *pool = arg;
+
+	pthread_mutex_lock( &(pool->lock) );
+	while (pool->next_job < pool->job_count)
+	{
+		struct OLE_stream_job *job;
+
+		if (pool->next_job -pool->consumed >= pool->window)
+		{
+			pthread_cond_wait( &(pool->slot_free), &(pool->lock) );
+			continue;
+		}
+
+		job = &(pool->jobs[pool->next_job++]);
+		pthread_mutex_unlock( &(pool->lock) );
+
+		job->data = OLE_load_stream( pool->ole, job->adir, &(job->result) );
+
+		pthread_mutex_lock( &(pool->lock) );
+		job->ready = 1;
+		pthread_cond_broadcast( &(pool->job_ready) );
+	}
+	pthread_mutex_unlock( &(pool->lock) );
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_decode_streams_parallel
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  struct OLE_stream_job *jobs, wanted streams, in directory order
+  3.  int job_count,
+  4.  RIPMIME_output *unpack_metadata ,
+  ------------------
+  Exit Codes	: OLE_OK, or -1 if no thread could be started
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Each stream's chain is independent once the FAT, miniFAT and
+directory are loaded, so the chain walks and sector copies are
+spread over ole->threads loader threads reading the shared, read
+only tables and mapped image.
+
+Unwrapping and storing stay on this thread, one stream at a time in
+directory order, as MIME_element naming and the output sinks are not
+thread safe; this also keeps the output names exactly those of a
+serial decode.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+static int OLE_decode_streams_parallel( struct OLE_object *ole, struct OLE_stream_job *jobs, int job_count, RIPMIME_output *unpack_metadata )
+{
+	struct OLE_stream_pool pool;
+	pthread_t loaders[OLE_THREADS_MAX];
+	int loader_count = 0;
+	int i;
+
+	pool.ole = ole;
+	pool.jobs = jobs;
+	pool.job_count = job_count;
+	pool.next_job = 0;
+	pool.consumed = 0;
+	pool.window = ole->threads *2;
+	pthread_mutex_init( &(pool.lock), NULL );
+	pthread_cond_init( &(pool.job_ready), NULL );
+	pthread_cond_init( &(pool.slot_free), NULL );
+
+	for (i = 0; (i < ole->threads)&&(i < job_count); i++)
+	{
+		if (pthread_create( &(loaders[loader_count]), NULL, OLE_stream_loader, &pool ) != 0)
+		{
+			LOGGER_log("%s:%d:%s:WARNING: Could only start %d of %d stream loaders",FL,__func__, loader_count, ole->threads);
+			break;
+		}
+		loader_count++;
+	}
+
+	if (loader_count > 0)
+	{
+		for (i = 0; i < job_count; i++)
+		{
+			pthread_mutex_lock( &(pool.lock) );
+			while (jobs[i].ready == 0) pthread_cond_wait( &(pool.job_ready), &(pool.lock) );
+			pthread_mutex_unlock( &(pool.lock) );
+
+			if (jobs[i].data != NULL)
+			{
+				OLE_unwrap_stream( ole, jobs[i].adir, jobs[i].data, unpack_metadata );
+				free(jobs[i].data);
+				jobs[i].data = NULL;
+			}
+
+			pthread_mutex_lock( &(pool.lock) );
+			pool.consumed++;
+			pthread_cond_broadcast( &(pool.slot_free) );
+			pthread_mutex_unlock( &(pool.lock) );
+		}
+
+		for (i = 0; i < loader_count; i++) pthread_join( loaders[i], NULL );
+	}
+
+	pthread_cond_destroy( &(pool.slot_free) );
+	pthread_cond_destroy( &(pool.job_ready) );
+	pthread_mutex_destroy( &(pool.lock) );
+
+	return (loader_count > 0) ? OLE_OK : -1;
+}
+
 int OLE_decode( struct OLE_object *ole, RIPMIME_output *unpack_metadata )
 {
-	unsigned char *current_property, *property_limit;
+	struct OLE_stream_job *jobs = NULL;
+	int job_count = 0;
+	int need_ministream = 0;
 	int result = 0;
 	int i;
 
@@ -1705,73 +2284,64 @@ int OLE_decode( struct OLE_object *ole, RIPMIME_output *unpack_metadata )
 	result = OLE_load_FAT( ole );
 	if (result != 0) return result;
 
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading miniFAT chain", FL,__func__);
-	ole->miniFAT = OLE_load_chain( ole, ole->header.mini_fat_start );
-	if (ole->miniFAT == NULL) return OLEER_MINIFAT_READ_FAIL;
-
-	DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading Directory stream chain", FL,__func__);
-	ole->properties = OLE_load_chain( ole, ole->header.directory_stream_start_sector );
-	if (ole->properties == NULL) return OLEER_PROPERTIES_READ_FAIL;
+	result = OLE_load_directory( ole );
+	if (result != 0) return result;
 
-	i=0;
-	current_property = ole->properties;
-	property_limit = current_property +ole->last_chain_size ;
-	// while(1)
-	while (current_property < property_limit)
+	// With more than one thread the wanted streams are gathered first
+	//		and handed to the loader pool, which needs the image mapped
+	//		so that the loaders never share a FILE position.
+	if ((ole->threads > 1)&&(ole->data != NULL))
 	{
-		struct OLE_directory_entry a_dir_object, *adir;
-		int property_value=0;
+		jobs = malloc( ole->directory_count *sizeof(struct OLE_stream_job) );
+	}
 
-		adir = &a_dir_object;
+	for (i = 0; i < ole->directory_count; i++)
+	{
+		struct OLE_directory_entry *adir = &(ole->directory[i]);
 
-		OLE_dir_init(adir);
+		if (adir->element_type != STGTY_STREAM)
+		{
+			/** The root and storage entries carry no data of their own
+			 ** (the root's chain being the ministream, which is loaded
+			 ** only when a wanted stream needs it), and the rest are
+			 ** empty or used for the MSAT/SAT, either way we just step
+			 ** over them and carry on **/
+			DOLE LOGGER_log("%s:%d:%s:DEBUG: Element type %d does not need to be handled",FL,__func__,adir->element_type);
+			continue;
+		}
 
-		property_value = get_uint8((char *)current_property);
-		if (property_value < 1) break;
+		if (!OLE_stream_wanted( ole, adir->name ))
+		{
+			DOLE LOGGER_log("%s:%d:%s:DEBUG: Skipping stream '%s'",FL,__func__,adir->name);
+			continue;
+		}
 
-		DOLE LOGGER_log("%s:%d:%s:DEBUG:--------- DIRECTORY INDEX: %d",FL,__func__,i);
+		/** STREAM ELEMENT **/
+		if (jobs != NULL)
+		{
+			memset( &(jobs[job_count]), 0, sizeof(struct OLE_stream_job) );
+			jobs[job_count].adir = adir;
+			if (adir->stream_size < ole->header.mini_cutoff_size) need_ministream = 1;
+			job_count++;
+			continue;
+		}
 
-		OLE_convert_directory( ole, current_property, adir );
+		OLE_decode_stream( ole, adir, unpack_metadata );
 
-		DOLE {
-			LOGGER_log("%s:%d:%s:DEBUG: Printing directory details...",FL,__func__);
-			OLE_print_directory( ole, adir);
-			LOGGER_log("%s:%d:%s:DEBUG: End of directory details",FL,__func__);
-		}
+	} // For every directory entry
 
-		if (adir->element_colour > 1) break;
+	if (jobs != NULL)
+	{
+		// Load the ministream up front, rather than have the loaders
+		//		race to do it on first use.
+		if (need_ministream) OLE_load_ministream( ole );
 
-		if ((adir->element_type == STGTY_INVALID)||(adir->element_type > STGTY_ROOT))
+		if (OLE_decode_streams_parallel( ole, jobs, job_count, unpack_metadata ) != OLE_OK)
 		{
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: breaking out due to element type %d",FL,__func__, adir->element_type);
-			break;
-		} else if (adir->element_type == STGTY_ROOT){
-			/** ROOT DIRECTORY ENTRY **/
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Loading ministream/SmallBlockArray",FL,__func__);
-			ole->ministream = OLE_load_chain( ole, adir->start_sector );
-			if (ole->ministream == NULL) return OLEER_MINISTREAM_READ_FAIL;
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: ministream done",FL,__func__);
-		} else if (adir->element_type == STGTY_STORAGE) {
-			/** STORAGE ELEMENT **/
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Item is directory, start child is at index %d\n",FL,__func__,i);
-			ole->ministream = OLE_load_chain( ole, adir->start_sector );
-			if (ole->ministream == NULL) return OLEER_MINISTREAM_READ_FAIL;
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: DIRECTORY ministream done",FL,__func__);
-		} else if (adir->element_type == STGTY_STREAM) {
-			/** STREAM ELEMENT **/
-			OLE_decode_stream( ole, adir, unpack_metadata );
-		} else {
-			/** If the element isn't of the above types then it's possibly 
-			 ** an empty element or just one used for the MSAT/SAT
-			 ** either way we just step over it and carry on **/
-			DOLE LOGGER_log("%s:%d:%s:DEBUG: Element type %d does not need to be handled",FL,__func__,adir->element_type);
+			for (i = 0; i < job_count; i++) OLE_decode_stream( ole, jobs[i].adir, unpack_metadata );
 		}
-		// Jump to the next property record, which
-		//		is always 128 bytes ahead.
-		current_property += 128;
-		i++;
-
-	} // While there are still more directory entries to read in.
+		free(jobs);
+	}
 
 	DOLE LOGGER_log("%s:%d:%s:DEBUG: Finished",FL,__func__);
 
@@ -1832,3 +2402,43 @@ int OLE_decode_file( struct OLE_object *ole, FILE *f, RIPMIME_output *unpack_met
 	if (result != 0) return result;
 	return OLE_decode( ole, unpack_metadata );
 }
+
+/*-----------------------------------------------------------------\
+  Function Name	: OLE_decode_buffer
+  Returns Type	: int
+  ----Parameter List
+  1. struct OLE_object *ole,
+  2.  const unsigned char *data, the whole OLE2 image
+  3.  size_t size,
+  4.  RIPMIME_output *unpack_metadata,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+Decodes an image which is already in memory, such as a part which
+ripMIME has just decoded.  Sectors are copied straight out of the
+image; it is only ever read, and must stay put until the decode is
+done.
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int OLE_decode_buffer( struct OLE_object *ole, const unsigned char *data, size_t size, RIPMIME_output *unpack_metadata )
+{
+	// Reject any bad paramters.
+	if (ole == NULL) return OLEER_DECODE_NULL_OBJECT;
+	if (data == NULL) return OLEER_DECODE_NULL_FILENAME;
+	if (unpack_metadata == NULL || unpack_metadata->dir == NULL) return OLEER_DECODE_NULL_PATH;
+
+	if (size < OLE_HEADER_BLOCK_SIZE) return OLEER_NOT_OLE_FILE;
+
+	ole->f = NULL;
+	ole->map = NULL;
+	ole->data = data;
+	ole->file_size = size;
+	ole->last_sector = -1;
+
+	return OLE_decode( ole, unpack_metadata );
+}
@@ -25,6 +25,8 @@
 
 #define OLEER_MEMORY_OVERFLOW					50
 
+#define OLE_THREADS_MAX 16
+
 #define OLE_VERBOSE_NORMAL			1
 #define OLE_VERBOSE_FATREAD			2
 #define OLE_VERBOSE_DIRREAD			4
@@ -77,9 +79,17 @@ struct OLE_directory_entry {
 	unsigned char timestamps[OLE_DIRECTORY_TIMESTAMPS_SIZE];
 	long int start_sector;
 	unsigned int stream_size;
+
+	char name[OLE_DIRECTORY_ELEMENT_NAME_SIZE]; /** element_name as plain bytes, for matching **/
 };
 
 	
+/* A run of consecutive sectors in a chain */
+struct OLE_extent {
+	int start;
+	int count;
+};
+
 #define OLE_HEADER_BLOCK_SIZE 512
 struct OLE_object {
 	int error;
@@ -88,13 +98,19 @@ struct OLE_object {
 	size_t last_chain_size;
 
 	FILE *f;
+	const unsigned char *data; /** In-memory image, used in place of f when set **/
+	void *map; /** data, when we mapped it ourselves from f **/
 	unsigned char *FAT;
 	unsigned char *FAT_limit; /** Added to prevent segment violations **/
 	unsigned char *miniFAT;
 	unsigned char *miniFAT_limit; /** Added to prevent segment violations **/
 	unsigned char header_block[OLE_HEADER_BLOCK_SIZE];
-	unsigned char *ministream;
+	unsigned char *ministream; /** Loaded on first use, see OLE_load_ministream() **/
+	size_t ministream_size;
+	long int ministream_start; /** Root entry's chain, -1 if there is none **/
 	unsigned char *properties;
+	struct OLE_directory_entry *directory; /** Parsed directory, see OLE_load_directory() **/
+	int directory_count;
 
 	struct OLE_header header;
 	
@@ -103,6 +119,8 @@ struct OLE_object {
 	int verbose;
 	int quiet;
 	int save_unknown_streams;
+	const char *stream_filter; /** Comma separated stream names to extract, NULL for the default **/
+	int threads; /** Stream loader threads, 1 to decode serially **/
 	
 	int save_streams;
 	int save_mini_streams;
@@ -124,7 +142,11 @@ int OLE_set_verbose( struct OLE_object *ole, int level );
 int OLE_set_debug( struct OLE_object *ole, int level );
 int OLE_set_quiet( struct OLE_object *ole, int level );
 int OLE_set_save_unknown_streams( struct OLE_object  *ole, int level );
+int OLE_set_stream_filter( struct OLE_object *ole, const char *names );
+int OLE_set_threads( struct OLE_object *ole, int threads );
 
+const unsigned char *OLE_sector_ptr( struct OLE_object *ole, int SID, int count );
+int OLE_get_blocks( struct OLE_object *ole, int block_index, int count, unsigned char *block_buffer );
 int OLE_get_block( struct OLE_object *ole, int block_index, unsigned char *block_buffer );
 int OLE_get_miniblock( struct OLE_object *ole, int block_index, unsigned char *block_buffer );
 int OLE_dbstosbs( char *raw_string, size_t char_count, char *clean_string, int clean_string_len );
@@ -136,6 +158,8 @@ int OLE_print_header( struct OLE_object *ole );
 int OLE_convert_directory(struct OLE_object *ole, unsigned char *buf, struct OLE_directory_entry *dir );
 int OLE_print_directory( struct OLE_object *ole, struct OLE_directory_entry *dir );
 int OLE_load_FAT( struct OLE_object *ole );
+int OLE_load_directory( struct OLE_object *ole );
+int OLE_load_ministream( struct OLE_object *ole );
 int OLE_follow_chain( struct OLE_object *ole, int FAT_sector_start );
 int OLE_follow_minichain( struct OLE_object *ole, int miniFAT_sector_start );
 unsigned char *OLE_load_minichain( struct OLE_object *ole, int miniFAT_sector_start );
@@ -143,6 +167,8 @@ unsigned char *OLE_load_chain( struct OLE_object *ole, int FAT_sector_start );
 int OLE_open_file( struct OLE_object *ole, char *fullpath );
 int OLE_decode_diskfile( struct OLE_object *ole, char *fname, RIPMIME_output *unpack_metadata );
 int OLE_decode_file( struct OLE_object *ole, FILE *f, RIPMIME_output *unpack_metadata );
+int OLE_is_signature( const unsigned char *head, size_t len );
+int OLE_decode_buffer( struct OLE_object *ole, const unsigned char *data, size_t size, RIPMIME_output *unpack_metadata );
 void OLE_decode_done( struct OLE_object *ole );
 
 // Our callbacks.
@@ -35,6 +35,27 @@ struct typesig {
 	char *sequence;
 	int length;
 	int offset;
+	int (*verify)( char *bp, size_t remaining );
+};
+
+static int OLEUNWRAP_verify_bmp( char *bp, size_t remaining );
+static int OLEUNWRAP_verify_pe( char *bp, size_t remaining );
+
+/** Indexed by the OLEUW_SIG_* codes **/
+static struct typesig sigs[OLEUW_SIG_COUNT]= {
+	{ "\x89PNG\r\n\x1a\n", 8, 0, NULL }, /** PNG **/
+	{ "\xff\xd8\xff", 3, 0, NULL }, /** JPEG **/
+	{ "GIF8", 4, 0, NULL }, /** GIF87a, GIF89a **/
+	{ "BM", 2, 0, OLEUNWRAP_verify_bmp }, /** BMP **/
+	{ "%PDF-", 5, 0, NULL }, /** PDF **/
+	{ "PK\x03\x04", 4, 0, NULL }, /** ZIP local header, also OOXML **/
+	{ "{\\rtf", 5, 0, NULL }, /** RTF **/
+	{ "MZ", 2, 0, OLEUNWRAP_verify_pe }, /** PE executable **/
+	{ "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8, 0, NULL } /** OLE2 **/
+};
+
+static char *sig_names[OLEUW_SIG_COUNT]= {
+	"PNG", "JPEG", "GIF", "BMP", "PDF", "ZIP", "RTF", "PE", "OLE2"
 };
 
 
@@ -150,7 +171,6 @@ int OLEUNWRAP_save_stream( struct OLEUNWRAP_object *oleuw, char *fname, RIPMIME_
 {
 	int result = 0;
 	MIME_element* cur_mime = NULL;
-	size_t write_count;
 
 	DUW LOGGER_log("%s:%d:%s:DEBUG: fname=%s, decodepath=%s, size=%ld"
 			,FL,__func__
@@ -159,12 +179,17 @@ int OLEUNWRAP_save_stream( struct OLEUNWRAP_object *oleuw, char *fname, RIPMIME_
 			,bytes
 			);
 
+	if (!MIME_output_size_wanted(unpack_metadata, bytes))
+	{
+		DUW LOGGER_log("%s:%d:%s:DEBUG: '%s' is outside the size limits, not saving it",FL,__func__, fname);
+		return result;
+	}
+
 	cur_mime = MIME_element_add (NULL, unpack_metadata, fname, "OLE", "OLE", "OLE", 0, 1, 0, __func__);
 
-	write_count = fwrite( stream, 1, bytes, cur_mime->f );
-	if (write_count != bytes)
+	if (MIME_element_write( cur_mime, stream, bytes ) != 0)
 	{
-		LOGGER_log("%s:%d:%s:WARNING: Only wrote %d of %d bytes to file %s\n",FL,__func__, write_count, bytes, cur_mime->fullpath );
+		LOGGER_log("%s:%d:%s:WARNING: Could not write %d bytes to file %s\n",FL,__func__, bytes, cur_mime->fullpath );
 	}
 
 	MIME_element_deactivate (cur_mime, unpack_metadata);
@@ -202,6 +227,153 @@ int OLEUNWRAP_sanitize_filename( char *fname )
 		return 0;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name	: OLEUNWRAP_verify_bmp
+ Returns Type	: int
+ 	----Parameter List
+	1. char *bp, start of a "BM" hit
+	2.  size_t remaining, bytes available from bp
+ 	------------------
+ Exit Codes	: 1 if the BITMAPFILEHEADER looks sane, else 0
+ Side Effects	: 
+--------------------------------------------------------------------
+ Comments:
+ Two bytes alone match far too often, so insist on a non-zero file
+ size, zeroed reserved words and a pixel offset past the headers.
+ 
+--------------------------------------------------------------------
+ Changes:
+ 
+\------------------------------------------------------------------*/
+static int OLEUNWRAP_verify_bmp( char *bp, size_t remaining )
+{
+	size_t offbits;
+
+	if (remaining < 14) return 0;
+	if (get_uint32( bp +2 ) < 14) return 0;
+	if (get_uint32( bp +6 ) != 0) return 0;
+
+	offbits = get_uint32( bp +10 );
+	if ((offbits < 26)||(offbits > get_uint32( bp +2 ))) return 0;
+
+	return 1;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: OLEUNWRAP_verify_pe
+ Returns Type	: int
+ 	----Parameter List
+	1. char *bp, start of an "MZ" hit
+	2.  size_t remaining, bytes available from bp
+ 	------------------
+ Exit Codes	: 1 if e_lfanew leads to a "PE\0\0" header, else 0
+ Side Effects	: 
+--------------------------------------------------------------------
+ Comments:
+ 
+--------------------------------------------------------------------
+ Changes:
+ 
+\------------------------------------------------------------------*/
+static int OLEUNWRAP_verify_pe( char *bp, size_t remaining )
+{
+	size_t lfanew;
+
+	if (remaining < 0x40) return 0;
+
+	lfanew = get_uint32( bp +0x3c );
+	if ((lfanew < 0x40)||(lfanew > remaining -4)) return 0;
+
+	return (memcmp( bp +lfanew, "PE\0\0", 4 ) == 0);
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: OLEUNWRAP_sig_name
+ Returns Type	: char *
+ 	----Parameter List
+	1. int sig, one of the OLEUW_SIG_* codes
+ 	------------------
+ Exit Codes	: 
+ Side Effects	: 
+--------------------------------------------------------------------
+ Comments:
+ 
+--------------------------------------------------------------------
+ Changes:
+ 
+\------------------------------------------------------------------*/
+char *OLEUNWRAP_sig_name( int sig )
+{
+	if ((sig < 0)||(sig >= OLEUW_SIG_COUNT)) return "unknown";
+	return sig_names[sig];
+}
+
+/*-----------------------------------------------------------------\
+ Function Name	: OLEUNWRAP_scan_file_sigs
+ Returns Type	: int
+ 	----Parameter List
+	1. struct OLEUNWRAP_object *oleuw, 
+	2.  char *block, data to scan
+	3.  size_t block_len, 
+	4.  int sig_mask, OR of OLEUW_SIG_MASK() for the wanted types
+	5.  struct OLEUNWRAP_sig_hit *hits, filled in order of offset
+	6.  int max_hits, 
+ 	------------------
+ Exit Codes	: The number of hits stored in hits[]
+ Side Effects	: 
+--------------------------------------------------------------------
+ Comments:
+ Single pass over the block.  A 256 entry table gives, for each byte
+ value, the mask of signatures starting with it, so most offsets cost
+ one lookup; only the signatures flagged there are compared in full,
+ then passed to their verify function if they have one.  Every
+ offset at which a wanted signature is found is reported, letting
+ the caller carve all the embedded payloads without rescanning.
+ 
+--------------------------------------------------------------------
+ Changes:
+ 
+\------------------------------------------------------------------*/
+int OLEUNWRAP_scan_file_sigs( struct OLEUNWRAP_object *oleuw, char *block, size_t block_len, int sig_mask, struct OLEUNWRAP_sig_hit *hits, int max_hits )
+{
+	int first[256];
+	int hit_count = 0;
+	int sig;
+	size_t offset;
+
+	memset( first, 0, sizeof(first) );
+	for (sig = 0; sig < OLEUW_SIG_COUNT; sig++)
+	{
+		if (sig_mask & OLEUW_SIG_MASK(sig)) first[(unsigned char)sigs[sig].sequence[0]] |= OLEUW_SIG_MASK(sig);
+	}
+
+	for (offset = 0; (offset < block_len)&&(hit_count < max_hits); offset++)
+	{
+		int candidates = first[(unsigned char)block[offset]];
+		size_t remaining = block_len -offset;
+
+		if (candidates == 0) continue;
+
+		for (sig = 0; sig < OLEUW_SIG_COUNT; sig++)
+		{
+			struct typesig *tsp = &(sigs[sig]);
+
+			if ((candidates & OLEUW_SIG_MASK(sig)) == 0) continue;
+			if (remaining < (size_t)tsp->length) continue;
+			if (memcmp( block +offset, tsp->sequence, tsp->length ) != 0) continue;
+			if ((tsp->verify != NULL)&&(tsp->verify( block +offset, remaining ) == 0)) continue;
+
+			DUW LOGGER_log("%s:%d:%s:DEBUG: Hit at offset %ld for signature %s",FL,__func__, (long)offset, sig_names[sig]);
+			hits[hit_count].offset = offset;
+			hits[hit_count].sig = sig;
+			hit_count++;
+			break;
+		}
+	}
+
+	return hit_count;
+}
+
 /*-----------------------------------------------------------------\
  Function Name	: OLEUNWRAP_seach_for_file_sig
  Returns Type	: int
@@ -215,6 +387,7 @@ int OLEUNWRAP_sanitize_filename( char *fname )
  Side Effects	: 
 --------------------------------------------------------------------
  Comments:
+ Only looks for the compressed image formats an Escher blob holds.
  
 --------------------------------------------------------------------
  Changes:
@@ -222,54 +395,11 @@ int OLEUNWRAP_sanitize_filename( char *fname )
 \------------------------------------------------------------------*/
 int OLEUNWRAP_seach_for_file_sig( struct OLEUNWRAP_object *oleuw, char *block, size_t block_len )
 {
-	int result = -1;
-	int hit = 0;
-	char *p;		/** signature pointer **/
-	char *bp; /** pointer in the block **/
-	struct typesig sigs[]= {
-		{ "\x89\x50\x4e\x47", 4, 0 }, /** PNG **/
-		{ "\xff\xd8\xff", 3, 0 }, /** JPEG **/
-		{ NULL, -1, -1 } /** End of array **/
-	};
-
-	bp = block;
-	block_len -= 4;
-
-	/** While there's more data in the block and we're not found a match **/
-	while ((block_len > 0)&&(hit==0)) {
-		struct typesig *tsp; /** Type signature pointer **/
-
-		block_len--;
-
-		tsp = sigs; /** tsp points to the first signature in the array **/
-
-		/** While there's more valid signatures in the array **/
-		while (tsp->length > 0) {
-			int cmpresult = 0;
-
-			p = tsp->sequence; /** set p to point to the start of the image signature sequence **/
-			cmpresult = memcmp(bp, p, 3);
-			if (cmpresult == 0) {
-				DUW LOGGER_log("%s:%d:%s:DEBUG: Hit at offset %d for signature %d",FL,__func__,(bp-block),(tsp -sigs));
-				hit = 1;
-				break;
-			} /** If we had a match in the signatures **/
-
-			tsp++; /** go to the next signature **/
-
-		} /** While more signatures **/
+	struct OLEUNWRAP_sig_hit hit;
 
-		if (hit == 0) bp++; /** If we didn't get a hit, move to the next byte in the file **/
+	if (OLEUNWRAP_scan_file_sigs( oleuw, block, block_len, OLEUW_SIG_ESCHER, &hit, 1 ) == 0) return -1;
 
-	} /** while more data in the block **/
-
-	if (hit == 1) {
-		result =  bp -block;
-	} else { 
-		result = -1;
-	}
-
-	return result;
+	return hit.offset;
 }
 
 	/** Look for PNG signature **/
@@ -349,10 +479,12 @@ int OLEUNWRAP_decode_attachment( struct OLEUNWRAP_object *oleuw, char *stream, s
 		
 		if (mfpmm == 100) {
 			int imageoffset = 0;
-			int search_size = 500;
+			size_t search_size = 500;
 
 			DUW LOGGER_log("%s:%d:%s:DEBUG: searcing for image signatures",FL,__func__);
-			if (stream_size < (search_size +68)) search_size = (stream_size -69); /** just make sure we don't over-search the stream **/
+			/** just make sure we don't over-search the stream **/
+			if ((data_start_point < stream)||(data_start_point > stream +stream_size)) search_size = 0;
+			else if (search_size > (size_t)(stream +stream_size -data_start_point)) search_size = stream +stream_size -data_start_point;
 
 			imageoffset = OLEUNWRAP_seach_for_file_sig(oleuw, data_start_point, search_size);
 			if (imageoffset >= 0) {
@@ -430,6 +562,31 @@ int OLEUNWRAP_decode_attachment( struct OLEUNWRAP_object *oleuw, char *stream, s
 	return OLEUW_OK;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name	: OLEUNWRAP_is_decodable_stream
+ Returns Type	: int
+ 	----Parameter List
+	1. char *element_string, stream name
+ 	------------------
+ Exit Codes	: 1 if OLEUNWRAP_decodestream() knows what to do with
+ a stream of this name, else 0
+ Side Effects	:
+--------------------------------------------------------------------
+ Comments:
+ Lets ripOLE skip loading streams which would only be thrown away.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int OLEUNWRAP_is_decodable_stream( char *element_string )
+{
+	if (strstr(element_string, OLEUW_ELEMENT_10NATIVE_STRING) != NULL) return 1;
+	if (strstr(element_string, OLEUW_ELEMENT_DATA) != NULL) return 1;
+
+	return 0;
+}
+
 /*-----------------------------------------------------------------\
  Function Name	: OLEUNWRAP_decodestream
  Returns Type	: int
@@ -3,6 +3,23 @@
 #define OLEUW_ELEMENT_10NATIVE_STRING "Ole10Native"
 #define OLEUW_ELEMENT_DATA "Data"
 
+/** Embedded file signatures known to OLEUNWRAP_scan_file_sigs() **/
+#define OLEUW_SIG_PNG 0
+#define OLEUW_SIG_JPEG 1
+#define OLEUW_SIG_GIF 2
+#define OLEUW_SIG_BMP 3
+#define OLEUW_SIG_PDF 4
+#define OLEUW_SIG_ZIP 5
+#define OLEUW_SIG_RTF 6
+#define OLEUW_SIG_PE 7
+#define OLEUW_SIG_OLE2 8
+#define OLEUW_SIG_COUNT 9
+
+#define OLEUW_SIG_MASK(x) (1 << (x))
+#define OLEUW_SIG_IMAGES (OLEUW_SIG_MASK(OLEUW_SIG_PNG)|OLEUW_SIG_MASK(OLEUW_SIG_JPEG)|OLEUW_SIG_MASK(OLEUW_SIG_GIF)|OLEUW_SIG_MASK(OLEUW_SIG_BMP))
+#define OLEUW_SIG_ESCHER (OLEUW_SIG_MASK(OLEUW_SIG_PNG)|OLEUW_SIG_MASK(OLEUW_SIG_JPEG))
+#define OLEUW_SIG_ALL ((1 << OLEUW_SIG_COUNT) -1)
+
 #define OLEUW_OK 0
 #define OLEUW_STREAM_NOT_DECODED 100
 
@@ -13,6 +30,11 @@ struct OLEUNWRAP_object {
 	int save_unknown_streams;
 };
 
+struct OLEUNWRAP_sig_hit {
+	size_t offset;
+	int sig;
+};
+
 
 int OLEUNWRAP_init( struct OLEUNWRAP_object *oleuw );
 int OLEUNWRAP_set_debug( struct OLEUNWRAP_object *oleuw, int level );
@@ -21,6 +43,10 @@ int OLEUNWRAP_set_save_unknown_streams( struct OLEUNWRAP_object *oleuw, int leve
 
 int OLEUNWRAP_save_stream( struct OLEUNWRAP_object *oleuw, char *fname, RIPMIME_output *unpack_metadata, char *stream, size_t bytes );
 int OLEUNWRAP_decode_attachment( struct OLEUNWRAP_object *oleuw, char *stream, size_t stream_size, RIPMIME_output *unpack_metadata );
+int OLEUNWRAP_scan_file_sigs( struct OLEUNWRAP_object *oleuw, char *block, size_t block_len, int sig_mask, struct OLEUNWRAP_sig_hit *hits, int max_hits );
+int OLEUNWRAP_seach_for_file_sig( struct OLEUNWRAP_object *oleuw, char *block, size_t block_len );
+char *OLEUNWRAP_sig_name( int sig );
+int OLEUNWRAP_is_decodable_stream( char *element_string );
 int OLEUNWRAP_decodestream( struct OLEUNWRAP_object *oleuw, char *element_string, char *stream, size_t stream_size, RIPMIME_output *unpack_metadata );
 
 int OLEUNWRAP_set_filename_report_fn( struct OLEUNWRAP_object *oleuw, int (*ptr_to_fn)(char *) );
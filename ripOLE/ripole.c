@@ -15,6 +15,8 @@ struct ripOLE_object {
 	int debug;
 	int verbose;
 	int save_unknown_streams;
+	char *stream_filter;
+	int threads;
 
 	char *inputfile;
 	char *outputdir;
@@ -25,7 +27,7 @@ struct ripOLE_object {
 
 static char defaultdir[]=".";
 static char version[]="0.2.1 - November 1, 2008 (C) PLDaniels http://www.pldaniels.com/ripole";
-static char help[]="ripOLE -i <OLE2 file> [ -d <directory> ] [--save-unknown-streams] [--version|-V] [--verbose|-v] [--debug] [--help|-h]";
+static char help[]="ripOLE -i <OLE2 file> [ -d <directory> ] [--save-unknown-streams] [--stream-filter <name[,name...]>] [--threads <count>] [--version|-V] [--verbose|-v] [--debug] [--help|-h]";
 
 /*-----------------------------------------------------------------\
   Function Name	: set_defaults
@@ -48,6 +50,8 @@ int ROLE_set_defaults( struct ripOLE_object *role )
 	role->debug = 0;
 	role->verbose = 0;
 	role->save_unknown_streams = 0;
+	role->stream_filter = NULL;
+	role->threads = 1;
 	role->inputfile = NULL;
 
 	return 0;
@@ -116,6 +120,14 @@ int ROLE_parse_parameters( struct ripOLE_object *role, int argc, char **argv )
 					} else if (strncmp (&(argv[i][2]), "save-unknown-streams", 20) == 0) {
 						role->save_unknown_streams = 1;
 
+					} else if ((strncmp (&(argv[i][2]), "stream-filter", 13) == 0)&&(i+1 < argc)) {
+						i++;
+						role->stream_filter = strdup(argv[i]);
+
+					} else if ((strncmp (&(argv[i][2]), "threads", 7) == 0)&&(i+1 < argc)) {
+						i++;
+						role->threads = atoi(argv[i]);
+
 					} else if (strncmp (&(argv[i][2]), "debug", 5) == 0) {
 						role->debug=1;
 
@@ -183,6 +195,16 @@ int ROLE_set_parameters( struct ripOLE_object *role, struct OLE_object *ole )
 		OLE_set_save_unknown_streams(ole, 1);
 	}
 
+	if (role->stream_filter != NULL)
+	{
+		OLE_set_stream_filter(ole, role->stream_filter);
+	}
+
+	if (role->threads > 1)
+	{
+		OLE_set_threads(ole, role->threads);
+	}
+
 	return 0;
 }
 
@@ -231,6 +253,8 @@ int ROLE_init(struct ripOLE_object *role)
 	role->debug = 0;
 	role->verbose = 0;
 	role->save_unknown_streams = 0;
+	role->stream_filter = NULL;
+	role->threads = 1;
 
 	role->inputfile = NULL;
 	role->outputdir = NULL;
@@ -338,6 +362,16 @@ int main( int argc, char **argv )
 
 	o.dir = role.outputdir;
 	o.unpack_mode = RIPMIME_UNPACK_MODE_TO_DIRECTORY;
+	o.rename_method = _MIME_RENAME_METHOD_INFIX;
+	o.unique_names = 1;
+	o.events = NULL;
+	o.sink = NULL;
+	o.digest_md5 = 0;
+	o.size_min = 0;
+	o.size_max = 0;
+	memset(&(o.budget), 0, sizeof(o.budget));
+	o.dedup_store = NULL;
+	all_MIME_elements_init();
 	result = OLE_decode_diskfile( ole, role.inputfile, &o );
 	OLE_decode_done(ole);
 
@@ -17,22 +17,24 @@
 #include <time.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 
 #include "logger.h"
 #include "ffget.h"
 #include "strstack.h"
+#include "mime_element.h"
 #include "mime.h"
-#include "MIME_headers.h"
+#include "mime_headers.h"
 #include "ripmime-api.h"
 
-char defaultdir[] = ".";
+static char defaultdir[] = ".";
 char version[] = "v1.4.0.1 - 30/08/2004 (C) PLDaniels http://www.pldaniels.com/ripmime";
 
 /*-----------------------------------------------------------------\
  Function Name  : RIPMIME_init
  Returns Type   : int
     ----Parameter List
-    1. struct RIPMIME_globals *glb,
+    1. struct RIPMIME_object *rm,
     ------------------
  Exit Codes :
  Side Effects   :
@@ -43,26 +45,164 @@ char version[] = "v1.4.0.1 - 30/08/2004 (C) PLDaniels http://www.pldaniels.com/r
  Changes:
 
 \------------------------------------------------------------------*/
-void RIPMIME_init (struct RIPMIME_object *rm)
+int RIPMIME_init (struct RIPMIME_object *rm)
 {
     rm->outputdir = defaultdir;
     rm->mailpack = NULL;
 
+    rm->output.dir = rm->outputdir;
+    rm->output.unpack_mode = RIPMIME_UNPACK_MODE_TO_DIRECTORY;
+    rm->output.rename_method = _MIME_RENAME_METHOD_INFIX;
+    rm->output.unique_names = 1;
+    rm->output.events = NULL;
+    rm->output.sink = NULL;
+    rm->output.digest_md5 = 0;
+    rm->output.size_min = 0;
+    rm->output.size_max = 0;
+    memset(&(rm->output.budget), 0, sizeof(rm->output.budget));
+    rm->output.dedup_store = NULL;
+
+    rm->feed_fd = -1;
+    rm->parse_f = NULL;
+    rm->parse_result = 0;
+
     LOGGER_set_output_mode(_LOGGER_STDOUT);
     MIME_init();
-    MIME_set_uniquenames(1);
     MIME_set_paranoid(0);
-    MIME_set_renamemethod(_MIME_RENAME_METHOD_INFIX);
     MIME_set_verbosity(0);
+
+    return 0;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_set_events
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    2.  struct mime_events *events, part event handlers, or NULL
+    ------------------
+ Exit Codes :
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+ The handlers are called from the parser thread when the push
+ parser is in use, never from the thread calling RIPMIME_feed().
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int RIPMIME_set_events( struct RIPMIME_object *rm, struct mime_events *events )
+{
+    rm->output.events = events;
+    return 0;
+}
 
 /*-----------------------------------------------------------------\
- Function Name  : main
+ Function Name  : RIPMIME_set_sink
  Returns Type   : int
     ----Parameter List
-    1. int argc,
-    2.  char **argv,
+    1. struct RIPMIME_object *rm,
+    2.  const struct mime_sink *sink, where decoded parts go, or NULL
+    ------------------
+ Exit Codes :
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+ Either one of the built-in MIME_sink_* sinks or the embedder's own.
+ NULL restores the default, a file per part in the output directory.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int RIPMIME_set_sink( struct RIPMIME_object *rm, const struct mime_sink *sink )
+{
+    rm->output.sink = sink;
+    return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_set_budget
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    2.  const struct mime_budget *budget, limits for each message, or NULL
+    ------------------
+ Exit Codes :
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+ A message which goes over any of the limits is abandoned and its
+ decode returns MIME_ERROR_BUDGET_EXCEEDED.  NULL lifts them all.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int RIPMIME_set_budget( struct RIPMIME_object *rm, const struct mime_budget *budget )
+{
+    if (budget) rm->output.budget = *budget;
+    else memset(&(rm->output.budget), 0, sizeof(rm->output.budget));
+    return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_prepare_outputdir
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    ------------------
+ Exit Codes : 0 on success, -1 if the directory cannot be created
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+static int RIPMIME_prepare_outputdir( struct RIPMIME_object *rm )
+{
+    int result = 0;
+
+    // clean up the output directory name if required (remove any trailing /'s, as suggested by James Cownie 03/02/2001
+
+    if ((rm->outputdir != defaultdir)&&(strlen(rm->outputdir) > 1)&&(rm->outputdir[strlen (rm->outputdir) - 1] == '/'))
+    {
+        rm->outputdir[strlen (rm->outputdir) - 1] = '\0';
+    }
+
+    // Create the output directory required as specified by the -d parameter
+
+    if (rm->outputdir != defaultdir)
+    {
+        result = mkdir (rm->outputdir, S_IRWXU);
+
+        // if we had a problem creating a directory, and it wasn't just
+        // due to the directory already existing, then we have a bit of
+        // a problem on our hands, hence, report it.
+        //
+
+        if ((result == -1) && (errno != EEXIST))
+        {
+            LOGGER_log("%s:%d:%s:ERROR: Cannot create directory '%s' (%s)", FL, __func__, rm->outputdir, strerror (errno));
+            return -1;
+        }
+    }
+
+    rm->output.dir = rm->outputdir;
+
+    return 0;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_decode
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    2.  char *mailpack,
+    3.  char *outputdir,
     ------------------
  Exit Codes :
  Side Effects   :
@@ -98,42 +238,162 @@ int RIPMIME_decode( struct RIPMIME_object *rm, char *mailpack, char *outputdir )
 
     srand (time (NULL));
 
-    // clean up the output directory name if required (remove any trailing /'s, as suggested by James Cownie 03/02/2001
+    if (RIPMIME_prepare_outputdir(rm) != 0) return -1;
 
-    if (rm->outputdir[strlen (rm->outputdir) - 1] == '/')
-    {
-        rm->outputdir[strlen (rm->outputdir) - 1] = '\0';
-    }
+    // Unpack the contents
 
-    // Create the output directory required as specified by the -d parameter
+    result = MIME_unpack (&(rm->output), rm->mailpack, 0);
 
-    if (rm->outputdir != defaultdir)
+    // do any last minute things
+
+    MIME_close (&(rm->output));
+
+    return result;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_feed_parser
+ Returns Type   : void *
+    ----Parameter List
+    1. void *arg, the struct RIPMIME_object being fed
+    ------------------
+ Exit Codes :
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+ Body of the parser thread.  The MIME decoder blocks on the pipe
+ whenever it has consumed everything fed so far, so header parsing,
+ boundary tracking and part decoding all run while the rest of the
+ message is still being received.
+
+ Once the decoder is done we keep reading until the feeding side
+ closes the pipe, else a mailpack with trailing junk would leave
+ RIPMIME_feed() blocked on a full pipe.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+static void *RIPMIME_feed_parser( void *arg )
+{
+    struct RIPMIME_object *rm = arg;
+    char drain[4096];
+
+    rm->parse_result = MIME_unpack_stream(&(rm->output), rm->parse_f, 0);
+    while (fread(drain, 1, sizeof(drain), rm->parse_f) > 0);
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_feed
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    2.  const char *buf, next chunk of the message
+    3.  size_t len, length of the chunk
+    ------------------
+ Exit Codes : 0 on success, -1 on failure
+ Side Effects   : starts the parser thread on the first call
+--------------------------------------------------------------------
+ Comments:
+ Incremental (push) interface for callers which receive the
+ mailpack piecemeal, such as an MTA during the SMTP DATA phase.
+ Chunks may be of any size and may split lines or boundaries.
+
+ The MIME module keeps its state in globals, so only one message
+ may be fed at a time per process, and RIPMIME_finish() must be
+ called before the next one is started.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int RIPMIME_feed( struct RIPMIME_object *rm, const char *buf, size_t len )
+{
+    if (rm->feed_fd == -1)
     {
-        result = mkdir (rm->outputdir, S_IRWXU);
+        int fds[2];
 
-        // if we had a problem creating a directory, and it wasn't just
-        // due to the directory already existing, then we have a bit of
-        // a problem on our hands, hence, report it.
-        //
+        if (RIPMIME_prepare_outputdir(rm) != 0) return -1;
 
-        if ((result == -1) && (errno != EEXIST))
+        if (pipe(fds) == -1)
         {
-            fprintf (stderr, "ripMIME: Cannot create directory '%s' (%s)\n",
-                    rm->outputdir, strerror (errno));
+            LOGGER_log("%s:%d:%s:ERROR: Cannot create parser pipe (%s)", FL, __func__, strerror(errno));
             return -1;
         }
-    }
 
-    // Unpack the contents
+        rm->parse_f = fdopen(fds[0], "r");
+        if (rm->parse_f == NULL)
+        {
+            LOGGER_log("%s:%d:%s:ERROR: Cannot open parser stream (%s)", FL, __func__, strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
 
-    MIMEH_set_outputdir(rm->outputdir);
-    MIME_unpack (rm->outputdir, rm->mailpack, 0);
+        rm->feed_fd = fds[1];
+        rm->parse_result = 0;
+        if (pthread_create(&(rm->parser), NULL, RIPMIME_feed_parser, rm) != 0)
+        {
+            LOGGER_log("%s:%d:%s:ERROR: Cannot start parser thread", FL, __func__);
+            fclose(rm->parse_f);
+            close(rm->feed_fd);
+            rm->parse_f = NULL;
+            rm->feed_fd = -1;
+            return -1;
+        }
+    }
 
-    // do any last minute things
+    while (len > 0)
+    {
+        ssize_t written = write(rm->feed_fd, buf, len);
 
-    MIME_close ();
+        if (written == -1)
+        {
+            if (errno == EINTR) continue;
+            LOGGER_log("%s:%d:%s:ERROR: Cannot pass data to the parser (%s)", FL, __func__, strerror(errno));
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
 
     return 0;
 }
 
+/*-----------------------------------------------------------------\
+ Function Name  : RIPMIME_finish
+ Returns Type   : int
+    ----Parameter List
+    1. struct RIPMIME_object *rm,
+    ------------------
+ Exit Codes : the MIME_unpack status of the fed message
+ Side Effects   :
+--------------------------------------------------------------------
+ Comments:
+ Signals end-of-message, waits for the decoder to drain what is
+ left and closes off the output.  All part_end events have been
+ delivered by the time this returns.
+
+--------------------------------------------------------------------
+ Changes:
+
+\------------------------------------------------------------------*/
+int RIPMIME_finish( struct RIPMIME_object *rm )
+{
+    if (rm->feed_fd == -1) return 0;
+
+    close(rm->feed_fd);
+    rm->feed_fd = -1;
+
+    pthread_join(rm->parser, NULL);
+    fclose(rm->parse_f);
+    rm->parse_f = NULL;
+
+    MIME_close (&(rm->output));
+
+    return rm->parse_result;
+}
+
 /*-END-----------------------------------------------------------*/
@@ -1,10 +1,32 @@
 
+#ifndef RIPMIME_API
+#define RIPMIME_API
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "mime_element.h"
+
 struct RIPMIME_object
 {
 	char *mailpack;
 	char *outputdir;
+	RIPMIME_output output;
+
+	/* Push parser state, see RIPMIME_feed() */
+	int feed_fd;		// write end of the parser pipe, -1 when no parse is running
+	FILE *parse_f;		// read end, consumed by the parser thread
+	pthread_t parser;
+	int parse_result;
 };
 
 int RIPMIME_init( struct RIPMIME_object *rm );
 int RIPMIME_decode( struct RIPMIME_object *rm, char *mailpack, char *outputdir );
 
+int RIPMIME_set_events( struct RIPMIME_object *rm, struct mime_events *events );
+int RIPMIME_set_sink( struct RIPMIME_object *rm, const struct mime_sink *sink );
+int RIPMIME_set_budget( struct RIPMIME_object *rm, const struct mime_budget *budget );
+int RIPMIME_feed( struct RIPMIME_object *rm, const char *buf, size_t len );
+int RIPMIME_finish( struct RIPMIME_object *rm );
+
+#endif
@@ -37,6 +37,8 @@
 struct RIPMIME_globals
 {
    char *input_path;
+   char *archive;      // --tar/--cpio output, NULL for none
+   int archive_format;
    RIPMIME_output *output;
    int use_return_codes;
    int timeout;
@@ -55,7 +57,7 @@ char help[] = "ripMIME -i <mime file> -d <directory>"
    "[-p prefix] [-e [header file]] [-vVh] [--version]"
    "[--no_nameless] [--unique_names [--prefix|--postfix|--infix|--randprefix|--randpostfix|--randinfix]]"
    "[--paranoid] [--mailbox] [--formdata] [--debug]"
-   "[--no-quotedprintable] [--no-uudecode]\n"
+   "[--no-quotedprintable] [--no-uudecode] [--no-yenc]\n"
    "Options available :\n"
    "-i : Input MIME encoded file (use '-' to input from STDIN)\n"
    "\tIf <mime file> is a directory, it will be recursed\n"
@@ -65,7 +67,33 @@ char help[] = "ripMIME -i <mime file> -d <directory>"
    "-v : Turn on verbosity\n"
    "-q : Run quietly, do no report non-fatal errors\n"
    "-l : list included mime fragments metadata to STDOUT delimited by '|' sign. Contains :\n"
-   "     internal id, attachment count, file count, recursion level, mime content type, file name\n"
+   "     internal id, attachment count, file count, recursion level, mime content type, file name,\n"
+   "     encoded size, estimated decoded size.  Parts are not decoded, so their contents\n"
+   "     (TNEF, OLE, uuencoded files) are not listed\n"
+   "--digest-only : write no files, list the SHA-256 of every part (including TNEF, OLE and\n"
+   "     uuencoded contents) to STDOUT as : internal id|sha256|size|mime content type|file name\n"
+   "--digest-md5 : with --digest-only, append the MD5 of each part as a sixth field\n"
+   "--tar <file> : write every part to one POSIX tar archive instead of a file each ('-' for STDOUT),\n"
+   "     ending with a '_manifest_' member listing : internal id|name|size|mime content type|parent id\n"
+   "--cpio <file> : as --tar, but as a cpio (newc) archive\n"
+   "--dedup-store <dir> : keep each base64, quoted-printable or text part in <dir> keyed by the\n"
+   "     SHA-256 of its encoded form, and hardlink repeats from there instead of decoding them again\n"
+   "\n"
+   "--include-type <globs> : only decode parts whose content-type matches, eg 'image/*,application/pdf'\n"
+   "--exclude-type <globs> : skip parts whose content-type matches\n"
+   "--include-ext <list> : only decode parts whose file name has one of the extensions, eg 'pdf,doc'\n"
+   "--exclude-ext <list> : skip parts whose file name has one of the extensions\n"
+   "--disposition <list> : only decode parts with these dispositions, any of 'inline,attachment,formdata,none'\n"
+   "--min-size <bytes> : discard parts which decode to fewer bytes\n"
+   "--max-size <bytes> : discard parts which decode to more bytes\n"
+   "--budget-parts <n> : abandon the message after <n> parts\n"
+   "--budget-part-bytes <bytes> : abandon the message if any part decodes to more bytes\n"
+   "--budget-total-bytes <bytes> : abandon the message after decoding this many bytes in all\n"
+   "--budget-files <n> : abandon the message rather than create more than <n> files\n"
+   "--budget-memory <bytes> : abandon the message if parts held in memory grow past this\n"
+   "--budget-header-bytes <bytes> : abandon the message if a header block is larger\n"
+   "     Skipped parts are read over without being decoded.  The size limits apply to the\n"
+   "     decoded data, sized from the encoded part before decoding where the encoding allows\n"
    "\n"
    "--verbose-contenttype : Turn on verbosity of file content type\n"
    "--verbose-oldstyle : Uses the v1.2.x style or filename reporting\n"
@@ -89,10 +117,14 @@ char help[] = "ripMIME -i <mime file> -d <directory>"
    "--randinfix : rename by putting unique code and random number in the middle of the filename\n"
    "\n"
    "--mailbox : Process mailbox file\n"
+   "--tmp-in-memory : keep the files only made to be read back (mailbox messages, double-CR\n"
+   "     sections) in memory rather than in the output directory\n"
+   "--tmpdir <dir> : where --tmp-in-memory puts them if the kernel has no memfd support\n"
    "--formdata : Process as form data (from HTML form etc).  Inhibits conversion of NUL/zero-bytes to spaces\n"
    "\n"
    "--no-ole : Turn off OLE decoding\n"
    "--no-uudecode : Turns off the facility of detecting UUencoded attachments in emails\n"
+   "--no-yenc : Turns off the facility of detecting yEnc encoded attachments in emails\n"
    "--no-quotedprintable : Turns off the facility of decoding QuotedPrintable data\n"
    "--no-doublecr : Turns off saving of double-CR embedded data\n"
    "--no-mht : Turns off MHT (a Microsoft mailpack attachment format ) decoding\n"
@@ -382,6 +414,214 @@ int RIPMIME_parse_parameters (struct RIPMIME_globals *glb, int argc, char **argv
                        {
                            MIME_set_no_nameless (1);
                        }
+                       else if (strncmp (&(argv[i][2]), "digest-only", 11) == 0)
+                       {
+                           glb->output->unpack_mode = RIPMIME_UNPACK_MODE_DIGEST;
+                       }
+                       else if (strncmp (&(argv[i][2]), "digest-md5", 10) == 0)
+                       {
+                           glb->output->digest_md5 = 1;
+                       }
+                       else if (strncmp (&(argv[i][2]), "tar", 3) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->unpack_mode = RIPMIME_UNPACK_MODE_ARCHIVE;
+                               glb->archive = argv[i];
+                               glb->archive_format = MIME_ARCHIVE_TAR;
+                               // Keep stdout clean for the archive
+                               if (strcmp (glb->archive, "-") == 0) LOGGER_set_output_mode (_LOGGER_STDERR);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--tar'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "cpio", 4) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->unpack_mode = RIPMIME_UNPACK_MODE_ARCHIVE;
+                               glb->archive = argv[i];
+                               glb->archive_format = MIME_ARCHIVE_CPIO;
+                               // Keep stdout clean for the archive
+                               if (strcmp (glb->archive, "-") == 0) LOGGER_set_output_mode (_LOGGER_STDERR);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--cpio'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "dedup-store", 11) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->dedup_store = argv[i];
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--dedup-store'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "include-type", 12) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_include_types (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--include-type'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "exclude-type", 12) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_exclude_types (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--exclude-type'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "include-ext", 11) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_include_extensions (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--include-ext'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "exclude-ext", 11) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_exclude_extensions (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--exclude-ext'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "disposition", 11) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_include_dispositions (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--disposition'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "min-size", 8) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->size_min = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--min-size'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "max-size", 8) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->size_max = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--max-size'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-part-bytes", 17) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.part_bytes = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-part-bytes'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-parts", 12) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.parts = atoi (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-parts'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-total-bytes", 18) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.total_bytes = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-total-bytes'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-files", 12) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.files = atoi (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-files'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-memory", 13) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.memory_bytes = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-memory'\n");
+                           }
+                       }
+                       else if (strncmp (&(argv[i][2]), "budget-header-bytes", 19) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               glb->output->budget.header_bytes = strtoul (argv[i], NULL, 10);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--budget-header-bytes'\n");
+                           }
+                       }
                        else if (strncmp (&(argv[i][2]), "debug", 5) == 0)
                        {
                            MIME_set_debug (1);
@@ -390,6 +630,22 @@ int RIPMIME_parse_parameters (struct RIPMIME_globals *glb, int argc, char **argv
                        {
                            MIME_set_mailboxformat (1);
                        }
+                       else if (strncmp (&(argv[i][2]), "tmp-in-memory", 13) == 0)
+                       {
+                           MIME_set_intermediates_in_memory (1);
+                       }
+                       else if (strncmp (&(argv[i][2]), "tmpdir", 6) == 0)
+                       {
+                           i++;
+                           if (i < argc)
+                           {
+                               MIME_set_tmpdir (argv[i]);
+                           }
+                           else
+                           {
+                               LOGGER_log("ERROR: insufficient parameters after '--tmpdir'\n");
+                           }
+                       }
                        else if (strncmp(&(argv[i][2]), "formdata", 8) == 0)
                        {
                            // Form data usually contains embedded \0 sequences
@@ -409,6 +665,10 @@ int RIPMIME_parse_parameters (struct RIPMIME_globals *glb, int argc, char **argv
                        {
                            MIME_set_decode_uudecode(0);
                        }
+                       else if (strncmp (&(argv[i][2]), "no-yenc", 7) == 0)
+                       {
+                           MIME_set_decode_yenc(0);
+                       }
                        else if (strncmp (&(argv[i][2]), "no-ole", 6) == 0)
                        {
                            MIME_set_decode_ole(0);
@@ -533,7 +793,16 @@ int RIPMIME_init (struct RIPMIME_globals *glb, RIPMIME_output *o)
    glb->output->unpack_mode = RIPMIME_UNPACK_MODE_TO_DIRECTORY;
    glb->output->rename_method = _MIME_RENAME_METHOD_INFIX;
    glb->output->unique_names = 1;
+   glb->output->events = NULL;
+   glb->output->sink = NULL;
+   glb->output->digest_md5 = 0;
+   glb->output->size_min = 0;
+   glb->output->size_max = 0;
+   memset (&(glb->output->budget), 0, sizeof (glb->output->budget));
+   glb->output->dedup_store = NULL;
    glb->input_path = NULL;
+   glb->archive = NULL;
+   glb->archive_format = MIME_ARCHIVE_TAR;
    glb->use_return_codes = 0;
    glb->timeout = 0;
    glb->quiet = 0;
@@ -760,12 +1029,20 @@ int main (int argc, char **argv)
        }
    }
 
+   if ((glb.archive)&&(MIME_archive_open (glb.archive, glb.archive_format) != 0))
+   {
+       return RIPMIME_ERROR_CANT_CREATE_OUTPUT_DIR;
+   }
+
    // Unpack the contents
    result = RIPMIME_unpack(&glb);
 
+   if (glb.archive) MIME_archive_close ();
+
    // Possible exit codes include;
    //      0 - all okay
    //      240 - processing stopped due to recursion limit
+   //      243 - processing stopped as a budget was exceeded
    if (glb.use_return_codes == 0) result = 0;
    return result;
 }
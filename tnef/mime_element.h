@@ -0,0 +1 @@
+../mime_element.h
\ No newline at end of file
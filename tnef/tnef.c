@@ -40,14 +40,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
 #include "logger.h"
 
 #include "config.h"
 #include "tnef.h"
 #include "mapidefs.h"
 #include "mapitags.h"
+#include "mime_element.h"
 #include "tnef_api.h"
 
 #define VERSION "pldtnef/0.0.2"
@@ -59,9 +62,6 @@
 #define TNEF_VERBOSE ((TNEF_glb.verbose > 0))
 #define TNEF_DEBUG ((TNEF_glb.debug > 0))
 
-/** 20041207-1246:PLD: Added RT32 macro to allow for large numbers of read-tests **/
-#define RT32( num_addr, offset ) if (read_32(num_addr, offset)==-1) return -1
-
 struct TNEF_globals {
 	int file_num;
 	int verbose;
@@ -70,9 +70,6 @@ struct TNEF_globals {
 
 	int TNEF_Verbose;
 
-	uint8 *tnef_home;
-	uint8 *tnef_limit;
-
 	int (*filename_decoded_report)(char *, char *);	// Pointer to our filename reporting function
 };
 
@@ -173,30 +170,125 @@ int TNEF_set_debug( int level )
 	return TNEF_glb.debug;
 }
 
-/* Some systems don't like to read unaligned data */
+/** Name given to the decompressed PR_RTF_COMPRESSED message body **/
+#define TNEF_RTF_BODY_NAME "body.rtf"
+
+/** Attachment data is copied to its output this many bytes at a time **/
+#define TNEF_CHUNK_SIZE 65536
+
+/** Where the TNEF stream is read from; only one of f and data is set **/
+struct TNEF_reader {
+	FILE *f;
+	const uint8 *data;
+	size_t size;		// bytes in the stream, 0 if not known (pipes)
+	size_t pos;		// offset of the next byte to be read
+	uint8 *chunk;		// TNEF_CHUNK_SIZE bytes, only needed with f
+};
+
+/** Per stream decoder state, what used to be statics in read_attribute() **/
+struct TNEF_parser {
+	struct TNEF_reader *r;
+	RIPMIME_output *unpack_metadata;
+	char attach_title[256];
+	uint32 attach_size;
+	size_t attach_loc;	// stream offset of the last attAttachData seen
+};
+
 /*------------------------------------------------------------------------
-Procedure:     read_32 ID:1
-Purpose:
+Procedure:     TNEF_read ID:1
+Purpose:       Reads the next len bytes of the stream into buf
 Input:
-Output:
+Output:        0 on success, -1 if the stream ends first
 Errors:
 ------------------------------------------------------------------------*/
-int read_32( uint32 *value, uint8 *tsp)
+static int TNEF_read( struct TNEF_reader *r, void *buf, size_t len )
 {
-	uint8 a,b,c,d;
-
-	if ((tsp +4) > TNEF_glb.tnef_limit)
+	if (r->f == NULL)
 	{
-		if ((TNEF_VERBOSE)||(TNEF_DEBUG)) LOGGER_log("%s:%d:%s:ERROR: Attempting to read beyond end of memory block",FL,__func__);
+		if (len > r->size -r->pos)
+		{
+			if ((TNEF_VERBOSE)||(TNEF_DEBUG)) LOGGER_log("%s:%d:%s:ERROR: Attempting to read beyond end of memory block",FL,__func__);
+			return -1;
+		}
+		memcpy(buf, r->data +r->pos, len);
+	} else if (fread(buf, 1, len, r->f) != len)
+	{
+		if ((TNEF_VERBOSE)||(TNEF_DEBUG)) LOGGER_log("%s:%d:%s:ERROR: Attempting to read past end of stream",FL,__func__);
 		return -1;
 	}
 
-	a = *tsp;
-	b = *(tsp+1);
-	c = *(tsp+2);
-	d = *(tsp+3);
+	r->pos += len;
 
-	*value =  long_little_endian(a<<24 | b<<16 | c<<8 | d);
+	return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     TNEF_skip ID:1
+Purpose:       Moves the stream on by len bytes without keeping them
+Input:
+Output:        0 on success, -1 if the stream ends first
+Errors:
+------------------------------------------------------------------------*/
+static int TNEF_skip( struct TNEF_reader *r, size_t len )
+{
+	if (r->f == NULL)
+	{
+		if (len > r->size -r->pos) return -1;
+		r->pos += len;
+		return 0;
+	}
+
+	if ((r->size > 0)&&(len <= LONG_MAX)&&(fseek(r->f, (long)len, SEEK_CUR) == 0))
+	{
+		if (r->pos +len > r->size) return -1;
+		r->pos += len;
+		return 0;
+	}
+
+	while (len > 0)
+	{
+		size_t take = (len > TNEF_CHUNK_SIZE) ? TNEF_CHUNK_SIZE : len;
+
+		if (TNEF_read(r, r->chunk, take) != 0) return -1;
+		len -= take;
+	}
+
+	return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     TNEF_seek ID:1
+Purpose:       Repositions the stream at an offset already passed
+Input:
+Output:        0 on success, -1 if the stream cannot go back
+Errors:
+------------------------------------------------------------------------*/
+static int TNEF_seek( struct TNEF_reader *r, size_t pos )
+{
+	if (r->f != NULL)
+	{
+		if ((r->size == 0)||(pos > LONG_MAX)||(fseek(r->f, (long)pos, SEEK_SET) != 0)) return -1;
+	} else if (pos > r->size) return -1;
+
+	r->pos = pos;
+
+	return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     read_32 ID:1
+Purpose:
+Input:
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int read_32( uint32 *value, struct TNEF_reader *r )
+{
+	uint8 b[4];
+
+	if (TNEF_read(r, b, sizeof(b)) == -1) return -1;
+
+	*value =  long_little_endian((uint32)b[0]<<24 | b[1]<<16 | b[2]<<8 | b[3]);
 
 	return 0;
 }
@@ -208,460 +300,646 @@ Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-int read_16( uint16 *value, uint8 *tsp)
+int read_16( uint16 *value, struct TNEF_reader *r )
+{
+	uint8 b[2];
+
+	if (TNEF_read(r, b, sizeof(b)) == -1) return -1;
+
+	*value = little_endian(b[0]<<8 | b[1]);
+
+	return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     save_attach_data ID:1
+Purpose:       Copies the next size bytes of the stream out as 'title'
+Input:
+Output:        0 on success, -1 if the stream or the output failed
+Errors:
+------------------------------------------------------------------------*/
+int save_attach_data(char *title, struct TNEF_reader *r, uint32 size, RIPMIME_output *unpack_metadata)
 {
-	uint8 a,b;
+	MIME_element *cur_mime;
+	int result = 0;
 
-	if (
-			((tsp +2) > TNEF_glb.tnef_limit)
-//PLD-20070707-17H20, how do we even compare tsp to a negative!?		||(tsp == -1)
-			)
+	if (!MIME_output_size_wanted(unpack_metadata, size))
 	{
-		if ((TNEF_VERBOSE)||(TNEF_DEBUG)) LOGGER_log("%s:%d:%s:ERROR: Attempting to read past end\n",FL,__func__);
-		return -1;
+		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: '%s' is outside the size limits, passing over it\n",FL,__func__,title);
+		return TNEF_skip(r, size);
 	}
 
-	//	if (TNEF_DEBUG) fprintf(stderr,"Read_16: Offset read %d\n", tsp -tnef_home);
+	cur_mime = MIME_element_add (NULL, unpack_metadata, title, "TNEF", "TNEF", "TNEF", 0, 1, 0, __func__);
+	if (!cur_mime->opened) return -1;
 
-	a = *tsp;
-	b = *(tsp + 1);
+	if (r->f == NULL)
+	{
+		// Straight out of the caller's buffer or mapping
+		if (size > r->size -r->pos) result = -1;
+		else if (MIME_element_write(cur_mime, r->data +r->pos, size) != 0) result = -1;
+		else r->pos += size;
 
-	*value = little_endian(a<<8 | b);
+	} else {
+		while ((size > 0)&&(result == 0))
+		{
+			size_t take = (size > TNEF_CHUNK_SIZE) ? TNEF_CHUNK_SIZE : size;
 
-	return 0;
+			if (TNEF_read(r, r->chunk, take) != 0) result = -1;
+			else if (MIME_element_write(cur_mime, r->chunk, take) != 0) result = -1;
+			size -= take;
+		}
+	}
+	MIME_element_deactivate(cur_mime, unpack_metadata);
+
+	return result;
 }
 
 /*------------------------------------------------------------------------
-Procedure:     make_string ID:1
-Purpose:
+Procedure:     save_attachment ID:1
+Purpose:       Saves the attachment whose data starts at p->attach_loc
 Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-char *make_string(uint8 *tsp, int size)
+static void save_attachment( struct TNEF_parser *p )
 {
-	static char s[256] = "";
+	if (!save_attach_data(p->attach_title, p->r, p->attach_size, p->unpack_metadata))
+	{
+		if (TNEF_VERBOSE) {
+			if (TNEF_glb.filename_decoded_report == NULL)
+			{
+				LOGGER_log("Decoding: %s\n", p->attach_title);
+			} else {
+				TNEF_glb.filename_decoded_report( p->attach_title, (TNEF_glb.verbosity_contenttype>0?"tnef":NULL));
+			}
 
-	snprintf(s,sizeof(s),"%s",tsp);
-	return s;
+		}
+	}
+	else
+	{
+		LOGGER_log("%s:%d:%s:ERROR: While saving attachment '%s'\n", FL,__func__, p->attach_title);
+	}
 }
 
 /*------------------------------------------------------------------------
-Procedure:     save_attach_data ID:1
-Purpose:
+Procedure:     TNEF_fetch ID:1
+Purpose:       Hands back a pointer to up to len of the next stream bytes
+Input:
+Output:        The number of bytes at *ptr, 0 at the end of the stream
+Errors:
+------------------------------------------------------------------------*/
+static size_t TNEF_fetch( struct TNEF_reader *r, size_t len, const uint8 **ptr )
+{
+	if (r->f == NULL)
+	{
+		if (len > r->size -r->pos) len = r->size -r->pos;
+		*ptr = r->data +r->pos;
+	} else {
+		if (len > TNEF_CHUNK_SIZE) len = TNEF_CHUNK_SIZE;
+		len = fread(r->chunk, 1, len, r->f);
+		*ptr = r->chunk;
+	}
+	r->pos += len;
+
+	return len;
+}
+
+/** Compressed RTF (MS-OXRTFCP) header fields and constants **/
+#define LZFU_HEADER_SIZE 16
+#define LZFU_COMPRESSED 0x75465a4c	/* "LZFu" */
+#define LZFU_UNCOMPRESSED 0x414c454d	/* "MELA" */
+#define LZFU_DICT_SIZE 4096
+
+/** The dictionary starts out holding this, writing carries on after it **/
+static const char LZFU_prebuf[] = "{\\rtf1\\ansi\\mac\\deff0\\deftab720{\\fonttbl;}"
+	"{\\f0\\fnil \\froman \\fswiss \\fmodern \\fscript \\fdecor MS Sans SerifSymbolArialTimes New RomanCourier"
+	"{\\colortbl\\red0\\green0\\blue0\r\n\\par \\pard\\plain\\f0\\fs20\\b\\i\\u\\tab\\tx";
+
+static uint32 LZFU_crc_table[256];
+static int LZFU_crc_table_ready = 0;
+
+/** Decompressor state, kept between input chunks **/
+struct LZFU_state {
+	uint8 dict[LZFU_DICT_SIZE];
+	unsigned int write_pos;
+	unsigned int flags;	// current control byte
+	int bit;		// its next bit, 8 when the next byte is a control byte
+	int have_high;		// first byte of a reference already seen
+	uint8 high;
+	int done;		// end reference reached
+	uint32 crc;
+	uint32 raw_left;	// bytes of RTF still expected
+	MIME_element *cur;
+	uint8 out[4096];
+	size_t out_l;
+};
+
+/*------------------------------------------------------------------------
+Procedure:     LZFU_crc ID:1
+Purpose:       Carries the compressed RTF CRC over another block
+Input:
+Output:
+Errors:        This is the usual reflected CRC-32 table, but MS-OXRTFCP
+               starts it at 0 and does not invert the result.
+------------------------------------------------------------------------*/
+static uint32 LZFU_crc( uint32 crc, const uint8 *p, size_t len )
+{
+	if (!LZFU_crc_table_ready)
+	{
+		uint32 i, c;
+		int k;
+
+		for (i = 0; i < 256; i++)
+		{
+			for (c = i, k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320UL ^ (c >> 1)) : (c >> 1);
+			LZFU_crc_table[i] = c;
+		}
+		LZFU_crc_table_ready = 1;
+	}
+
+	while (len--) crc = LZFU_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     LZFU_flush ID:1
+Purpose:       Writes out the decompressed bytes gathered so far
+Input:
+Output:
+Errors:
+------------------------------------------------------------------------*/
+static int LZFU_flush( struct LZFU_state *z )
+{
+	int result = 0;
+
+	if (z->out_l > 0) result = MIME_element_write(z->cur, z->out, z->out_l);
+	z->out_l = 0;
+
+	return result;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     LZFU_emit ID:1
+Purpose:       Appends one byte to both the output and the dictionary
 Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-int save_attach_data(char *title, uint8 *tsp, uint32 size, char * file_dir)
+static int LZFU_emit( struct LZFU_state *z, uint8 c )
+{
+	z->dict[z->write_pos] = c;
+	z->write_pos = (z->write_pos +1) & (LZFU_DICT_SIZE -1);
+
+	if (z->raw_left == 0) return 0;
+	z->raw_left--;
+	z->out[z->out_l++] = c;
+	if (z->out_l == sizeof(z->out)) return LZFU_flush(z);
+
+	return 0;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     LZFU_decompress ID:1
+Purpose:       Runs the next block of compressed input through z
+Input:
+Output:        0 on success, -1 if the output could not be written
+Errors:
+------------------------------------------------------------------------*/
+static int LZFU_decompress( struct LZFU_state *z, const uint8 *p, size_t len )
 {
-	FILE *out;
-	char * fn;
-	int fn_l = strlen(file_dir) + strlen(title) + sizeof(char) * 2;
-
-	fn = malloc(fn_l);
-	snprintf(fn,fn_l,"%s/%s",file_dir,title);        
-	out = fopen(fn, "w");
-	if (!out)
+	z->crc = LZFU_crc(z->crc, p, len);
+
+	while ((len > 0)&&(!z->done))
 	{
-		LOGGER_log("%s:%d:%s:ERROR: Failed opening file %s for writing (%s)\n", FL,__func__, fn, strerror(errno));
-		free(fn);
-		return -1;
+		uint8 b = *p++;
+
+		len--;
+		if (z->bit == 8)
+		{
+			// Each control byte's bits, low first, say whether the next
+			//		eight items are literals (0) or references (1)
+			z->flags = b;
+			z->bit = 0;
+
+		} else if ((z->flags & (1 << z->bit)) == 0)
+		{
+			if (LZFU_emit(z, b) != 0) return -1;
+			z->bit++;
+
+		} else if (!z->have_high)
+		{
+			z->high = b;
+			z->have_high = 1;
+
+		} else {
+			// 12 bit dictionary offset, 4 bit length less 2
+			unsigned int offset = ((unsigned int)z->high << 4) | (b >> 4);
+			unsigned int length = (b & 0x0F) +2;
+			unsigned int i;
+
+			z->have_high = 0;
+			z->bit++;
+
+			if (offset == z->write_pos)
+			{
+				z->done = 1;
+				break;
+			}
+
+			// Byte by byte, as the copy may run into what it writes
+			for (i = 0; i < length; i++)
+			{
+				if (LZFU_emit(z, z->dict[(offset +i) & (LZFU_DICT_SIZE -1)]) != 0) return -1;
+			}
+		}
 	}
 
-	free(fn);
-	fwrite(tsp, sizeof(uint8), size, out);
-	fclose(out);
 	return 0;
 }
 
+/*------------------------------------------------------------------------
+Procedure:     save_rtf_body ID:1
+Purpose:       Decompresses a PR_RTF_COMPRESSED value of num bytes into
+               body.rtf, falling back to saving it raw as XAM_n.rtf
+Input:
+Output:        0 with the stream just past the value, -1 if it failed
+Errors:
+------------------------------------------------------------------------*/
+static int save_rtf_body( struct TNEF_parser *p, uint32 num )
+{
+	struct TNEF_reader *r = p->r;
+	struct LZFU_state *z;
+	uint8 header[LZFU_HEADER_SIZE];
+	size_t start = r->pos;
+	size_t end = start +num;
+	uint32 comp_size = 0, raw_size = 0, comp_type = 0, crc = 0;
+	size_t data_len = 0;
+	size_t len;
+	const uint8 *bp;
+	int seekable = ((r->f == NULL)||(r->size > 0));
+	int wanted = 1;
+	int result = 0;
+
+	if (num >= LZFU_HEADER_SIZE)
+	{
+		if (TNEF_read(r, header, sizeof(header)) == -1) return -1;
+		comp_size = header[0] | header[1] << 8 | header[2] << 16 | (uint32)header[3] << 24;
+		raw_size = header[4] | header[5] << 8 | header[6] << 16 | (uint32)header[7] << 24;
+		comp_type = header[8] | header[9] << 8 | header[10] << 16 | (uint32)header[11] << 24;
+		crc = header[12] | header[13] << 8 | header[14] << 16 | (uint32)header[15] << 24;
+
+		// COMPSIZE counts the header after itself
+		data_len = num -LZFU_HEADER_SIZE;
+		if ((comp_size >= LZFU_HEADER_SIZE -4)&&(comp_size -(LZFU_HEADER_SIZE -4) < data_len)) data_len = comp_size -(LZFU_HEADER_SIZE -4);
+	}
+
+	// Check the CRC before creating anything, when the data can be
+	//		read twice; otherwise it is checked as we go.
+	if ((comp_type == LZFU_COMPRESSED)&&(seekable))
+	{
+		uint32 check = 0;
+		size_t left = data_len;
+
+		while ((left > 0)&&((len = TNEF_fetch(r, left, &bp)) > 0))
+		{
+			check = LZFU_crc(check, bp, len);
+			left -= len;
+		}
+		if ((left > 0)||(TNEF_seek(r, start +LZFU_HEADER_SIZE) == -1)) return -1;
+		if (check != crc)
+		{
+			LOGGER_log("%s:%d:%s:WARNING: Compressed RTF CRC is %lx, expected %lx, saving it undecoded\n",FL,__func__,(unsigned long)check,(unsigned long)crc);
+			comp_type = 0;
+		}
+	}
+
+	if ((comp_type != LZFU_COMPRESSED)&&(comp_type != LZFU_UNCOMPRESSED))
+	{
+		char filename[256];
+
+		if (TNEF_seek(r, start) == -1) return -1;
+		sprintf (filename, "XAM_%d.rtf", TNEF_glb.file_num);
+		TNEF_glb.file_num++;
+		return save_attach_data(filename, r, num, p->unpack_metadata);
+	}
+
+	if (comp_type == LZFU_UNCOMPRESSED)
+	{
+		if (raw_size > data_len) raw_size = data_len;
+		result = save_attach_data(TNEF_RTF_BODY_NAME, r, raw_size, p->unpack_metadata);
+
+	} else if (!MIME_output_size_wanted(p->unpack_metadata, raw_size)) {
+		// RAWSIZE is what the RTF decompresses to; the value is skipped below
+		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: '%s' is outside the size limits, passing over it\n",FL,__func__,TNEF_RTF_BODY_NAME);
+		wanted = 0;
+
+	} else {
+		z = malloc(sizeof(struct LZFU_state));
+		if (z == NULL)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate the RTF decompressor (%s)\n",FL,__func__,strerror(errno));
+			return -1;
+		}
+		memset(z->dict, 0, sizeof(z->dict));
+		memcpy(z->dict, LZFU_prebuf, sizeof(LZFU_prebuf) -1);
+		z->write_pos = sizeof(LZFU_prebuf) -1;
+		z->bit = 8;
+		z->flags = 0;
+		z->have_high = 0;
+		z->done = 0;
+		z->crc = 0;
+		z->raw_left = raw_size;
+		z->out_l = 0;
+
+		z->cur = MIME_element_add (NULL, p->unpack_metadata, TNEF_RTF_BODY_NAME, "TNEF", "TNEF", "TNEF", 0, 1, 0, __func__);
+		if (!z->cur->opened)
+		{
+			free(z);
+			return -1;
+		}
+
+		while ((result == 0)&&(data_len > 0)&&((len = TNEF_fetch(r, data_len, &bp)) > 0))
+		{
+			data_len -= len;
+			if (LZFU_decompress(z, bp, len) != 0) result = -1;
+		}
+		if ((result == 0)&&(LZFU_flush(z) != 0)) result = -1;
+		if (data_len > 0) result = -1;
+
+		if ((result == 0)&&(!seekable)&&(z->crc != crc))
+		{
+			LOGGER_log("%s:%d:%s:WARNING: Compressed RTF CRC is %lx, expected %lx\n",FL,__func__,(unsigned long)z->crc,(unsigned long)crc);
+		}
+		if ((result == 0)&&(!z->done)&&((TNEF_VERBOSE)||(TNEF_DEBUG))) LOGGER_log("%s:%d:%s:WARNING: Compressed RTF has no end marker\n",FL,__func__);
+
+		MIME_element_deactivate(z->cur, p->unpack_metadata);
+		free(z);
+	}
+
+	if ((result == 0)&&(wanted)&&(TNEF_VERBOSE))
+	{
+		if (TNEF_glb.filename_decoded_report == NULL) LOGGER_log("Decoding: %s\n", TNEF_RTF_BODY_NAME);
+		else TNEF_glb.filename_decoded_report( TNEF_RTF_BODY_NAME, (TNEF_glb.verbosity_contenttype>0?"tnef":NULL));
+	}
+
+	// Past anything of the value which was not part of the RTF
+	if (result == 0)
+	{
+		if (r->pos > end) return -1;
+		result = TNEF_skip(r, end -r->pos);
+	}
+
+	return result;
+}
+
 /*------------------------------------------------------------------------
 Procedure:     handle_props ID:1
-Purpose:
+Purpose:       Walks an attMAPIProps block ending at stream offset 'end'
 Input:
-Output:
+Output:        0 when done, -1 if the block is damaged
 Errors:
 ------------------------------------------------------------------------*/
-int handle_props(uint8 *tsp, char * file_dir)
+int handle_props(struct TNEF_parser *p, size_t end)
 {
-	int bytes = 0;
+	struct TNEF_reader *r = p->r;
 	uint32 num_props = 0;
 	uint32 x = 0;
 
-
-	RT32(&num_props, tsp);
-	bytes += sizeof(num_props);
+	if (read_32(&num_props, r) == -1) return -1;
 
 	while (x < num_props)
 	{
 		uint32 prop_tag;
-		uint32 num;
-		char filename[256];
+		uint32 count = 1;
+		uint32 value_size = 0;
+		uint32 i;
 
-		RT32(&prop_tag, tsp+bytes);
-		bytes += sizeof(prop_tag);
+		if (r->pos > end) return -1;
+		if (read_32(&prop_tag, r) == -1) return -1;
 
-		switch (prop_tag & PROP_TYPE_MASK)
+		// Named properties carry their GUID and name or ID after the tag
+		if (PROP_ID(prop_tag) >= 0x8000)
+		{
+			uint32 kind, len;
+
+			if (TNEF_skip(r, 16) == -1) return -1;
+			if (read_32(&kind, r) == -1) return -1;
+			if (read_32(&len, r) == -1) return -1;
+			if (kind != 0)
+			{
+				if (len > end -r->pos) return -1;
+				if (TNEF_skip(r, len + ((len % 4) ? (4 - len%4) : 0)) == -1) return -1;
+			}
+		}
+
+		switch (PROP_TYPE(prop_tag) & ~MV_FLAG)
 		{
 			case PT_BINARY:
-				RT32(&num, tsp+bytes);
-				bytes += sizeof(num);
-				RT32(&num, tsp+bytes);
-				bytes += sizeof(num);
-				if (prop_tag == PR_RTF_COMPRESSED)
-				{
-					sprintf (filename, "XAM_%d.rtf", TNEF_glb.file_num);
-					TNEF_glb.file_num++;
-					save_attach_data(filename, tsp+bytes, num, file_dir);
-				}
-				/* num + PAD */
-				bytes += num + ((num % 4) ? (4 - num%4) : 0);
-				break;
+			case PT_OBJECT:
 			case PT_STRING8:
-				RT32(&num, tsp+bytes);
-				bytes += sizeof(num);
-				RT32(&num, tsp+bytes);
-				bytes += sizeof(num);
-				make_string(tsp+bytes,num);
-				bytes += num + ((num % 4) ? (4 - num%4) : 0);
-				break;
 			case PT_UNICODE:
-			case PT_OBJECT:
+				// Counted values, each one length prefixed and padded
+				if (read_32(&count, r) == -1) return -1;
+				for (i = 0; i < count; i++)
+				{
+					uint32 num;
+
+					if (read_32(&num, r) == -1) return -1;
+					if (num > end -r->pos) return -1;
+					if ((prop_tag == PR_RTF_COMPRESSED)&&(i == 0))
+					{
+						if (save_rtf_body(p, num) == -1) return -1;
+					} else if (TNEF_skip(r, num) == -1) return -1;
+					/* num + PAD */
+					if (TNEF_skip(r, (num % 4) ? (4 - num%4) : 0) == -1) return -1;
+				}
 				break;
 			case PT_I2:
-				bytes += 2;
-				break;
 			case PT_LONG:
-				bytes += 4;
-				break;
 			case PT_R4:
-				bytes += 4;
+			case PT_ERROR:
+			case PT_BOOLEAN:
+				value_size = 4;
 				break;
 			case PT_DOUBLE:
-				bytes += 8;
-				break;
 			case PT_CURRENCY:
 			case PT_APPTIME:
-			case PT_ERROR:
-				bytes += 4;
-				break;
-			case PT_BOOLEAN:
-				bytes += 4;
-				break;
 			case PT_I8:
-				bytes += 8;
 			case PT_SYSTIME:
-				bytes += 8;
+				value_size = 8;
+				break;
+			case PT_CLSID:
+				value_size = 16;
 				break;
+			default:
+				// Can't tell how long it is, so nothing after it can be found
+				if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Unknown property type 0x%x, ending properties\n",FL,__func__, PROP_TYPE(prop_tag));
+				return 0;
 		}
-		x++;
-	}
-	return 0;
-}
-
-/*------------------------------------------------------------------------
-Procedure:     default_handler ID:1
-Purpose:
-Input:
-Output:
-Errors:
-------------------------------------------------------------------------*/
-int default_handler(uint32 attribute, uint8 *tsp, uint32 size)
-{
-	uint16 type = ATT_TYPE(attribute);
 
-	switch (type) {
-		case atpTriples:
-			break;
-		case atpString:
-		case atpText:
-			break;
-		case atpDate:
-			break;
-		case atpShort:
-			break;
-		case atpLong:
-			break;
-		case atpByte:
-			break;
-		case atpWord:
-			break;
-		case atpDword:
-			break;
-		default:
-			break;
+		if (value_size > 0)
+		{
+			if ((prop_tag & MV_FLAG)&&(read_32(&count, r) == -1)) return -1;
+			if (count > (end -r->pos) /value_size) return -1;
+			if (TNEF_skip(r, (size_t)count *value_size) == -1) return -1;
+		}
+		x++;
 	}
 	return 0;
 }
 
 /*------------------------------------------------------------------------
 Procedure:     read_attribute ID:1
-Purpose:
+Purpose:       Decodes the next attribute and moves past its checksum
 Input:
-Output:
+Output:        1 if an attribute was read, 0 at the end of the stream,
+               -1 if the stream is damaged
 Errors:
 ------------------------------------------------------------------------*/
-int read_attribute(uint8 *tsp, char *file_dir)
+int read_attribute(struct TNEF_parser *p)
 {
-
-	int bytes = 0, header = 0;
-	int rv = 0;
+	struct TNEF_reader *r = p->r;
+	uint8 level;
 	uint32 attribute;
 	uint32 size = 0;
 	uint16 checksum = 0;
-	static char attach_title[256] = {
-		0				};
-	static uint32 attach_size = 0;
-	//static uint32 attach_loc  = 0; // 2003-02-22-1231-PLD
-	static uint8 *attach_loc  = 0;
+	size_t start, end;
 
-	bytes += sizeof(uint8);
+	// Quietly stop at the end of the stream
+	if (r->f == NULL)
+	{
+		if (r->pos >= r->size) return 0;
+	} else {
+		int c = getc(r->f);
+
+		if (c == EOF) return 0;
+		ungetc(c, r->f);
+	}
+
+	// The level byte (message or attachment), which we don't need
+	if (TNEF_read(r, &level, sizeof(level)) == -1) return -1;
 
 	// Read the attributes of this component
 
 	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Reading Attribute...\n",FL,__func__);
-	rv = read_32(&attribute, tsp+bytes);
-	if (rv == -1) return -1;
-	bytes += sizeof(attribute);
+	if (read_32(&attribute, r) == -1) return -1;
 
 	// Read the size of the information we have to read
 
 	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s: Reading Size...\n",FL,__func__);
-	rv = read_32(&size, tsp+bytes);
-	if (rv == -1) return -1;
-	bytes += sizeof(size);
-
-	// The header size equals the sum of all the things we've read
-	//  so far.
-
-	header = bytes;
-
-	// The is a bit of a tricky one [if you're being slow
-	//  it moves the number of bytes ahead by the amount of data of
-	//  the attribute we're about to read, so that for next
-	//  "read_attribute()"
-	//  call starts in the right place.
-
-	bytes += size;
-
-	// Read in the checksum for this component
-	//
-	// AMMENDMENT - 19/07/02 - 17H01
-	// Small code change to deal with strange sitations that occur with non
-	//		english characters. - Submitted by wtcheuk@netvigator.com @ 19/07/02
+	if (read_32(&size, r) == -1) return -1;
 
-	if ( bytes < 0 ) return -1;
+	start = r->pos;
+	end = start +size;
 
-	// --END of ammendment.
-
-	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Reading Checksum...(offset %d, bytes=%d)\n", FL,__func__, tsp -TNEF_glb.tnef_home, bytes);
-	if (read_16(&checksum, tsp+bytes) == -1) return -1;
-
-	bytes += sizeof(checksum);
+	// When we know how long the stream is, refuse an attribute which
+	//		(with its checksum) runs past the end of it before acting
+	//		on any of it, as a truncated winmail.dat would otherwise
+	//		give a truncated attachment.
+	if ((r->size > 0)&&((size > r->size)||(end +sizeof(checksum) > r->size)))
+	{
+		if ((TNEF_VERBOSE)||(TNEF_DEBUG)) LOGGER_log("%s:%d:%s:ERROR: Attribute of %lu bytes at offset %lu runs past the end of the stream",FL,__func__,(unsigned long)size,(unsigned long)start);
+		return -1;
+	}
 
-	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Decoding attribute %d\n", FL,__func__, attribute);
+	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Decoding attribute %d (offset %lu, bytes=%lu)\n", FL,__func__, attribute, (unsigned long)start, (unsigned long)size);
 
 	switch (attribute) {
-		case attNull:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attFrom:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attSubject:
-			break;
-		case attDateSent:
-			break;
-		case attDateRecd:
-			break;
-		case attMessageStatus:
-			break;
-		case attMessageClass:
-			break;
-		case attMessageID:
-			break;
-		case attParentID:
-			break;
-		case attConversationID:
-			break;
-		case attBody:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attPriority:
-			break;
 		case attAttachData:
-			attach_size=size;
-			//		attach_loc =(int)tsp+header; // 2003-02-22-1232-PLD
-			attach_loc =(uint8 *)tsp+header;
-			if (strlen(attach_title)>0 && attach_size > 0) {
-				if (!save_attach_data(attach_title, (uint8 *)attach_loc,attach_size,file_dir))
-				{
-					if (TNEF_VERBOSE) {
-						if (TNEF_glb.filename_decoded_report == NULL)
-						{
-							LOGGER_log("Decoding: %s\n", attach_title);
-						} else {
-							TNEF_glb.filename_decoded_report( attach_title, (TNEF_glb.verbosity_contenttype>0?"tnef":NULL));
-						}
-
-					}
-				}
-				else
-				{
-					LOGGER_log("%s:%d:%s:ERROR: While saving attachment '%s'\n", FL,__func__, attach_title);
-				}
-			}
+			p->attach_size = size;
+			p->attach_loc = start;
+			if (strlen(p->attach_title)>0 && p->attach_size > 0) save_attachment(p);
 			break;
 		case attAttachTitle:
-			strncpy(attach_title, make_string(tsp+header,size),255);
-			if (strlen(attach_title)>0 && attach_size > 0) {
-				if (!save_attach_data(attach_title, (uint8 *)attach_loc,attach_size, file_dir))
-				{
-					if (TNEF_VERBOSE) {
-						if (TNEF_glb.filename_decoded_report == NULL)
-						{
-							LOGGER_log("Decoding: %s\n", attach_title);
-						} else {
-							TNEF_glb.filename_decoded_report( attach_title, (TNEF_glb.verbosity_contenttype>0?"tnef":NULL));
-						}
-
-					}
-				}
-				else
+			{
+				size_t len = (size < sizeof(p->attach_title)) ? size : sizeof(p->attach_title) -1;
+
+				if (TNEF_read(r, p->attach_title, len) == -1) return -1;
+				p->attach_title[len] = '\0';
+			}
+			if (strlen(p->attach_title)>0 && p->attach_size > 0) {
+				// The data came first, go back for it
+				if (TNEF_seek(r, p->attach_loc) == 0)
 				{
-					LOGGER_log("%s:%d:%s:ERROR: While saving attachment '%s'\n", FL,__func__, attach_title);
+					save_attachment(p);
+					if (TNEF_seek(r, end) == -1) return -1;
 				}
+				else LOGGER_log("%s:%d:%s:ERROR: Cannot go back for the data of attachment '%s' in an unseekable stream\n", FL,__func__, p->attach_title);
 			}
 			break;
-		case attAttachMetaFile:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attAttachCreateDate:
-			break;
-		case attAttachModifyDate:
-			break;
-		case attDateModified:
-			break;
-		case attAttachTransportFilename:
-			default_handler(attribute, tsp+header, size);
-			break;
 		case attAttachRenddata:
-			attach_title[0]=0;
-			attach_size=0;
-			attach_loc=0;
-			default_handler(attribute, tsp+header, size);
+			p->attach_title[0]=0;
+			p->attach_size=0;
+			p->attach_loc=0;
 			break;
 		case attMAPIProps:
-			if (handle_props(tsp+header, file_dir)==-1) return -1;
-			break;
-		case attRecipTable:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attAttachment:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attTnefVersion:
-			{
-				uint32 version;
-				rv = read_32(&version, tsp+header);
-				if (rv == -1) return -1;
-			}
-			break;
-		case attOemCodepage:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attOriginalMessageClass:
-			break;
-		case attOwner:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attSentFor:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attDelegate:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attDateStart:
-			break;
-		case attDateEnd:
-			break;
-		case attAidOwner:
-			default_handler(attribute, tsp+header, size);
-			break;
-		case attRequestRes:
-			default_handler(attribute, tsp+header, size);
+			if (handle_props(p, end)==-1) return -1;
 			break;
 		default:
-			default_handler(attribute, tsp+header, size);
+			// Nothing else is used, so it is simply stepped over
 			break;
 	}
-	return bytes;
 
+	// Skip whatever the handler left of the attribute and the checksum
+	if (r->pos > end) return -1;
+	if (TNEF_skip(r, end -r->pos) == -1) return -1;
+	if (read_16(&checksum, r) == -1) return -1;
+
+	return 1;
 }
 
 /*------------------------------------------------------------------------
 Procedure:     decode_tnef ID:1
-Purpose:
+Purpose:       Decodes the TNEF stream behind the reader
 Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-int TNEF_decode_tnef(uint8 *tnef_stream, int size, char* file_dir)
+static int TNEF_decode_stream( struct TNEF_reader *r, RIPMIME_output *unpack_metadata )
 {
-
+	struct TNEF_parser p;
 	int ra_response;
-	uint32 tnefs;
+	uint32 tnefs = 0;
 	uint16 tnef_attachkey;
-	uint8 *tsp;
 
-	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Start. Size = %d\n", FL,__func__,size);
+	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Start. Size = %lu\n", FL,__func__,(unsigned long)r->size);
 
-	// TSP == TNEF Stream Pointer (well memory block actually!)
-	//
-	tsp = tnef_stream;
+	p.r = r;
+	p.unpack_metadata = unpack_metadata;
+	p.attach_title[0] = '\0';
+	p.attach_size = 0;
+	p.attach_loc = 0;
 
 	// Read in the signature of this TNEF
 	//
-	ra_response = read_32(&tnefs, tsp);
+	ra_response = read_32(&tnefs, r);
 	if ((ra_response != -1)&&(TNEF_SIGNATURE == tnefs))
 	{
 		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: TNEF signature is good\n",FL,__func__);
 	} else {
 		if (TNEF_VERBOSE) LOGGER_log("%s:%d:%s:WARNING: Bad TNEF signature, expecting %lx got %lx\n",FL,__func__,TNEF_SIGNATURE,tnefs);
+		if (ra_response == -1) return -1;
 	}
 
-	// Move tsp pointer along
-	//
-	tsp += sizeof(TNEF_SIGNATURE);
-
 	/** Read the TNEF Attach key **/
-	if (read_16(&tnef_attachkey, tsp) == -1) return -1;
+	if (read_16(&tnef_attachkey, r) == -1) return -1;
 	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: TNEF Attach Key: %x\n",FL,__func__,tnef_attachkey);
 
-	// Move tsp pointer along
-	//
-	tsp += sizeof(uint16);
-
 	// While we still have more bytes to process,
-	//		go through entire memory block and extract
+	//		go through the stream and extract
 	//		all the required attributes and files
 	//
 	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: TNEF - Commence reading attributes\n",FL,__func__);
-	while ((tsp - tnef_stream) < size)
-	{
-		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Offset = %d\n", FL,__func__,tsp -TNEF_glb.tnef_home);
-		ra_response = read_attribute(tsp, file_dir);
-		if ( ra_response > 0 )
-		{
-			tsp += ra_response;
-		} else {
-
-			// Must find out /WHY/ this happens, and, how to rectify the issue.
+	do {
+		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Offset = %lu\n", FL,__func__,(unsigned long)r->pos);
+		ra_response = read_attribute(&p);
+	} while (ra_response > 0);
 
-			tsp++;
-			if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:WARNING: TNEF - Attempting to read attribute at %d resulted in a sub-zero response, ending decoding to be safe\n",FL,__func__,tsp);
-			break;
-		}
+	if (ra_response < 0)
+	{
+		// Must find out /WHY/ this happens, and, how to rectify the issue.
+		if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:WARNING: TNEF - Attempting to read attribute at %lu resulted in a sub-zero response, ending decoding to be safe\n",FL,__func__,(unsigned long)r->pos);
 	}
 
 	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Done.\n",FL,__func__);
@@ -669,50 +947,79 @@ int TNEF_decode_tnef(uint8 *tnef_stream, int size, char* file_dir)
 	return 0;
 }
 
-int TNEF_file_processing( FILE *fp, char *file_dir )
+/*------------------------------------------------------------------------
+Procedure:     TNEF_is_signature ID:1
+Purpose:       Checks whether data starts with the TNEF signature
+Input:         head, len: leading bytes of the data
+Output:        1 if it does, else 0
+Errors:
+------------------------------------------------------------------------*/
+int TNEF_is_signature( const unsigned char *head, size_t len )
 {
-	uint8 *tnef_stream;
-	int size, nread;
-
-	// Get the filesize
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-
-	// Allocate enough memory to read in the ENTIRE file
-	// FIXME - This could be a real consumer if multiple
-	// instances of TNEF decoding is going on
-	TNEF_glb.tnef_home = tnef_stream = (uint8 *)malloc(size);
-	TNEF_glb.tnef_limit = TNEF_glb.tnef_home +size;
-
-	// If we were unable to allocate enough memory, then we
-	// should report this
-	if (tnef_stream == NULL)
-	{
-		LOGGER_log("%s:%d:%s:ERROR: When allocating %d bytes for loading file (%s)\n", FL,__func__, size,strerror(errno));
-		if (TNEF_glb.tnef_home) free(TNEF_glb.tnef_home);
-		return -1;
-	}
+	if (len < sizeof(TNEF_SIGNATURE)) return 0;
+	return ((ULONG)head[0] | (ULONG)head[1] << 8 | (ULONG)head[2] << 16 | (ULONG)head[3] << 24) == TNEF_SIGNATURE;
+}
+
+/*------------------------------------------------------------------------
+Procedure:     TNEF_decode_buffer ID:1
+Purpose:       Decodes a TNEF stream which is already in memory
+Input:         buf, size: the whole TNEF stream, which is only ever read
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int TNEF_decode_buffer( const char *buf, size_t size, RIPMIME_output *unpack_metadata )
+{
+	struct TNEF_reader r;
+
+	if ((buf == NULL)||(size == 0)) return 0;
+
+	r.f = NULL;
+	r.data = (const uint8 *)buf;
+	r.size = size;
+	r.pos = 0;
+	r.chunk = NULL;
+
+	TNEF_decode_stream(&r, unpack_metadata);
 
-	// Attempt to read in the entire file
-	nread = fread(tnef_stream, sizeof(uint8), size, fp);
+	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: finished decoding.\n",FL,__func__);
 
-	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: Read %d bytes\n", FL,__func__, nread);
+	return 0;
+}
 
-	// If we did not read in all the bytes, then let syslogs know!
-	if (nread < size)
+/*------------------------------------------------------------------------
+Procedure:     TNEF_decode_file ID:1
+Purpose:       Decodes a TNEF stream from an open file or pipe
+Input:
+Output:
+Errors:
+------------------------------------------------------------------------*/
+int TNEF_decode_file( FILE *fp, RIPMIME_output *unpack_metadata )
+{
+	struct TNEF_reader r;
+	struct stat st;
+
+	r.f = fp;
+	r.data = NULL;
+	r.size = 0;
+	r.pos = 0;
+
+	// The stream is parsed as it is read, attachments going out in
+	//		chunks, so only one chunk is ever held however big the
+	//		winmail.dat.  Knowing the size (regular files only) lets
+	//		truncated attributes be refused, and attachments whose
+	//		data comes before their title be gone back for.
+	if ((fstat(fileno(fp), &st) == 0)&&(S_ISREG(st.st_mode))&&(ftell(fp) == 0)) r.size = st.st_size;
+
+	r.chunk = malloc(TNEF_CHUNK_SIZE);
+	if (r.chunk == NULL)
 	{
-		LOGGER_log("%s:%d:%s:ERROR: while reading stream from TNEF file (%s)\n", FL,__func__, strerror(errno));
-		if (TNEF_glb.tnef_home) free(TNEF_glb.tnef_home);
+		LOGGER_log("%s:%d:%s:ERROR: When allocating %d bytes for reading the stream (%s)\n", FL,__func__, TNEF_CHUNK_SIZE,strerror(errno));
 		return -1;
 	}
 
-	// Proceed to decode the file
-	TNEF_decode_tnef(tnef_stream,size, file_dir);
+	TNEF_decode_stream(&r, unpack_metadata);
 
-	if (TNEF_glb.tnef_home) free(TNEF_glb.tnef_home);
-
-	if (TNEF_DEBUG) LOGGER_log("%s:%d:%s:DEBUG: finished decoding.\n",FL,__func__);
+	free(r.chunk);
 
 	return 0;
 }
@@ -724,7 +1031,7 @@ Input:
 Output:
 Errors:
 ------------------------------------------------------------------------*/
-int TNEF_main( char *filename, char *file_dir )
+int TNEF_main( char *filename, RIPMIME_output *unpack_metadata )
 {
 	FILE *fp;
 
@@ -735,10 +1042,9 @@ int TNEF_main( char *filename, char *file_dir )
 	if ((fp = fopen(filename,"r")) == NULL)
 	{
 		LOGGER_log("%s:%d:%s:ERROR: opening file %s for reading (%s)\n", FL,__func__, filename,strerror(errno));
-		if (TNEF_glb.tnef_home) free(TNEF_glb.tnef_home);
 		return -1;
 	}
-	TNEF_file_processing(fp, file_dir);
+	TNEF_decode_file(fp, unpack_metadata);
 	
 	// Close the file
 	fclose(fp);
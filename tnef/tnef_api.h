@@ -3,8 +3,15 @@
 #ifndef __TNEF_API__
 #define __TNEF_API__
 
+#include <stdio.h>
+
+struct mime_output;
+
 void TNEF_init( void );
-int TNEF_main( char *filename, char* file_dir );
+int TNEF_main( char *filename, struct mime_output *unpack_metadata );
+int TNEF_decode_file( FILE *fp, struct mime_output *unpack_metadata );
+int TNEF_is_signature( const unsigned char *head, size_t len );
+int TNEF_decode_buffer( const char *buf, size_t size, struct mime_output *unpack_metadata );
 int TNEF_set_filename_report_fn( int (*ptr_to_fn)(char *, char *));
 int TNEF_set_verbosity( int level );
 int TNEF_set_verbosity_contenttype( int level );
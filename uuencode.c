@@ -361,6 +361,122 @@ FFGET_FILE * UUENCODE_make_sourcestream( FILE *f)
 	return &(glb.ffinf);
 }
 
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_begin_name
+  Returns Type	: char *
+  ----Parameter List
+  1. struct PLD_strtok *tx, tokeniser state
+  2. char *buf, the begin line, which is split up in place
+  ------------------
+  Exit Codes	: the file name, else the permissions if there is no
+  name on the line, else NULL
+  \------------------------------------------------------------------*/
+static char *UUENCODE_begin_name( struct PLD_strtok *tx, char *buf )
+{
+	char *bp, *fp = NULL, *fn = NULL;
+
+	bp = PLD_strtok(tx, buf, " \n\r\t"); // Get the begin
+
+	if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: BEGIN = '%s'\n", FL,__func__, bp);
+	if (bp) fp = PLD_strtok(tx, NULL, " \n\r\t"); // Get the file-permissions
+
+	if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Permissions/Name = '%s'\n", FL,__func__, fp);
+	if (fp) fn = PLD_strtok(tx, NULL, "\n\r"); // Get the file-name
+
+	if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Name = '%s'\n", FL,__func__, fn);
+
+	if (!fn) return fp;
+	return fn;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_decode_line
+  Returns Type	: int
+  ----Parameter List
+  1. char *buf, one line of uuencoded data, padded in place
+  2. MIME_element *cur_mime, where the decoded bytes go
+  3. unsigned char *writebuffer, UUENCODE_WRITE_BUFFER_SIZE bytes
+  4. int *wbcount, bytes held in writebuffer
+  ------------------
+  Exit Codes	: the byte count from the head of the line, <= 0 at
+  the end of the data (in which case nothing is decoded)
+  Comments:
+  The count is checked before anything is decoded, so the line can be
+  run through four characters to three bytes at a time straight into
+  the write buffer, which is flushed at most once per line.
+  \------------------------------------------------------------------*/
+static int UUENCODE_decode_line( char *buf, MIME_element *cur_mime, unsigned char *writebuffer, int *wbcount )
+{
+	unsigned char *lp = (unsigned char *)buf;
+	unsigned char *wp;
+	unsigned int v;
+	int n, groups, expected, len;
+
+	// The first char of the line indicates how many bytes are to be expected,
+	//	anything outside of ' ' to '`' is not a uuencoded line at all.
+	if ((*lp < ' ')||(*lp > '`')) return 0;
+	n = uudec[*lp];
+	if (n <= 0) return 0;
+
+	// Lines which have lost their trailing spaces along the way are padded out
+	expected = ((n+2)/3)<<2;
+	len = strcspn(buf +1, "\r\n");
+	while (len < expected) buf[1 +len++] = ' ';
+
+	if ( *wbcount >= UUENCODE_WRITE_BUFFER_LIMIT )
+	{
+		MIME_element_write(cur_mime, writebuffer, *wbcount);
+		*wbcount = 0;
+	}
+
+	lp++;
+	wp = writebuffer +*wbcount;
+
+	for (groups = n /3; groups > 0; groups--)
+	{
+		v = (uudec[lp[0]] << 18) | (uudec[lp[1]] << 12) | (uudec[lp[2]] << 6) | uudec[lp[3]];
+		wp[0] = v >> 16;
+		wp[1] = v >> 8;
+		wp[2] = v;
+		wp += 3;
+		lp += 4;
+	}
+
+	// Last, partial, group
+	if (n %3)
+	{
+		v = (uudec[lp[0]] << 18) | (uudec[lp[1]] << 12) | (uudec[lp[2]] << 6);
+		wp[0] = v >> 16;
+		if (n %3 == 2) wp[1] = v >> 8;
+	}
+
+	*wbcount += n;
+
+	return n;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_report
+  Returns Type	: void
+  ----Parameter List
+  1. struct MIMEH_header_info *hinfo, headers of the carrying part
+  ------------------
+  Comments:
+  Call our reporting function, else, if no function is defined, use
+  the default standard call
+  \------------------------------------------------------------------*/
+static void UUENCODE_report( struct MIMEH_header_info *hinfo )
+{
+	if (!UUENCODE_VERBOSE) return;
+
+	if (glb.filename_decoded_report == NULL)
+	{
+		LOGGER_log("Decoded: %s\n", hinfo->filename);
+	} else {
+		glb.filename_decoded_report( hinfo->filename, (glb.verbosity_contenttype>0?"uuencoded":NULL) );
+	}
+}
+
 /*-----------------------------------------------------------------\
   Function Name	: UUENCODE_decode_uu
   Returns Type	: int
@@ -384,14 +500,10 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 {
 	int filename_found = 0;
 	char buf[ UUENCODE_STRLEN_MAX ];
-	char *bp = buf, *fn = NULL, *fp = NULL;
-	int n, i, expected;
+	char *bp = buf;
 	struct PLD_strtok tx;
 	unsigned char *writebuffer = NULL;
-	unsigned char *wbpos;
 	int wbcount = 0;
-	int loop = 0;
-	int buflen = 0;
 	int filecount = 0;
 
 	int output_filename_supplied = (out_filename != NULL) && (out_filename[0] != '\0');
@@ -409,7 +521,6 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 		return -1;
 	}
 	else {
-		wbpos = writebuffer;
 		wbcount = 0;
 	}
 
@@ -431,23 +542,7 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 				{
 					if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Located BEGIN\n",FL,__func__);
 					// Okay, so the line contains begin at the start, now, lets get the decode details
-					fp = fn = NULL;
-
-					bp = PLD_strtok(&tx, buf, " \n\r\t"); // Get the begin
-
-					if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: BEGIN = '%s'\n", FL,__func__, bp);
-					if (bp) fp = PLD_strtok(&tx, NULL, " \n\r\t"); // Get the file-permissions
-
-					if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Permissions/Name = '%s'\n", FL,__func__, fp);
-					if (fp) fn = PLD_strtok(&tx, NULL, "\n\r"); // Get the file-name
-
-					if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Name = '%s'\n", FL,__func__, fn);
-
-					if (!fn)
-					{
-						bp = fp;
-					}
-					else bp = fn;
+					bp = UUENCODE_begin_name(&tx, buf);
 
 					if ((!bp)&&(!f))
 					{
@@ -487,22 +582,22 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 			// Clean up the file name
 			FNFILTER_filter( bp, 255 ); /* the longest for most of filesystems */
 
-			// If our filename wasn't supplied via the params, then copy it over here
+			// If our filename wasn't supplied via the params, then pass it back
+			//		to the caller here
 			if (output_filename_supplied == 0)
-				out_filename = strdup(bp);
+				PLD_strncpy(out_filename, bp, _MIMEH_FILENAMELEN_MAX);
 
-			if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Filename = (%s)\n", FL,__func__, fn);
+			if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Filename = (%s)\n", FL,__func__, bp);
 
-			cur_mime = MIME_element_add (NULL, unpack_metadata, fn, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, 1, filecount, __func__);
+			cur_mime = MIME_element_add (NULL, unpack_metadata, bp, hinfo->content_type_string, hinfo->content_transfer_encoding_string, hinfo->name, hinfo->current_recursion_level, 1, filecount, __func__);
 
 			// Allocate the write buffer.  By using the write buffer we gain an additional 10% in performance
 			// due to the lack of function call (fwrite) overheads
 
 			// Okay, now we have the UUDECODE data to decode...
 			wbcount = 0;
-			wbpos = writebuffer;
 
-			while (cur_mime->f)
+			while (cur_mime->opened)
 			{
 				// for each input line
 				FFGET_fgets(buf, sizeof(buf), f);
@@ -528,100 +623,30 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 					LOGGER_log("%s:%d:%s:WARNING: Excessive length line\n",FL,__func__);
 				}
 
-				// The first char of the line indicates how many bytes are to be expected
-				n = uudec[(int)*buf];
-
 				// If the line is a -blank- then break out.
 
 				if ((start_found == 0)&&((*buf == '\n')||(*buf == '\r'))) continue;
 				else start_found =1 ;
 
-				if ((start_found != 0)&&((n <= 0) || (*buf == '\n'))) break;
-
-				// Calculate expected # of chars and pad if necessary
-
-				expected = ((n+2)/3)<<2;
-				buflen = strlen(buf) -1;
-				for (i = buflen; i <= expected; i++) buf[i] = ' ';
-				bp = &buf[1];
-
-				// Decode input buffer to output file.
-
-				while (n > 0)
-				{
-					// In order to reduce function call overheads, we've bought the UUDecoding
-					// bit shifting routines into the UUDecode main decoding routines. This should
-					// save us about 250,000 function calls per Mb.
-					// UUENCODE_outdec(bp, cur_mime->f, n);
-
-					char c[3];
-					int m = n;
-
-					c[0] = uudec[(int)*bp] << 2 | uudec[(int)*(bp+1)] >> 4;
-					c[1] = uudec[(int)*(bp+1)] << 4 | uudec[(int)*(bp+2)] >> 2;
-					c[2] = uudec[(int)*(bp+2)] << 6 | uudec[(int)*(bp+3)];
-
-					if (m > 3) m = 3;
-
-					if ( wbcount >= UUENCODE_WRITE_BUFFER_LIMIT )
-					{
-						size_t bc;
-						bc = fwrite(writebuffer, 1, wbcount, cur_mime->f);
-						if (bc != wbcount) {
-							LOGGER_log("%s:%d:ERROR: Attempted to write %ld bytes, only wrote %ld\n", FL,__func__, wbcount, bc);
-						}
-						wbpos = writebuffer;
-						wbcount = 0;
-					}
-
-					// Transfer the decoded data to the write buffer.
-					// The reason why we use a loop, rather than just a set of if
-					// statements is just for code-viewing simplicity.  It's a lot
-					// easier to read than some nested chain of if's
-
-					for (loop = 0; loop < m; loop++)
-					{
-						*wbpos = c[loop];
-						wbpos++;
-						wbcount++;
-					}
-
-					bp += 4;
-					n -= 3;
-
-				} // while (n > 0)
+				if (UUENCODE_decode_line(buf, cur_mime, writebuffer, &wbcount) <= 0) break;
 
 			} // While (1)
 
-			if ((cur_mime->f != NULL)&&(wbcount > 0))
+			if (wbcount > 0)
 			{
-				size_t bc = fwrite(writebuffer, 1, wbcount, cur_mime->f);
-
-				if (bc != wbcount) {
-					LOGGER_log("%s:%d:ERROR: Attempted to write %ld bytes, only wrote %ld\n", FL,__func__, wbcount, bc);
-				}
+				MIME_element_write(cur_mime, writebuffer, wbcount);
 			}
 
 			MIME_element_deactivate(cur_mime, unpack_metadata);
-			// Call our reporting function, else, if no function is defined, use the default
-			//		standard call
-
-			if ((UUENCODE_VERBOSE) && (output_filename_supplied == 0))
-			{
-				if (glb.filename_decoded_report == NULL)
-				{
-					LOGGER_log("Decoded: %s\n", hinfo->filename);
-				} else {
-					glb.filename_decoded_report( hinfo->filename, (glb.verbosity_contenttype>0?"uuencoded":NULL) );
-				}
-			}
+			if (output_filename_supplied == 0) UUENCODE_report(hinfo);
 
 			filecount++;
 		} // If valid filename was found for UUdecode
 
 		else
 		{
-			out_filename[0] = '\0';
+			// Keep the name of anything already decoded for the caller
+			if (filecount == 0) out_filename[0] = '\0';
 			if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: No FILENAME was found in data...\n",FL,__func__);
 		}
 
@@ -640,3 +665,241 @@ int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file
 	return filecount;
 }
 
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_inline_init
+  Returns Type	: int
+  ----Parameter List
+  1. struct UUENCODE_inline *uu, state to set up
+  2. char *out_filename, as for UUENCODE_decode_uu()
+  3. int decode_whole_file, 0 == only first segment, >0 == all
+  4. unpack file metadata
+  5. related MIME headers
+  ------------------
+  Exit Codes	: 0
+  Comments:
+  For the part decoders which already have every line of the part in
+  hand.  Rather than saving the part and rescanning it afterwards for
+  uuencoded files, they hand what they decode to UUENCODE_inline_write()
+  as they go, and the files are pulled out on the same pass.
+  \------------------------------------------------------------------*/
+int UUENCODE_inline_init( struct UUENCODE_inline *uu, char *out_filename, int decode_whole_file, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
+{
+	uu->state = UUENCODE_INLINE_SEEK;
+	uu->decode_whole_file = decode_whole_file;
+	uu->output_filename_supplied = (out_filename[0] != '\0');
+	uu->start_found = 0;
+	uu->skip_line = 0;
+	uu->found = 0;
+	uu->filecount = 0;
+	uu->out_filename = out_filename;
+	uu->unpack_metadata = unpack_metadata;
+	uu->hinfo = hinfo;
+	uu->cur_mime = NULL;
+	uu->linelen = 0;
+	uu->wbcount = 0;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_inline_file_end
+  Returns Type	: void
+  ----Parameter List
+  1. struct UUENCODE_inline *uu,
+  ------------------
+  Comments:
+  Closes off the file being decoded and goes back to looking for the
+  next begin line, if more than one file is wanted.
+  \------------------------------------------------------------------*/
+static void UUENCODE_inline_file_end( struct UUENCODE_inline *uu )
+{
+	if (uu->wbcount > 0)
+	{
+		MIME_element_write(uu->cur_mime, uu->writebuffer, uu->wbcount);
+		uu->wbcount = 0;
+	}
+
+	MIME_element_deactivate(uu->cur_mime, uu->unpack_metadata);
+	uu->cur_mime = NULL;
+	if (uu->output_filename_supplied == 0) UUENCODE_report(uu->hinfo);
+
+	uu->filecount++;
+	uu->state = (uu->decode_whole_file)?UUENCODE_INLINE_SEEK:UUENCODE_INLINE_DONE;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_inline_line
+  Returns Type	: void
+  ----Parameter List
+  1. struct UUENCODE_inline *uu, uu->line holds the next line
+  ------------------
+  Comments:
+  The same steps as UUENCODE_decode_uu() takes, one line at a time.
+  A file is only started on a line which UUENCODE_is_uuencode_header()
+  accepts, the test which used to decide whether a part got rescanned.
+  \------------------------------------------------------------------*/
+static void UUENCODE_inline_line( struct UUENCODE_inline *uu )
+{
+	char *buf = uu->line;
+
+	if (UUENCODE_DPEDANTIC) LOGGER_log("%s:%d:%s:DEBUG: Read line:\n%s",FL,__func__,buf);
+
+	if ((uu->state == UUENCODE_INLINE_DATA)&&(!uu->cur_mime->opened))
+	{
+		// Aborted by the output side, keep on looking for the next one
+		UUENCODE_inline_file_end(uu);
+	}
+
+	if (uu->state == UUENCODE_INLINE_SEEK)
+	{
+		struct PLD_strtok tx;
+		char *bp;
+
+		if (!UUENCODE_is_uuencode_header(buf)) return;
+
+		if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Located BEGIN\n",FL,__func__);
+		uu->found++;
+
+		bp = UUENCODE_begin_name(&tx, buf);
+
+		/** 20041105-23H02:PLD: Stepan Kasal Patch **/
+		// Filename from header has precedence:
+		if (uu->output_filename_supplied != 0) bp = uu->out_filename;
+		if (!bp) return;
+
+		// Clean up the file name
+		FNFILTER_filter( bp, 255 ); /* the longest for most of filesystems */
+
+		if (uu->output_filename_supplied == 0)
+			PLD_strncpy(uu->out_filename, bp, _MIMEH_FILENAMELEN_MAX);
+
+		if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Filename = (%s)\n", FL,__func__, bp);
+
+		uu->cur_mime = MIME_element_add (NULL, uu->unpack_metadata, bp, uu->hinfo->content_type_string, uu->hinfo->content_transfer_encoding_string, uu->hinfo->name, uu->hinfo->current_recursion_level, 1, uu->filecount, __func__);
+		uu->state = UUENCODE_INLINE_DATA;
+		uu->start_found = 0;
+		return;
+	}
+
+	if (uu->state != UUENCODE_INLINE_DATA) return;
+
+	// If we've reached the end of the UUencoding
+	if (strncasecmp(buf,"end",3)==0)
+	{
+		if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: End of UUencoding detected\n",FL,__func__);
+		UUENCODE_inline_file_end(uu);
+		return;
+	}
+
+	if ( !strpbrk(buf,"\r\n") )
+	{
+		LOGGER_log("%s:%d:%s:WARNING: Excessive length line\n",FL,__func__);
+	}
+
+	// Skip any blank lines ahead of the data
+	if ((uu->start_found == 0)&&((*buf == '\n')||(*buf == '\r'))) return;
+	uu->start_found = 1;
+
+	if (UUENCODE_decode_line(buf, uu->cur_mime, uu->writebuffer, &(uu->wbcount)) <= 0)
+	{
+		UUENCODE_inline_file_end(uu);
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_inline_write
+  Returns Type	: int
+  ----Parameter List
+  1. struct UUENCODE_inline *uu,
+  2. const char *buf, next piece of the decoded part
+  3. size_t len,
+  ------------------
+  Exit Codes	: 0
+  Comments:
+  The pieces need not line up with lines; they are split up here the
+  way FFGET_fgets() would have handed them to UUENCODE_decode_uu().
+  While looking for a begin, lines which cannot start one are passed
+  over without being copied.
+  \------------------------------------------------------------------*/
+int UUENCODE_inline_write( struct UUENCODE_inline *uu, const char *buf, size_t len )
+{
+	while ((len > 0)&&(uu->state != UUENCODE_INLINE_DONE))
+	{
+		const char *eol = memchr(buf, '\n', len);
+		size_t take = (eol)?(size_t)(eol -buf +1):len;
+		size_t room;
+
+		if ((uu->linelen == 0)&&(uu->state == UUENCODE_INLINE_SEEK)&&(uu->skip_line == 0))
+		{
+			if ((*buf != 'b')&&(*buf != 'B')) uu->skip_line = 1;
+		}
+
+		if (uu->skip_line)
+		{
+			if (eol) uu->skip_line = 0;
+			buf += take;
+			len -= take;
+			continue;
+		}
+
+		room = sizeof(uu->line) -2 -uu->linelen;
+		if (take > room)
+		{
+			take = room;
+			eol = NULL;
+		}
+
+		memcpy(uu->line +uu->linelen, buf, take);
+		uu->linelen += take;
+		buf += take;
+		len -= take;
+
+		if ((eol)||(uu->linelen >= (int)sizeof(uu->line) -2))
+		{
+			uu->line[uu->linelen] = '\0';
+			uu->linelen = 0;
+			UUENCODE_inline_line(uu);
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: UUENCODE_inline_done
+  Returns Type	: int
+  ----Parameter List
+  1. struct UUENCODE_inline *uu,
+  ------------------
+  Exit Codes	: the number of files decoded, -1 (with uuencode_error
+  set) if the part ended part way through one
+  \------------------------------------------------------------------*/
+int UUENCODE_inline_done( struct UUENCODE_inline *uu )
+{
+	// A last line without a line break
+	if ((uu->linelen > 0)&&(uu->state != UUENCODE_INLINE_DONE))
+	{
+		uu->line[uu->linelen] = '\0';
+		uu->linelen = 0;
+		UUENCODE_inline_line(uu);
+	}
+
+	if ((uu->state == UUENCODE_INLINE_DATA)&&(!uu->cur_mime->opened)) UUENCODE_inline_file_end(uu);
+
+	if (uu->state == UUENCODE_INLINE_DATA)
+	{
+		if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:WARNING: Short file (%s)\n",FL,__func__, uu->hinfo->filename);
+		if (uu->wbcount > 0) MIME_element_write(uu->cur_mime, uu->writebuffer, uu->wbcount);
+		uu->wbcount = 0;
+		MIME_element_deactivate(uu->cur_mime, uu->unpack_metadata);
+		uu->cur_mime = NULL;
+		uu->state = UUENCODE_INLINE_DONE;
+		uuencode_error = UUENCODE_STATUS_SHORT_FILE;
+		return -1;
+	}
+
+	if (UUENCODE_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Completed, %d files\n",FL,__func__, uu->filecount);
+
+	return uu->filecount;
+}
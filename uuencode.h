@@ -5,6 +5,33 @@
 #define UUENCODE_STATUS_CANNOT_FIND_FILENAME	103
 #define UUENCODE_STATUS_OK						0
 
+#define UUENCODE_INLINE_LINE_MAX		1024
+#define UUENCODE_INLINE_WRITE_BUFFER_SIZE	4096
+
+#define UUENCODE_INLINE_SEEK	0		// looking for a begin line
+#define UUENCODE_INLINE_DATA	1		// decoding into cur_mime
+#define UUENCODE_INLINE_DONE	2		// nothing more wanted from this part
+
+/* State for decoding uuencoded files out of a part while it is being
+ * decoded itself, see UUENCODE_inline_write() */
+struct UUENCODE_inline {
+	int state;
+	int decode_whole_file;
+	int output_filename_supplied;
+	int start_found;
+	int skip_line;			// rest of the current line cannot hold a begin
+	int found;				// begin lines seen
+	int filecount;			// files decoded through to their end
+	char *out_filename;
+	RIPMIME_output *unpack_metadata;
+	struct MIMEH_header_info *hinfo;
+	MIME_element *cur_mime;
+	char line[ UUENCODE_INLINE_LINE_MAX ];
+	int linelen;
+	unsigned char writebuffer[ UUENCODE_INLINE_WRITE_BUFFER_SIZE ];
+	int wbcount;
+};
+
 extern int uuencode_error;
 
 int UUENCODE_init( void );
@@ -19,9 +46,14 @@ int UUENCODE_set_doubleCR_mode( int level );
 int UUENCODE_set_filename_report_fn( int (*ptr_to_fn)(char *, char *) );
 
 int UUENCODE_is_uuencode_header( char *line );
+int UUENCODE_is_file_uuencoded( FILE *f );
 int UUENCODE_is_diskfile_uuencoded( char *fname );
 
 int UUENCODE_decode_uu( FFGET_FILE *f, char *out_filename, int decode_whole_file, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo );
+int UUENCODE_inline_init( struct UUENCODE_inline *uu, char *out_filename, int decode_whole_file, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo );
+int UUENCODE_inline_write( struct UUENCODE_inline *uu, const char *buf, size_t len );
+int UUENCODE_inline_done( struct UUENCODE_inline *uu );
+
 FILE * UUENCODE_make_file_obj (char *input_filename);
 FFGET_FILE * UUENCODE_make_sourcestream( FILE *f);
 
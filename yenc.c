@@ -0,0 +1,926 @@
+/*------------------------------------------------------------------------
+Module:        yenc.c
+Project:       Xamime:ripMIME
+State:         Beta
+Description:   yEnc is the 8-bit encoding used for binary Usenet posts, which
+turn up in mail from news gateways as plain text parts holding one or more
+=ybegin / [=ypart] / =yend blocks.  This module pulls the files out of those
+parts as they are decoded, puts multipart posts back together and checks the
+part and file CRC32s.
+------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <syslog.h>
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "logger.h"
+#include "pldstr.h"
+#include "ffget.h"
+#include "filename-filters.h"
+#include "strstack.h"
+#include "mime_element.h"
+#include "mime_headers.h"
+
+#include "yenc.h"
+
+#ifndef FL
+#define FL __FILE__,__LINE__
+#endif
+
+#define YENC_DEBUG_PEDANTIC 10
+#define YENC_DEBUG_NORMAL 1
+
+// Debug precodes
+#define YENC_DPEDANTIC ((glb.debug >= YENC_DEBUG_PEDANTIC))
+#define YENC_DNORMAL   ((glb.debug >= YENC_DEBUG_NORMAL  ))
+#define YENC_VERBOSE  	((glb.verbosity > 0 ))
+
+// Parts which turn up ahead of their turn are held in memory, up to this much
+#define YENC_PENDING_MAX (64 *1024 *1024)
+
+/* A part which arrived before the data ahead of it */
+struct YENC_piece {
+	size_t offset;
+	size_t len;
+	size_t alloc;
+	unsigned char *data;
+	struct YENC_piece *next;
+};
+
+/* A file being put back together, possibly over several parts, and over
+ * several mails of a mailbox */
+struct YENC_file {
+	char name[ _MIMEH_FILENAMELEN_MAX +1 ];
+	size_t size;
+	size_t written;			// bytes in place at the front of the file
+	unsigned int crc;		// CRC32 of those bytes
+	unsigned int crc_expected;
+	int crc_known;			// crc_expected came from a =yend crc32=
+	MIME_element *cur;
+	RIPMIME_output *unpack_metadata;
+	struct YENC_piece *pending;	// sorted by offset
+	struct YENC_file *next;
+};
+
+struct YENC_globals {
+	int debug;
+	int verbosity;
+	int verbosity_contenttype;
+	int decode;
+	int (*filename_decoded_report)(char *, char *);	// Pointer to our filename reporting function
+	struct YENC_file *files;
+	size_t pending_bytes;
+	unsigned int crc_table[4][256];
+	int crc_table_ready;
+};
+
+static struct YENC_globals glb;
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_init
+  Returns Type	: int
+  ----Parameter List
+  1. void ,
+  ------------------
+  Exit Codes	:
+  Side Effects	:
+  --------------------------------------------------------------------
+Comments:
+
+--------------------------------------------------------------------
+Changes:
+
+\------------------------------------------------------------------*/
+int YENC_init( void )
+{
+	glb.debug = 0;
+	glb.verbosity = 0;
+	glb.verbosity_contenttype = 0;
+	glb.decode = 1;
+	glb.filename_decoded_report = NULL;
+	glb.files = NULL;
+	glb.pending_bytes = 0;
+
+	return 0;
+}
+
+int YENC_set_debug( int level )
+{
+	glb.debug = level;
+	return glb.debug;
+}
+
+int YENC_set_verbosity( int level )
+{
+	glb.verbosity = level;
+	return glb.verbosity;
+}
+
+int YENC_set_verbosity_contenttype( int level )
+{
+	glb.verbosity_contenttype = level;
+	return glb.verbosity_contenttype;
+}
+
+int YENC_set_decode( int level )
+{
+	glb.decode = level;
+	return glb.decode;
+}
+
+int YENC_set_filename_report_fn( int (*ptr_to_fn)(char *, char *) )
+{
+	glb.filename_decoded_report = ptr_to_fn;
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_crc32
+  Returns Type	: unsigned int
+  ----Parameter List
+  1. unsigned int crc, CRC of the data so far, 0 to start
+  2. const unsigned char *p,
+  3. size_t len,
+  ------------------
+  Comments:
+  The usual (zlib / PKZIP) CRC32, which is what pcrc32= and crc32= carry.
+  \------------------------------------------------------------------*/
+static unsigned int YENC_crc32( unsigned int crc, const unsigned char *p, size_t len )
+{
+	unsigned int (*t)[256] = glb.crc_table;
+
+	if (!glb.crc_table_ready)
+	{
+		unsigned int c;
+		int i, k;
+
+		for (i = 0; i < 256; i++)
+		{
+			c = i;
+			for (k = 0; k < 8; k++) c = (c & 1)?(0xEDB88320 ^ (c >> 1)):(c >> 1);
+			t[0][i] = c;
+		}
+		for (i = 0; i < 256; i++)
+		{
+			for (k = 1; k < 4; k++) t[k][i] = t[0][t[k-1][i] & 0xff] ^ (t[k-1][i] >> 8);
+		}
+		glb.crc_table_ready = 1;
+	}
+
+	crc = ~crc;
+
+	// Four bytes per step, byte by byte for what is left
+	while (len >= 4)
+	{
+		crc ^= (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+		crc = t[3][crc & 0xff] ^ t[2][(crc >> 8) & 0xff] ^ t[1][(crc >> 16) & 0xff] ^ t[0][crc >> 24];
+		p += 4;
+		len -= 4;
+	}
+	while (len--) crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_decode_block
+  Returns Type	: size_t
+  ----Parameter List
+  1. const unsigned char *in, yEnc data, without the line break
+  2. size_t len,
+  3. unsigned char *out, room for len bytes
+  4. int *escape, carries an '=' left at the end of one block to the next
+  ------------------
+  Exit Codes	: bytes decoded into out
+  Comments:
+  Almost everything is a straight subtract of 42, so the work is finding
+  the odd '=' escape.  With SSE2 sixteen bytes are tested and converted at
+  once, and the store is simply overwritten from the escape onward when
+  one is found.  Elsewhere, and for the tail, memchr() finds the escapes.
+  \------------------------------------------------------------------*/
+static size_t YENC_decode_block( const unsigned char *in, size_t len, unsigned char *out, int *escape )
+{
+	const unsigned char *end = in +len;
+	unsigned char *o = out;
+
+	if ((*escape)&&(in < end))
+	{
+		*o++ = *in++ -106;
+		*escape = 0;
+	}
+
+#ifdef __SSE2__
+	{
+		const __m128i k42 = _mm_set1_epi8(42);
+		const __m128i keq = _mm_set1_epi8('=');
+
+		while (end -in >= 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)in);
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, keq));
+
+			_mm_storeu_si128((__m128i *)o, _mm_sub_epi8(v, k42));
+			if (mask == 0)
+			{
+				in += 16;
+				o += 16;
+				continue;
+			}
+
+			mask = ffs(mask) -1;
+			in += mask +1;
+			o += mask;
+			if (in == end)
+			{
+				*escape = 1;
+				return o -out;
+			}
+			*o++ = *in++ -106;
+		}
+	}
+#endif
+
+	while (in < end)
+	{
+		const unsigned char *eq = memchr(in, '=', end -in);
+		size_t run = ((eq)?eq:end) -in;
+		size_t i;
+
+		for (i = 0; i < run; i++) o[i] = in[i] -42;
+		o += run;
+		in += run;
+		if (!eq) break;
+
+		in++;
+		if (in == end)
+		{
+			*escape = 1;
+			break;
+		}
+		*o++ = *in++ -106;
+	}
+
+	return o -out;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_param
+  Returns Type	: char *
+  ----Parameter List
+  1. char *line, a =ybegin, =ypart or =yend line
+  2. const char *key, such as "size="
+  ------------------
+  Exit Codes	: the value, else NULL
+  Comments:
+  name= always comes last and takes the rest of the line, so nothing
+  past it is taken as a keyword.
+  \------------------------------------------------------------------*/
+static char *YENC_param( char *line, const char *key )
+{
+	size_t klen = strlen(key);
+	char *p = line;
+
+	while ((p = strchr(p, ' ')) != NULL)
+	{
+		p++;
+		if (strncmp(p, key, klen) == 0) return p +klen;
+		if (strncmp(p, "name=", 5) == 0) break;
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_part_what
+  Returns Type	: char *
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. const char *name, of the file the part belongs to
+  3. char *buf, where the description is written
+  4. size_t size, of buf
+  ------------------
+  Exit Codes	: buf
+  Comments:
+  Describes the part for our messages.  Single part posts have no
+  =ypart line, so they are named by their file alone.
+  \------------------------------------------------------------------*/
+static char *YENC_part_what( struct YENC_inline *y, const char *name, char *buf, size_t size )
+{
+	if (y->part > 0) snprintf(buf, size, "yEnc part %d of '%s'", y->part, name);
+	else snprintf(buf, size, "yEnc file '%s'", name);
+
+	return buf;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_report
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_file *f,
+  ------------------
+  Comments:
+  Call our reporting function, else, if no function is defined, use
+  the default standard call
+  \------------------------------------------------------------------*/
+static void YENC_report( struct YENC_file *f )
+{
+	if (!YENC_VERBOSE) return;
+
+	if (glb.filename_decoded_report == NULL)
+	{
+		LOGGER_log("Decoded: %s\n", f->name);
+	} else {
+		glb.filename_decoded_report( f->name, (glb.verbosity_contenttype>0?"yenc":NULL) );
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_file_open
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y, the part which has the start of the file
+  2. struct YENC_file *f,
+  ------------------
+  Comments:
+  The output part is only created once there is data for the front of
+  the file, and takes the headers of the mail part that carried it.
+  \------------------------------------------------------------------*/
+static void YENC_file_open( struct YENC_inline *y, struct YENC_file *f )
+{
+	if (f->cur != NULL) return;
+
+	f->unpack_metadata = y->unpack_metadata;
+	f->cur = MIME_element_add (NULL, y->unpack_metadata, f->name, y->hinfo->content_type_string, y->hinfo->content_transfer_encoding_string, y->hinfo->name, y->hinfo->current_recursion_level, 1, y->filecount, __func__);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_file_close
+  Returns Type	: int
+  ----Parameter List
+  1. struct YENC_file *f, taken off the file list and freed
+  ------------------
+  Exit Codes	: 1 if an output part was written, else 0
+  \------------------------------------------------------------------*/
+static int YENC_file_close( struct YENC_file *f )
+{
+	struct YENC_file **fp;
+	int result = 0;
+
+	for (fp = &(glb.files); *fp != NULL; fp = &((*fp)->next))
+	{
+		if (*fp == f)
+		{
+			*fp = f->next;
+			break;
+		}
+	}
+
+	while (f->pending != NULL)
+	{
+		struct YENC_piece *pc = f->pending;
+
+		f->pending = pc->next;
+		glb.pending_bytes -= pc->len;
+		free(pc->data);
+		free(pc);
+	}
+
+	if (f->cur != NULL)
+	{
+		MIME_element_deactivate(f->cur, f->unpack_metadata);
+		YENC_report(f);
+		result = 1;
+	}
+	free(f);
+
+	return result;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_file_progress
+  Returns Type	: int
+  ----Parameter List
+  1. struct YENC_inline *y, the part just finished
+  2. struct YENC_file *f,
+  ------------------
+  Exit Codes	: 1 if this completed the file, else 0
+  Comments:
+  Moves any parts now due from the pending list into the file, and
+  closes it off once all of it is there.
+  \------------------------------------------------------------------*/
+static int YENC_file_progress( struct YENC_inline *y, struct YENC_file *f )
+{
+	while ((f->pending != NULL)&&(f->pending->offset <= f->written))
+	{
+		struct YENC_piece *pc = f->pending;
+
+		f->pending = pc->next;
+		glb.pending_bytes -= pc->len;
+
+		// Anything before f->written is a repeat of what is already there
+		if (pc->offset +pc->len > f->written)
+		{
+			size_t skip = f->written -pc->offset;
+
+			YENC_file_open(y, f);
+			MIME_element_write(f->cur, pc->data +skip, pc->len -skip);
+			f->crc = YENC_crc32(f->crc, pc->data +skip, pc->len -skip);
+			f->written += pc->len -skip;
+		}
+		free(pc->data);
+		free(pc);
+	}
+
+	if (f->written < f->size) return 0;
+
+	if (f->written > f->size) LOGGER_log("%s:%d:%s:WARNING: yEnc file '%s' came to %lu bytes, %lu were expected",FL,__func__, f->name, (unsigned long)f->written, (unsigned long)f->size);
+	if ((f->crc_known)&&(f->crc != f->crc_expected))
+	{
+		LOGGER_log("%s:%d:%s:WARNING: yEnc file '%s' has CRC32 %08x, %08x was expected",FL,__func__, f->name, f->crc, f->crc_expected);
+	}
+	if (YENC_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: '%s' complete, %lu bytes",FL,__func__, f->name, (unsigned long)f->written);
+
+	return YENC_file_close(f);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_begin
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. char *buf, the =ybegin line
+  ------------------
+  Comments:
+  =ybegin [part=n [total=n]] line=n size=n name=file
+  \------------------------------------------------------------------*/
+static void YENC_begin( struct YENC_inline *y, char *buf )
+{
+	char *p;
+
+	y->found++;
+
+	p = YENC_param(buf, "size=");
+	if (p == NULL)
+	{
+		LOGGER_log("%s:%d:%s:WARNING: yEnc header without a size (%s)",FL,__func__, buf);
+		return;
+	}
+	y->size = strtoul(p, NULL, 10);
+
+	p = YENC_param(buf, "part=");
+	y->part = (p)?atoi(p):0;
+	p = YENC_param(buf, "total=");
+	y->total = (p)?atoi(p):0;
+
+	p = strstr(buf, " name=");
+	if (p == NULL)
+	{
+		LOGGER_log("%s:%d:%s:WARNING: yEnc header without a name (%s)",FL,__func__, buf);
+		return;
+	}
+	p += strlen(" name=");
+	snprintf(y->name, sizeof(y->name), "%.*s", (int)strcspn(p, "\r\n"), p);
+	FNFILTER_filter( y->name, 255 ); /* the longest for most of filesystems */
+
+	if (YENC_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: '%s' size=%lu part=%d total=%d",FL,__func__, y->name, (unsigned long)y->size, y->part, y->total);
+
+	y->state = YENC_INLINE_YPART;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_part_start
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. size_t offset, where the coming data goes in the file
+  ------------------
+  Comments:
+  Data which follows straight on from what the file already has is
+  decoded into it directly; any other part is held until its turn.
+  \------------------------------------------------------------------*/
+static void YENC_part_start( struct YENC_inline *y, size_t offset )
+{
+	struct YENC_file *f;
+	char what[ _MIMEH_FILENAMELEN_MAX +64 ];
+
+	y->file = NULL;
+	y->piece = NULL;
+	y->part_offset = offset;
+	y->part_size = 0;
+	y->part_crc = 0;
+	y->escape = 0;
+	y->wbcount = 0;
+	y->state = YENC_INLINE_DATA;	// with no file, the data is passed over up to the =yend
+
+	if (!MIME_output_size_wanted(y->unpack_metadata, y->size))
+	{
+		if (YENC_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: '%s' is outside the size limits, passing over it",FL,__func__, y->name);
+		return;
+	}
+
+	for (f = glb.files; f != NULL; f = f->next)
+	{
+		if ((f->size == y->size)&&(strcmp(f->name, y->name) == 0)) break;
+	}
+
+	if (f == NULL)
+	{
+		f = calloc(1, sizeof(struct YENC_file));
+		if (f == NULL)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate memory for yEnc file '%s'",FL,__func__, y->name);
+			return;
+		}
+		snprintf(f->name, sizeof(f->name), "%s", y->name);
+		f->size = y->size;
+		f->next = glb.files;
+		glb.files = f;
+	}
+
+	y->file = f;
+	if (offset == f->written)
+	{
+		YENC_file_open(y, f);
+	}
+	else
+	{
+		if (YENC_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: %s is ahead of its turn, holding it",FL,__func__, YENC_part_what(y, f->name, what, sizeof(what)));
+		y->piece = calloc(1, sizeof(struct YENC_piece));
+		if (y->piece == NULL)
+		{
+			LOGGER_log("%s:%d:%s:ERROR: Cannot allocate memory for %s",FL,__func__, YENC_part_what(y, f->name, what, sizeof(what)));
+			y->file = NULL;
+			return;
+		}
+		y->piece->offset = offset;
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_write_flush
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y,
+  ------------------
+  \------------------------------------------------------------------*/
+static void YENC_write_flush( struct YENC_inline *y )
+{
+	if ((y->wbcount > 0)&&(y->file != NULL)&&(y->piece == NULL))
+	{
+		MIME_element_write(y->file->cur, y->writebuffer, y->wbcount);
+	}
+	y->wbcount = 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_data
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. const char *buf, one line of yEnc data
+  3. size_t len, without the line break
+  ------------------
+  \------------------------------------------------------------------*/
+static void YENC_data( struct YENC_inline *y, const char *buf, size_t len )
+{
+	struct YENC_piece *pc = y->piece;
+	char what[ _MIMEH_FILENAMELEN_MAX +64 ];
+	unsigned char *out;
+	size_t n;
+
+	if (pc != NULL)
+	{
+		if (glb.pending_bytes +len > YENC_PENDING_MAX)
+		{
+			LOGGER_log("%s:%d:%s:WARNING: Too much out of order yEnc data held, dropping %s",FL,__func__, YENC_part_what(y, y->name, what, sizeof(what)));
+			glb.pending_bytes -= pc->len;
+			free(pc->data);
+			free(pc);
+			y->piece = pc = NULL;
+			y->file = NULL;
+		}
+		else if (pc->len +len > pc->alloc)
+		{
+			size_t alloc = (pc->alloc)?(pc->alloc *2):YENC_WRITE_BUFFER_SIZE;
+			unsigned char *data;
+
+			while (alloc < pc->len +len) alloc *= 2;
+			data = realloc(pc->data, alloc);
+			if (data == NULL)
+			{
+				LOGGER_log("%s:%d:%s:ERROR: Cannot allocate memory for %s",FL,__func__, YENC_part_what(y, y->name, what, sizeof(what)));
+				return;
+			}
+			pc->data = data;
+			pc->alloc = alloc;
+		}
+	}
+
+	if (pc != NULL)
+	{
+		out = pc->data +pc->len;
+	}
+	else
+	{
+		if (y->wbcount +len > sizeof(y->writebuffer)) YENC_write_flush(y);
+		out = y->writebuffer +y->wbcount;
+	}
+
+	n = YENC_decode_block((const unsigned char *)buf, len, out, &(y->escape));
+	if (y->file == NULL) return;
+
+	y->part_crc = YENC_crc32(y->part_crc, out, n);
+	y->part_size += n;
+
+	if (pc != NULL)
+	{
+		pc->len += n;
+		glb.pending_bytes += n;
+	}
+	else
+	{
+		y->wbcount += n;
+		if (y->part_offset > 0) y->file->crc = YENC_crc32(y->file->crc, out, n);
+		y->file->written += n;
+	}
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_part_end
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. char *buf, the =yend line, or NULL if the part was cut short
+  ------------------
+  Comments:
+  =yend size=n [part=n pcrc32=hex] [crc32=hex]
+  Whatever of the part got through is kept, even if it was cut short.
+  \------------------------------------------------------------------*/
+static void YENC_part_end( struct YENC_inline *y, char *buf )
+{
+	struct YENC_file *f = y->file;
+	char what[ _MIMEH_FILENAMELEN_MAX +64 ];
+	char *p;
+
+	YENC_write_flush(y);
+	y->state = YENC_INLINE_SEEK;
+	if (f == NULL) return;
+
+	if (buf == NULL)
+	{
+		LOGGER_log("%s:%d:%s:WARNING: %s is cut short after %lu bytes",FL,__func__, YENC_part_what(y, f->name, what, sizeof(what)), (unsigned long)y->part_size);
+	}
+	else
+	{
+		p = YENC_param(buf, "size=");
+		if (p)
+		{
+			unsigned long expected = strtoul(p, NULL, 10);
+
+			if (expected != y->part_size)
+			{
+				LOGGER_log("%s:%d:%s:WARNING: %s decoded to %lu bytes, %lu expected",FL,__func__, YENC_part_what(y, f->name, what, sizeof(what)), (unsigned long)y->part_size, expected);
+			}
+		}
+
+		p = YENC_param(buf, "pcrc32=");
+		if (p)
+		{
+			unsigned int expected = (unsigned int)strtoul(p, NULL, 16);
+
+			if (expected != y->part_crc)
+			{
+				LOGGER_log("%s:%d:%s:WARNING: %s has CRC32 %08x, %08x expected",FL,__func__, YENC_part_what(y, f->name, what, sizeof(what)), y->part_crc, expected);
+			}
+		}
+
+		p = YENC_param(buf, "crc32=");
+		if (p)
+		{
+			f->crc_expected = strtoul(p, NULL, 16);
+			f->crc_known = 1;
+		}
+	}
+
+	// A part decoded from the start of the file carries the file's CRC too
+	if ((y->piece == NULL)&&(y->part_offset == 0)) f->crc = y->part_crc;
+
+	if (y->piece != NULL)
+	{
+		struct YENC_piece **pp = &(f->pending);
+
+		while ((*pp != NULL)&&((*pp)->offset < y->piece->offset)) pp = &((*pp)->next);
+		y->piece->next = *pp;
+		*pp = y->piece;
+		y->piece = NULL;
+	}
+
+	y->file = NULL;
+	y->filecount += YENC_file_progress(y, f);
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_inline_line
+  Returns Type	: void
+  ----Parameter List
+  1. struct YENC_inline *y, y->line holds the next line
+  ------------------
+  \------------------------------------------------------------------*/
+static void YENC_inline_line( struct YENC_inline *y )
+{
+	char *buf = y->line;
+
+	if (YENC_DPEDANTIC) LOGGER_log("%s:%d:%s:DEBUG: Read line:\n%s",FL,__func__,buf);
+
+	if (y->state == YENC_INLINE_YPART)
+	{
+		if ((y->part > 0)&&(strncmp(buf, "=ypart ", 7) == 0))
+		{
+			char *p = YENC_param(buf, "begin=");
+			size_t begin = (p)?strtoul(p, NULL, 10):1;
+
+			YENC_part_start(y, (begin > 0)?begin -1:0);
+			return;
+		}
+
+		// Single part posts go straight into their data
+		if (y->part == 0) YENC_part_start(y, 0);
+		else
+		{
+			LOGGER_log("%s:%d:%s:WARNING: yEnc part %d of '%s' has no =ypart line",FL,__func__, y->part, y->name);
+			y->state = YENC_INLINE_SEEK;
+		}
+	}
+
+	if ((y->state == YENC_INLINE_DATA)&&(buf[0] == '=')&&(buf[1] == 'y'))
+	{
+		if (strncmp(buf, "=yend", 5) == 0)
+		{
+			YENC_part_end(y, buf);
+			return;
+		}
+		if (strncmp(buf, "=ybegin ", 8) == 0) YENC_part_end(y, NULL);
+	}
+
+	if (y->state == YENC_INLINE_SEEK)
+	{
+		if (strncmp(buf, "=ybegin ", 8) == 0) YENC_begin(y, buf);
+		return;
+	}
+
+	YENC_data(y, buf, strcspn(buf, "\r\n"));
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_inline_init
+  Returns Type	: int
+  ----Parameter List
+  1. struct YENC_inline *y, state to set up
+  2. unpack file metadata
+  3. related MIME headers
+  ------------------
+  Exit Codes	: 0
+  Comments:
+  As UUENCODE_inline_init(), the part decoders hand what they decode
+  to YENC_inline_write() as they go.
+  \------------------------------------------------------------------*/
+int YENC_inline_init( struct YENC_inline *y, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo )
+{
+	y->state = YENC_INLINE_SEEK;
+	y->skip_line = 0;
+	y->found = 0;
+	y->filecount = 0;
+	y->unpack_metadata = unpack_metadata;
+	y->hinfo = hinfo;
+	y->file = NULL;
+	y->piece = NULL;
+	y->linelen = 0;
+	y->wbcount = 0;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_inline_write
+  Returns Type	: int
+  ----Parameter List
+  1. struct YENC_inline *y,
+  2. const char *buf, next piece of the decoded part
+  3. size_t len,
+  ------------------
+  Exit Codes	: 0
+  Comments:
+  Split up into lines as for UUENCODE_inline_write(); lines which can
+  not be a =ybegin are passed over while none is open.
+  \------------------------------------------------------------------*/
+int YENC_inline_write( struct YENC_inline *y, const char *buf, size_t len )
+{
+	if (glb.decode == 0) return 0;
+
+	while (len > 0)
+	{
+		const char *eol = memchr(buf, '\n', len);
+		size_t take = (eol)?(size_t)(eol -buf +1):len;
+		size_t room;
+
+		if ((y->linelen == 0)&&(y->state == YENC_INLINE_SEEK)&&(y->skip_line == 0))
+		{
+			if (*buf != '=') y->skip_line = 1;
+		}
+
+		if (y->skip_line)
+		{
+			if (eol) y->skip_line = 0;
+			buf += take;
+			len -= take;
+			continue;
+		}
+
+		room = sizeof(y->line) -2 -y->linelen;
+		if (take > room)
+		{
+			take = room;
+			eol = NULL;
+		}
+
+		memcpy(y->line +y->linelen, buf, take);
+		y->linelen += take;
+		buf += take;
+		len -= take;
+
+		if ((eol)||(y->linelen >= (int)sizeof(y->line) -2))
+		{
+			y->line[y->linelen] = '\0';
+			y->linelen = 0;
+			YENC_inline_line(y);
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_inline_done
+  Returns Type	: int
+  ----Parameter List
+  1. struct YENC_inline *y,
+  ------------------
+  Exit Codes	: the number of files completed
+  Comments:
+  A part cut short keeps what it had; the rest of a multipart file may
+  yet come in a later part of the same mailpack, see YENC_flush().
+  \------------------------------------------------------------------*/
+int YENC_inline_done( struct YENC_inline *y )
+{
+	// A last line without a line break
+	if (y->linelen > 0)
+	{
+		y->line[y->linelen] = '\0';
+		y->linelen = 0;
+		YENC_inline_line(y);
+	}
+
+	if (y->state == YENC_INLINE_DATA) YENC_part_end(y, NULL);
+	y->state = YENC_INLINE_SEEK;
+
+	if (YENC_DNORMAL) LOGGER_log("%s:%d:%s:DEBUG: Completed, %d files",FL,__func__, y->filecount);
+
+	return y->filecount;
+}
+
+/*-----------------------------------------------------------------\
+  Function Name	: YENC_flush
+  Returns Type	: int
+  ----Parameter List
+  1. void ,
+  ------------------
+  Exit Codes	: the number of partial files written out
+  Comments:
+  Called at the end of each top-level mailpack.  Files still missing
+  parts are written out with as much of the front of them as arrived,
+  so a multipart post is only put back together when all its parts
+  are in the one mailpack, such as a mailbox.  Posted in separate
+  mails (ripMIME -i <dir>, or one RIPMIME_feed() run per mail), the
+  file is cut short after the first mail and the parts in later mails
+  are dropped.
+  \------------------------------------------------------------------*/
+int YENC_flush( void )
+{
+	int count = 0;
+
+	while (glb.files != NULL)
+	{
+		struct YENC_file *f = glb.files;
+
+		LOGGER_log("%s:%d:%s:WARNING: yEnc file '%s' is incomplete, %lu of %lu bytes",FL,__func__, f->name, (unsigned long)f->written, (unsigned long)f->size);
+		count += YENC_file_close(f);
+	}
+
+	return count;
+}
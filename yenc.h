@@ -0,0 +1,55 @@
+
+#ifndef YENC_H
+#define YENC_H
+
+#define YENC_LINE_MAX			1024
+#define YENC_WRITE_BUFFER_SIZE	8192
+
+#define YENC_INLINE_SEEK	0		// looking for a =ybegin line
+#define YENC_INLINE_YPART	1		// =ybegin of a part seen, the =ypart line is next
+#define YENC_INLINE_DATA	2		// decoding a file or part
+
+struct YENC_file;
+struct YENC_piece;
+
+/* State for decoding yEnc files out of a part while it is being decoded
+ * itself, see YENC_inline_write() */
+struct YENC_inline {
+	int state;
+	int skip_line;			// rest of the current line cannot hold a =ybegin
+	int found;				// =ybegin lines seen
+	int filecount;			// files completed
+	RIPMIME_output *unpack_metadata;
+	struct MIMEH_header_info *hinfo;
+
+	char name[ _MIMEH_FILENAMELEN_MAX +1 ];	// from the =ybegin line
+	size_t size;			// whole file size, from =ybegin
+	int part;				// part number, 0 for a single part post
+	int total;
+
+	struct YENC_file *file;	// the file this part belongs to
+	struct YENC_piece *piece;	// where an out-of-order part is collected, else NULL
+	size_t part_offset;		// where this part goes in the file
+	size_t part_size;		// bytes decoded in this part so far
+	unsigned int part_crc;
+	int escape;				// an '=' was the last thing seen
+
+	char line[ YENC_LINE_MAX ];
+	int linelen;
+	unsigned char writebuffer[ YENC_WRITE_BUFFER_SIZE ];
+	int wbcount;
+};
+
+int YENC_init( void );
+int YENC_set_debug( int level );
+int YENC_set_verbosity( int level );
+int YENC_set_verbosity_contenttype( int level );
+int YENC_set_decode( int level );
+int YENC_set_filename_report_fn( int (*ptr_to_fn)(char *, char *) );
+
+int YENC_inline_init( struct YENC_inline *y, RIPMIME_output *unpack_metadata, struct MIMEH_header_info *hinfo );
+int YENC_inline_write( struct YENC_inline *y, const char *buf, size_t len );
+int YENC_inline_done( struct YENC_inline *y );
+int YENC_flush( void );
+
+#endif